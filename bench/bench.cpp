@@ -0,0 +1,321 @@
+// Microbenchmarks of the per-packet primitives. Build with `make bench`, run ./LoRaPktFwrdBench
+// and compare the ns/op and allocs/op columns (or the JSON output) between releases.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+
+#include <unistd.h>
+
+#include "smtUdpPacketForwarder/version.h"
+#include "smtUdpPacketForwarder/UdpUtils.h"
+#include "smtUdpPacketForwarder/TimeUtils.h"
+#include "smtUdpPacketForwarder/gpsTimestampUtils/GpsTimestampUtils.h"
+#include "smtUdpPacketForwarder/base64/base64.h"
+#include "smtUdpPacketForwarder/base64/base64_simd.h"
+#include "smtUdpPacketForwarder/rapidjson/stringbuffer.h"
+#include "smtUdpPacketForwarder/rapidjson/prettywriter.h"
+
+// {{{ time base and allocation counting
+static const auto benchEpoch = std::chrono::steady_clock::now();
+
+unsigned int micros() {
+  return (unsigned int) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - benchEpoch).count();
+}
+
+unsigned int millis() {
+  return micros() / 1000;
+}
+
+static std::atomic<uint64_t> allocations{0};
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void *ptr, size_t size);
+
+extern "C" void* malloc(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void *ptr, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+// }}}
+
+typedef struct BenchResult {
+  std::string name;
+  uint64_t iterations;
+  double ns_per_op;
+  double allocs_per_op;
+} BenchResult_t;
+
+static double minBenchSeconds = 0.5;
+static std::vector<BenchResult_t> results;
+
+static void runBench(const char *name, const std::function<void()> &op) { // {{{
+  // warm up, then grow the iteration count until the run is long enough to trust
+  for (int i = 0; i < 100; ++i) op();
+
+  uint64_t iterations = 1000;
+  for (;;) {
+    uint64_t allocsBefore = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t i = 0; i < iterations; ++i) op();
+
+    double elapsedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    uint64_t allocs = allocations.load() - allocsBefore;
+
+    if (elapsedNs >= minBenchSeconds * 1e9 || iterations >= (1ULL << 32)) {
+      results.push_back(BenchResult_t{name, iterations, elapsedNs / iterations, (double) allocs / iterations});
+      printf("%-40s %12llu %12.1f %10.2f\n", name, (unsigned long long) iterations, elapsedNs / iterations,
+        (double) allocs / iterations);
+      fflush(stdout);
+      return;
+    }
+
+    iterations *= (elapsedNs < minBenchSeconds * 1e8 ? 10 : 2);
+  }
+} // }}}
+
+static void drainQueue(Direction direction) { // {{{
+  while (DequeuePacket(direction).data_len > 0);
+} // }}}
+
+static void benchQueueContention() { // {{{
+  // one producer thread against the consumer, like the radio thread and the network worker
+  const uint64_t packets = 2000000;
+
+  uint64_t allocsBefore = allocations.load();
+  auto start = std::chrono::steady_clock::now();
+
+  std::thread producer([packets]() {
+    for (uint64_t i = 0; i < packets; ) {
+      if (GetPacketQueueStats(UP_TX).depth >= PrioritySettings_t().depths[PRIORITY_NORMAL] - 1) {
+        std::this_thread::yield();
+        continue;
+      }
+      EnqueueFanOut(PKT_PUSH_DATA, AcquirePacketBuffer(), 64, UPLINK_PUSH, UP_TX, PRIORITY_NORMAL);
+      ++i;
+    }
+  });
+
+  for (uint64_t received = 0; received < packets; ) {
+    PackagedDataToSend_t packet{DequeuePacket(UP_TX)};
+    if (packet.data_len > 0) ++received;
+    else std::this_thread::yield();
+  }
+  producer.join();
+
+  double elapsedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  uint64_t allocs = allocations.load() - allocsBefore;
+
+  results.push_back(BenchResult_t{"EnqueueDequeue/contended", packets, elapsedNs / packets, (double) allocs / packets});
+  printf("%-40s %12llu %12.1f %10.2f\n", "EnqueueDequeue/contended", (unsigned long long) packets,
+    elapsedNs / packets, (double) allocs / packets);
+
+  // the eventfd counter isn't of interest here
+  uint64_t signalled;
+  while (read(PacketQueueEventFd(), &signalled, sizeof(signalled)) > 0);
+} // }}}
+
+static bool writeResults(const char *path) { // {{{
+  rapidjson::StringBuffer sb;
+  rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  writer.String("version");
+  writer.String(GIT_VER);
+  writer.String("timestamp");
+  writer.Int64((int64_t) std::time(nullptr));
+  writer.String("benchmarks");
+  writer.StartArray();
+  for (const BenchResult_t &result : results) {
+    writer.StartObject();
+    writer.String("name");
+    writer.String(result.name.c_str());
+    writer.String("iterations");
+    writer.Uint64(result.iterations);
+    writer.String("ns_per_op");
+    writer.Double(result.ns_per_op);
+    writer.String("allocs_per_op");
+    writer.Double(result.allocs_per_op);
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.EndObject();
+
+  FILE *out = fopen(path, "w");
+  if (out == nullptr) {
+    perror(path);
+    return false;
+  }
+  fprintf(out, "%s\n", sb.GetString());
+  fclose(out);
+  return true;
+} // }}}
+
+int main(int argc, char **argv) {
+  const char *outputPath = "bench.json";
+  const char *filter = nullptr;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "o:f:t:h")) != -1) {
+    switch (opt) {
+      case 'o':
+        outputPath = optarg;
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      case 't':
+        minBenchSeconds = atof(optarg);
+        break;
+      case 'h':
+      default:
+        fprintf(stderr, "Usage:\n%s [-h] [-o bench.json] [-f name_filter] [-t min_seconds]\n"
+            "  -o writes the results as JSON to that file (by default bench.json)\n"
+            "  -f runs only the benchmarks whose name contains the filter\n"
+            "  -t minimum duration of each benchmark in seconds (by default 0.5)\n", argv[0]);
+        exit(opt == 'h' ? 0 : EXIT_FAILURE);
+    }
+  }
+
+  auto selected = [filter](const char *name) { return filter == nullptr || strstr(name, filter) != nullptr; };
+
+  PlatformInfo_t cfg{};
+  cfg.lora_chip_settings.coding_rate = CR_4_5;
+  cfg.latitude = 42.69f;
+  cfg.longtitude = 23.32f;
+  cfg.altitude_meters = 550;
+  strcpy(cfg.platform_definition, "1chan_uplink_pkt_fwd");
+  strcpy(cfg.platform_email, "contact@email.com");
+  strcpy(cfg.platform_description, "OPiPC LoRa 1-Ch GW");
+  cfg.servers.push_back(Server_t{});
+  RegisterServers(cfg.servers);
+
+  uint8_t payload[51];
+  for (size_t i = 0; i < sizeof(payload); ++i) payload[i] = (uint8_t) (i * 37);
+
+  LoRaDataPkt_t uplink{};
+  uplink.msg = payload;
+  uplink.msg_sz = sizeof(payload);
+  uplink.SNR = 7.25f;
+  uplink.RSSI = -87.0f;
+  uplink.freq_mhz = 868.1;
+  uplink.bandwidth_khz = 125.0;
+  uplink.internal_recv_ts_us = 123456789;
+  uplink.sf = SF7;
+
+  LoRaPacketTrafficStats_t trafficStats{};
+  trafficStats.recv_packets = 1234;
+  trafficStats.recv_packets_crc_good = 1200;
+  trafficStats.forw_packets = 1200;
+  trafficStats.acked_forw_packets = 1180;
+
+  char b64[BASE64_MAX_LENGTH];
+  bin_to_b64(payload, sizeof(payload), b64, sizeof(b64));
+
+  // far enough ahead to stay a valid future tmst for the whole run
+  char txpk[512];
+  int txpkLen = snprintf(txpk, sizeof(txpk),
+    "{\"txpk\":{\"imme\":false,\"tmst\":%u,\"freq\":868.1,\"rfch\":0,\"powe\":14,\"modu\":\"LORA\","
+    "\"datr\":\"SF7BW125\",\"codr\":\"4/5\",\"ipol\":true,\"size\":%u,\"data\":\"%s\"}}",
+    micros() + 600000000U, (unsigned) sizeof(payload), b64);
+
+  printf("base64 kernel: %s\n\n", b64_kernel_name());
+  printf("%-40s %12s %12s %10s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+
+  if (selected("PublishLoRaUplinkProtocolPacket"))
+    runBench("PublishLoRaUplinkProtocolPacket", [&]() {
+      PublishLoRaUplinkProtocolPacket(cfg, uplink);
+      drainQueue(UP_TX);
+    });
+
+  if (selected("PublishStatProtocolPacket"))
+    runBench("PublishStatProtocolPacket", [&]() {
+      PublishStatProtocolPacket(cfg, trafficStats);
+      drainQueue(UP_TX);
+    });
+
+  if (selected("DownlinkTxJsonToPacket"))
+    runBench("DownlinkTxJsonToPacket", [&]() {
+      DownlinkPacket_t result;
+      const char *txAckError;
+      DownlinkTxJsonToPacket(txpk, txpkLen, 2000000, result, &txAckError);
+    });
+
+  // a typical and the largest LoRa payload, through the selected base64 kernel and the reference code
+  uint8_t maxPayload[255];
+  for (size_t i = 0; i < sizeof(maxPayload); ++i) maxPayload[i] = (uint8_t) (i * 91 + 7);
+
+  struct { const uint8_t *data; int size; } b64Inputs[] = { { payload, sizeof(payload) }, { maxPayload, sizeof(maxPayload) } };
+  char b64Buffer[400];
+  uint8_t binBuffer[256];
+
+  for (int reference = 0; reference <= 1; ++reference) {
+    b64_kernel_disable(reference);
+
+    for (const auto &input : b64Inputs) {
+      std::string suffix = "/" + std::to_string(input.size) + "B" + (reference ? "/reference" : "");
+      int encodedLen = bin_to_b64(input.data, input.size, b64Buffer, sizeof(b64Buffer));
+
+      std::string encodeName = "bin_to_b64" + suffix;
+      if (selected(encodeName.c_str()))
+        runBench(encodeName.c_str(), [&]() {
+          bin_to_b64(input.data, input.size, b64Buffer, sizeof(b64Buffer));
+        });
+
+      std::string decodeName = "b64_to_bin" + suffix;
+      if (selected(decodeName.c_str()))
+        runBench(decodeName.c_str(), [&]() {
+          b64_to_bin(b64Buffer, encodedLen, binBuffer, sizeof(binBuffer));
+        });
+    }
+  }
+  b64_kernel_disable(0);
+
+  if (selected("iso8601_utc_extended_now"))
+    runBench("iso8601_utc_extended_now", [&]() {
+      struct timeval now;
+      char iso[28];
+      gettimeofday(&now, nullptr);
+      iso8601_utc_extended_now(&now, iso, sizeof(iso));
+    });
+
+  volatile long double sink = 0;
+  if (selected("unix2gps"))
+    runBench("unix2gps", [&]() { sink = unix2gps(1700000000.0L, false); });
+
+  if (selected("gps2unix"))
+    runBench("gps2unix", [&]() { sink = gps2unix(1384035218.0L, false); });
+
+  if (selected("compute_rf_tx_timestamp_correction_us"))
+    runBench("compute_rf_tx_timestamp_correction_us", [&]() {
+      sink = compute_rf_tx_timestamp_correction_us(0, sizeof(payload), SF7, 125, CR_4_5, true, false, 2000000);
+    });
+
+  if (selected("EnqueueDequeue"))
+    benchQueueContention();
+
+  // the PULL_DATA eventfd writes of the publish benchmarks have piled up, they're irrelevant
+  uint64_t signalled;
+  while (read(PacketQueueEventFd(), &signalled, sizeof(signalled)) > 0);
+
+  return (writeResults(outputPath) ? 0 : 1);
+}
@@ -2,11 +2,13 @@
         #define LINUX
 #endif
 
+#include <algorithm>
 #include <cstdio>
 #include <ctime>
 #include <csignal>
 #include <functional>
 #include <map>
+#include <set>
 #include <string>
 #include <thread>
 #include <typeinfo>
@@ -15,6 +17,7 @@
 #include <linux/limits.h>
 
 #include <sys/resource.h>
+#include <sys/epoll.h>
 #include <sched.h>
 
 #include <RadioLib.h>
@@ -22,7 +25,11 @@
 #include "smtUdpPacketForwarder/version.h"
 #include "smtUdpPacketForwarder/ConfigFileParser.h"
 #include "smtUdpPacketForwarder/UdpUtils.h"
+#include "smtUdpPacketForwarder/HostResolver.h"
+#include "smtUdpPacketForwarder/UplinkSpool.h"
 #include "smtUdpPacketForwarder/Radio.h"
+#include "smtUdpPacketForwarder/DownlinkScheduler.h"
+#include "smtUdpPacketForwarder/SfScanPlanner.h"
 #include "smtUdpPacketForwarder/TimeUtils.h"
 
 extern char **environ;
@@ -68,91 +75,181 @@ void appIntubator(char* const argv[]) { // {{{
 } // }}}
 
 void networkPacketExchangeWorker(LoRaPacketTrafficStats_t *loraPacketStats,
-                                std::vector<Server_t> *servers) { // {{{
+                                std::vector<Server_t> *servers, const LoRaChipSettings_t *chipSettings) { // {{{
+
+  std::function<bool(char*, int, DownlinkPacket_t&, char*, int*)> isValidDownlinkPkt =
+    [chipSettings](char *origMsg, int origMsgSz, DownlinkPacket_t &decoded,
+                   char* respErrorJsonMsg, int *maxRespErrorJsonMsgSz) { // {{{
+        // Invalid packet or payload. Send vague, but compliant response
+        const char *txAckError = "COLLISION_BEACON";
 
-  static std::function<bool(char*, int, char*, int)> isValidUplinkAck =
-    [](char* origMsg, int origMsgSz, char* respMsg, int respMsgSz) { // {{{
-        if (origMsg != nullptr && origMsgSz > 4 && respMsg != nullptr && respMsgSz >= 4) {
-          return origMsg[0] == respMsg[0] && origMsg[1] == respMsg[1] &&
-                    origMsg[2] == respMsg[2] && (respMsg[3] == PKT_PUSH_ACK || respMsg[3] == PKT_PULL_ACK);
-        }
-        return false;
-  }; // }}}
-  static std::function<bool(char*, int, char*, int*)> isValidDownlinkPkt =
-    [](char *origMsg, int origMsgSz, char* respErrorJsonMsg, int *maxRespErrorJsonMsgSz) { // {{{
         if (origMsg != nullptr && origMsgSz > 15 && origMsg[0] == PROTOCOL_VERSION &&
-            origMsg[3] == PKT_PULL_RESP)
+            origMsg[3] == PKT_PULL_RESP &&
+            DownlinkTxJsonToPacket(origMsg + 4, origMsgSz - 4, chipSettings->spi_speed_hz, decoded, &txAckError))
         {
           //strncpy(respErrorJsonMsg, "NONE", *maxRespErrorJsonMsgSz); // no need
           //*maxRespErrorJsonMsgSz = 4;
           *maxRespErrorJsonMsgSz = 0;
           return true;
         }
-        else
-        {
-          // Invalid packet or payload. Send vague, but compliant response
-          strncpy(respErrorJsonMsg, "COLLISION_BEACON", *maxRespErrorJsonMsgSz);
-          *maxRespErrorJsonMsgSz = strlen(respErrorJsonMsg);
-        }
+
+        strncpy(respErrorJsonMsg, txAckError, *maxRespErrorJsonMsgSz);
+        *maxRespErrorJsonMsgSz = strlen(respErrorJsonMsg);
 
         return false;
   }; // }}}
 
-  struct TxPacket { // {{{
-    PackagedDataToSend_t packet;
-    Direction direction;
-
-    TxPacket(PackagedDataToSend_t&& pkt, Direction directn) : packet(std::move(pkt)), direction(directn)
-    { }
+  std::function<void(PackagedDataToSend_t&, Direction)> onAcked =
+    [loraPacketStats](PackagedDataToSend_t &packet, Direction direction) { // {{{
+        if (direction == UP_TX && packet.data_type == UPLINK_PUSH)
+        { loraPacketStats->acked_forw_packets += packet.frames; }
+  }; // }}}
+  static std::function<void(PackagedDataToSend_t&&, Direction, const char*)> requeueFailed =
+    [](PackagedDataToSend_t &&packet, Direction direction, const char *reason) { // {{{
+        time_t currTime{std::time(nullptr)};
+        char asciiTime[25];
+        ts_asciitime(currTime, asciiTime, sizeof(asciiTime));
+        printf("(%s) %s the %s packet to %s\n", asciiTime, reason, (direction == UP_TX ? "uplink" : "downlink fetch request"),
+          PacketDestination(packet).address.c_str());
+        if (RequeuePacket(std::move(packet), direction))
+        { printf("(%s) Scheduled a retry of the %s packet.\n", asciiTime, (direction == UP_TX ? "uplink" : "downlink fetch request")); }
+        else if (direction == UP_TX && packet.data_type == UPLINK_PUSH &&
+                 SpoolUplink(PacketDestination(packet), packet.body.data(), packet.data_len - PROTOCOL_HEADER_SIZE))
+        { printf("(%s) Spooled the uplink packet (%u spooled).\n", asciiTime, GetUplinkSpoolStats().records); }
+        fflush(stdout);
   }; // }}}
+  std::function<void(PackagedDataToSend_t&&, Direction)> onAckTimeout =
+    [](PackagedDataToSend_t &&packet, Direction direction) {
+        requeueFailed(std::move(packet), direction, "No ACK received for");
+  };
+  // the server is cut off, its uplinks wait in the spool until it answers the probes again
+  std::function<void(PackagedDataToSend_t&&, Direction)> onRefused =
+    [](PackagedDataToSend_t &&packet, Direction direction) {
+        if (direction == UP_TX && packet.data_type == UPLINK_PUSH)
+        { SpoolUplink(PacketDestination(packet), packet.body.data(), packet.data_len - PROTOCOL_HEADER_SIZE); }
+  };
+
+  const Direction txDirections[] = { UP_TX, DOWN_TX };
+
+  // one event loop for all sockets; the eventfd is signalled on each enqueued packet
+  const uint64_t queueEventTag = UINT64_MAX;
+
+  int epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd == -1) Die("epoll_create1");
+
+  auto watch = [epollFd](int fd, uint64_t tag) {
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) Die("epoll_ctl");
+  };
+
+  // the servers share their uplink socket, so that one is watched once
+  std::set<int> watchedSockets;
+  for (size_t i = 0; i < servers->size(); ++i)
+  {
+    if (watchedSockets.insert((*servers)[i].uplink_network_cfg.socket).second)
+    { watch((*servers)[i].uplink_network_cfg.socket, i << 1); }
+    watch((*servers)[i].downlink_network_cfg.socket, (i << 1) | 1);
+  }
+  watch(PacketQueueEventFd(), queueEventTag);
 
   char downlinkMsg[RX_BUFF_DOWN_SIZE];
-  bool iterateImmediately;
-  do
+  struct epoll_event events[16];
+
+  std::vector<PackagedDataToSend_t> batch;
+  batch.reserve(SEND_BATCH_MAX);
+
+  int replayTimeoutMs = -1;
+
+  while (keepRunning)
   {
-    iterateImmediately = false;
-    for (auto it = servers->begin(); it != servers->end(); ++it)
+    int timeoutMs = NextPendingAckTimeoutMs();
+    for (int timeout : { replayTimeoutMs, NextRetryTimeoutMs() })
+    { if (timeout >= 0 && (timeoutMs < 0 || timeout < timeoutMs)) timeoutMs = timeout; }
+
+    int eventsCount = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), timeoutMs);
+    if (eventsCount == -1)
     {
-      bool received = RecvUdp(*it, downlinkMsg, sizeof(downlinkMsg), isValidDownlinkPkt);
-      if (received)
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < eventsCount; ++i)
+    {
+      uint64_t tag = events[i].data.u64;
+
+      if (tag == queueEventTag)
       {
-        ++(loraPacketStats->downlink_recv_packets);
-        iterateImmediately = true;
+        uint64_t signalled;
+        while (read(PacketQueueEventFd(), &signalled, sizeof(signalled)) > 0);
+        continue;
       }
+
+      uint16_t serverIndex = (uint16_t) (tag >> 1);
+      if (tag & 1)
+      {
+        // PULL_RESPs are handled as they arrive, whatever the uplink traffic or the other servers
+        loraPacketStats->downlink_recv_packets += RecvUdp(serverIndex, downlinkMsg, sizeof(downlinkMsg), isValidDownlinkPkt);
+      }
+      else
+      { CollectUdpAcks((*servers)[serverIndex].uplink_network_cfg.socket, onAcked); }
     }
 
-    TxPacket txPackets[] = { TxPacket{DequeuePacket(UP_TX), UP_TX}, TxPacket{DequeuePacket(DOWN_TX), DOWN_TX} };
+    // the radio thread has scheduled the downlinks of those PULL_RESPs, or found it can't
+    SendDownlinkAcks();
+
+    replayTimeoutMs = ReplaySpooledUplinks();
 
-    for (size_t i = 0; i < sizeof(txPackets) / sizeof(TxPacket); ++i)
+    // keep as many datagrams in flight as possible, the ACKs are matched by token later
+    for (Direction direction : txDirections)
     {
-       PackagedDataToSend_t& packet = txPackets[i].packet;
-       if (packet.data_len > 0)
-       {
-          Direction direction = txPackets[i].direction;
-
-          iterateImmediately = true;
-          bool result = SendUdp(packet.destination, reinterpret_cast<char*>(packet.data.get()),
-                            packet.data_len, direction, isValidUplinkAck);
-
-          if (!result)
-          {
-            time_t currTime{std::time(nullptr)};
-            char asciiTime[25];
-            ts_asciitime(currTime, asciiTime, sizeof(asciiTime));
-            printf("(%s) No %s ACK received from %s\n", asciiTime, (direction == UP_TX ? "uplink" : "downlink fetch request"),
-              packet.destination.address.c_str());
-            if (RequeuePacket(std::move(packet), 4, direction))
-            { printf("(%s) Requeued the %s packet.\n", asciiTime, (direction == UP_TX ? "uplink" : "downlink fetch request")); }
-            fflush(stdout);
-          }
-          else if (direction == UP_TX && packet.data_type == UPLINK_PUSH)
-          { ++(loraPacketStats->acked_forw_packets); }
-       }
+      while (PendingAcksCount() < MAX_PENDING_ACKS)
+      {
+        size_t room = std::min((size_t) SEND_BATCH_MAX, (size_t) (MAX_PENDING_ACKS - PendingAcksCount()));
+        while (batch.size() < room)
+        {
+          PackagedDataToSend_t packet{DequeuePacket(direction)};
+          if (packet.data_len == 0) break;
+          batch.push_back(std::move(packet));
+        }
+        if (batch.empty()) break;
+
+        size_t batched = batch.size();
+        SendUdpBatchAsync(batch, direction, onRefused);
+
+        // the ones left in the batch have not been sent, those only waiting for a pending ACK slot
+        // of their server are already back in its queue
+        bool failed = !batch.empty();
+        for (PackagedDataToSend_t &packet : batch)
+        { requeueFailed(std::move(packet), direction, "Failed sending"); }
+        batch.clear();
+
+        if (failed || batched < room) break;
+      }
     }
 
-    if (!iterateImmediately && keepRunning) std::this_thread::sleep_for(std::chrono::milliseconds(50));
-  } while (keepRunning);
+    ExpirePendingAcks(onAckTimeout);
+  }
 
+  // what hasn't been acknowledged yet would be lost with the process
+  if (UplinkSpoolEnabled())
+  {
+    std::function<void(PackagedDataToSend_t&&, Direction)> spoolUnacked =
+      [](PackagedDataToSend_t &&packet, Direction direction) {
+          if (direction == UP_TX && packet.data_type == UPLINK_PUSH)
+          { SpoolUplink(PacketDestination(packet), packet.body.data(), packet.data_len - PROTOCOL_HEADER_SIZE); }
+    };
+    ReleasePendingAcks(spoolUnacked);
+    ReleaseRetries(spoolUnacked);
+    for (PackagedDataToSend_t packet{DequeuePacket(UP_TX)}; packet.data_len > 0; packet = DequeuePacket(UP_TX))
+    { spoolUnacked(std::move(packet), UP_TX); }
+
+    printf("%u uplink packets spooled\n", GetUplinkSpoolStats().records);
+  }
+
+  close(epollFd);
 } // }}}
 
 PlatformInfo_t loadConfig(int argc, char **argv, const char **confFile, bool *useIntubator,
@@ -213,12 +310,26 @@ int main(int argc, char **argv) {
   PlatformInfo_t cfg = loadConfig(argc, argv, &configFilePath, &useIntubator,
                             networkIfaceName, sizeof(networkIfaceName) - 1);
 
+  // all servers share one uplink socket, a PUSH_DATA goes out to each of them with a single sendmmsg;
+  // the downlink ones stay apart since each server answers a PULL_DATA on the socket it came from
+  NetworkConf_t uplinkNetworkCfg = PrepareNetworking(networkIfaceName, gatewayId);
+
   for (auto &serv : cfg.servers) {
-    serv.uplink_network_cfg =
-       PrepareNetworking(networkIfaceName, serv.receive_timeout_ms * 1000, gatewayId);
-    serv.downlink_network_cfg =
-       PrepareNetworking(networkIfaceName, serv.receive_timeout_ms * 1000, gatewayId);
+    serv.uplink_network_cfg = uplinkNetworkCfg;
+    serv.downlink_network_cfg = PrepareNetworking(networkIfaceName, gatewayId);
   }
+  RegisterServers(cfg.servers);
+  SetRetransmissionSettings(cfg.retransmission);
+  SetPriorityClasses(cfg.priority_classes);
+  SetUplinkCoalescing(cfg.uplink_coalescing);
+  PacketBufferPoolSetup(cfg.packet_buffers);
+
+  if (!cfg.uplink_spool.path.empty() && !OpenUplinkSpool(cfg.uplink_spool))
+  { printf("Carrying on without the uplink spool\n"); }
+
+  std::vector<std::string> hostnames;
+  for (auto &serv : cfg.servers) hostnames.push_back(serv.address);
+  StartHostResolver(hostnames);
 
   if (!SetGatewayIdentifier(cfg, gatewayId))
   {
@@ -231,7 +342,7 @@ int main(int argc, char **argv) {
     SPI_MODE0, cfg.lora_chip_settings.spi_channel, cfg.lora_chip_settings.spi_port};
   SPI.beginTransaction(spiSettings);
 
-  PhysicalLayer* lora = instantiateLoRaChip(cfg.lora_chip_settings, SPI, spiSettings);
+  ChipAdapter* lora = instantiateLoRaChip(cfg.lora_chip_settings, SPI, spiSettings);
 
   uint16_t state = RADIOLIB_ERR_NONE + 1;
 
@@ -250,6 +361,12 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  bool interruptDrivenRx = setupLoRaRxEdgeEvents(lora, cfg);
+  if (interruptDrivenRx) printf("Using interrupt driven continuous RX\n\n");
+
+  if (cfg.lora_chip_settings.all_spreading_factors)
+  { SfScanPlannerSetup(cfg.lora_chip_settings.bandwidth_khz, cfg.lora_chip_settings.preamble_length); }
+
   fflush(stdout);
 
 
@@ -267,8 +384,10 @@ int main(int argc, char **argv) {
   const uint16_t delayIntervalMs = 20;
   const uint32_t sendStatPktIntervalSeconds = 20;
   const uint32_t loraChipRestIntervalSeconds = 2700;
+  const uint32_t sfScanReportIntervalSeconds = 600;
 
   time_t nextStatUpdateTime = std::time(nullptr) - 1;
+  time_t nextSfScanReportTime = nextStatUpdateTime + 1 + sfScanReportIntervalSeconds;
   time_t nextChipRestTime = nextStatUpdateTime + 1 + loraChipRestIntervalSeconds;
 
   LoRaPacketTrafficStats_t loraPacketStats={};
@@ -281,7 +400,8 @@ int main(int argc, char **argv) {
   schedPrio.sched_priority = sched_get_priority_max(SCHED_RR) - 10;
   sched_setscheduler(0, SCHED_RR, (const sched_param*) &schedPrio);
 
-  std::thread packetExchanger{networkPacketExchangeWorker, &loraPacketStats, &cfg.servers};
+  std::thread packetExchanger{networkPacketExchangeWorker, &loraPacketStats, &cfg.servers,
+    &cfg.lora_chip_settings};
   if (useIntubator) {
     std::thread intubator{appIntubator, argv};
     intubator.detach();
@@ -300,8 +420,28 @@ int main(int argc, char **argv) {
       PublishLoRaDownlinkProtocolPacket(cfg);
     }
 
+    if (cfg.lora_chip_settings.all_spreading_factors && currTime >= nextSfScanReportTime) {
+      nextSfScanReportTime = currTime + sfScanReportIntervalSeconds;
+      PrintSfScanStats(stdout);
+    }
+
     if (!keepRunning) break;
 
+    FlushCoalescedUplinks(false);
+    scheduleLoRaDownlinkData();
+
+    PackagedDataToSend_t downlinkPacket{DequeueDueDownlink(micros())};
+    if (downlinkPacket.data_len > 0) {
+      if (sendLoRaDownlinkData(lora, cfg, downlinkPacket, loraPacketStats) == LoRaRecvStat::NODATA) {
+        currTime = std::time(nullptr);
+        ts_asciitime(currTime, asciiTime, sizeof(asciiTime));
+        printf("(%s) Downlink packet has been trasmitted with success!\n", asciiTime);
+        // don't flush - there's a high chance for a subsequent uplink response
+      }
+      lastRFInteractionTime = std::time(nullptr);
+      continue;
+    }
+
     LoRaRecvStat lastRecvResult = recvLoRaUplinkData(
                         lora, cfg, loraDataPacket, msg, loraPacketStats);
 
@@ -312,16 +452,6 @@ int main(int argc, char **argv) {
     } else if (keepRunning && lastRecvResult == LoRaRecvStat::NODATA) {
       currTime = std::time(nullptr);
 
-      PackagedDataToSend_t downlinkPacket{DequeuePacket(DOWN_RX)};
-      if (downlinkPacket.data_len > 0) {
-        if (sendLoRaDownlinkData(lora, cfg, downlinkPacket, loraPacketStats) == LoRaRecvStat::NODATA) {
-          lastRFInteractionTime = currTime = std::time(nullptr);
-          ts_asciitime(currTime, asciiTime, sizeof(asciiTime));
-          printf("(%s) Downlink packet has been trasmitted with success!\n", asciiTime);
-          // don't flush - there's a high chance for a subsequent uplink response
-        }
-      }
-
       if (cfg.lora_chip_settings.pin_rest > -1 && currTime >= nextChipRestTime
              && diff_timestamps(lastRFInteractionTime, currTime) > 6) {
 
@@ -342,9 +472,12 @@ int main(int argc, char **argv) {
         } while (state != RADIOLIB_ERR_NONE);
       }
 
-      if (!cfg.lora_chip_settings.all_spreading_factors
+      // in the interrupt driven mode the radio thread already sleeps until an RxDone edge
+      if (!cfg.lora_chip_settings.all_spreading_factors && !interruptDrivenRx
             && diff_timestamps(lastRFInteractionTime, currTime) > 6) {
-        delay(delayIntervalMs);
+        // don't oversleep the next scheduled downlink
+        uint32_t downlinkDueInMs = DownlinkDueInMicros(micros()) / 1000;
+        delay(downlinkDueInMs < delayIntervalMs ? downlinkDueInMs : delayIntervalMs);
       }
     }
 
@@ -356,5 +489,10 @@ int main(int argc, char **argv) {
   printf("\n(%s) Shutting down...\n", asciiTime);
   fflush(stdout);
   SPI.endTransaction();
+  FlushCoalescedUplinks(true);
+  NotifyPacketQueue(); // wake up the packet exchanger so it could notice the shutdown
   packetExchanger.join();
+  StopHostResolver();
+  CloseUplinkSpool();
+  delete lora;
 }
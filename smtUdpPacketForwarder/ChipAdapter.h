@@ -0,0 +1,252 @@
+#ifndef LORA_PF_CHIP_ADAPTER_H
+#define LORA_PF_CHIP_ADAPTER_H
+
+#include <cstdint>
+#include <RadioLib.h>
+#include <PhysicalLayer/PhysicalLayer.h>
+#include "config.h"
+
+// shadow of the modem parameters the chip is currently configured with
+typedef struct RadioModemState {
+  bool valid = false;
+  bool fsk = false;
+
+  float carrier_frequency_mhz = 0;
+  float bandwidth_khz = 0;
+  uint8_t spreading_factor = 0;
+  uint8_t coding_rate = 0;
+  bool iq_polatization_inversion = false;
+  bool crc = true;
+  int8_t output_power_dbm = 0;
+  uint16_t preamble_length = 0;
+} RadioModemState_t;
+
+// Chip specific operations, resolved once when the chip gets instantiated,
+// so the hot paths need a single indirect call instead of RTTI lookups.
+// Everything the forwarder does with the radio goes through here.
+class ChipAdapter
+{
+  public:
+    virtual ~ChipAdapter() { }
+
+    virtual int16_t receive(uint8_t *data, size_t len) = 0;
+    virtual int16_t readData(uint8_t *data, size_t len) = 0;
+    virtual size_t getPacketLength() = 0;
+    virtual int16_t startTransmit(uint8_t *data, size_t len) = 0;
+    virtual int16_t standby() = 0;
+
+    virtual void reset(RADIOLIB_PIN_TYPE reset_pin) = 0;
+    virtual int16_t begin(const LoRaChipSettings_t &settings, int8_t power, uint8_t current_limit_ma, uint8_t gain) = 0;
+    virtual int16_t beginForTx(const LoRaChipSettings_t &settings, const DownlinkPacket_t &downlink_pkt,
+                               uint8_t current_limit_ma, uint8_t gain) = 0;
+    virtual int16_t applyModemState(RadioModemState_t &current, const RadioModemState_t &target) = 0;
+    virtual int16_t setSpreadingFactor(uint8_t sf) = 0;
+    virtual int16_t scanChannel() = 0;
+    virtual int16_t startContinuousReceive() = 0;
+    virtual void readPacketStats(LoRaDataPkt_t &pkt, float &freq_err) = 0;
+    virtual float getRSSI() = 0;
+    virtual int txDoneIrqPin(const LoRaChipSettings_t &settings) = 0;
+    virtual int rxDoneGpioLine(const LoRaChipSettings_t &settings) = 0;
+
+    RadioModemState_t modem_state;
+};
+
+template<typename ChipClass>
+class ChipAdapterBase : public ChipAdapter
+{
+  public:
+    explicit ChipAdapterBase(Module *module) : inst(new ChipClass(module))
+    { }
+
+    ~ChipAdapterBase()
+    { delete inst; }
+
+    int16_t receive(uint8_t *data, size_t len) override
+    { return inst->receive(data, len); }
+
+    int16_t readData(uint8_t *data, size_t len) override
+    { return inst->readData(data, len); }
+
+    size_t getPacketLength() override
+    { return inst->getPacketLength(false); }
+
+    int16_t startTransmit(uint8_t *data, size_t len) override
+    { return inst->startTransmit(data, len); }
+
+    int16_t standby() override
+    { return inst->standby(); }
+
+    int16_t begin(const LoRaChipSettings_t &settings, int8_t power, uint8_t current_limit_ma, uint8_t gain) override
+    {
+      int16_t result = inst->begin(settings.carrier_frequency_mhz, settings.bandwidth_khz, settings.spreading_factor,
+        settings.coding_rate, settings.sync_word, power, settings.preamble_length, gain);
+
+      if (result == RADIOLIB_ERR_NONE) result = inst->setCurrentLimit(current_limit_ma);
+      if (result == RADIOLIB_ERR_NONE) result = inst->invertIQ(false);
+      if (result == RADIOLIB_ERR_NONE) result = setCRC(true);
+
+      return result;
+    }
+
+    int16_t beginForTx(const LoRaChipSettings_t &settings, const DownlinkPacket_t &downlink_pkt,
+                       uint8_t current_limit_ma, uint8_t gain) override
+    {
+      static uint8_t gfskSyncWord[] = { 0xC1, 0x94, 0xC1 };
+      int16_t result;
+
+      if (downlink_pkt.fsk_datarate_bps == 0) {
+        result = inst->begin(downlink_pkt.carrier_frequency_mhz, downlink_pkt.bandwidth_khz,
+          downlink_pkt.spreading_factor, downlink_pkt.coding_rate, settings.sync_word,
+          (int8_t) downlink_pkt.output_power_dbm, downlink_pkt.preamble_length, gain);
+
+        if (result == RADIOLIB_ERR_NONE) result = inst->invertIQ(downlink_pkt.iq_polatization_inversion);
+        if (result == RADIOLIB_ERR_NONE) result = setCRC(!downlink_pkt.disable_crc);
+      } else {
+        result = inst->beginFSK(downlink_pkt.carrier_frequency_mhz, downlink_pkt.fsk_datarate_bps / 1000.0,
+          downlink_pkt.fsk_freq_deviation_hz / 1000.0, downlink_pkt.bandwidth_khz,
+          (int8_t) downlink_pkt.output_power_dbm, downlink_pkt.preamble_length, false /* don't use OOK */);
+
+        if (result == RADIOLIB_ERR_NONE) result = inst->setSyncWord(gfskSyncWord, ((uint8_t) sizeof(gfskSyncWord)));
+      }
+
+      if (result == RADIOLIB_ERR_NONE) result = inst->setCurrentLimit(current_limit_ma);
+
+      return result;
+    }
+
+    int16_t applyModemState(RadioModemState_t &current, const RadioModemState_t &target) override
+    {
+      // only the parameters that differ are written; each setter leaves the chip in standby
+      int16_t result = RADIOLIB_ERR_NONE;
+
+      if (current.carrier_frequency_mhz != target.carrier_frequency_mhz) {
+        result = inst->setFrequency(target.carrier_frequency_mhz);
+        if (result == RADIOLIB_ERR_NONE) current.carrier_frequency_mhz = target.carrier_frequency_mhz;
+      }
+      if (result == RADIOLIB_ERR_NONE && current.bandwidth_khz != target.bandwidth_khz) {
+        result = inst->setBandwidth(target.bandwidth_khz);
+        if (result == RADIOLIB_ERR_NONE) current.bandwidth_khz = target.bandwidth_khz;
+      }
+      if (result == RADIOLIB_ERR_NONE && current.spreading_factor != target.spreading_factor) {
+        result = inst->setSpreadingFactor(target.spreading_factor);
+        if (result == RADIOLIB_ERR_NONE) current.spreading_factor = target.spreading_factor;
+      }
+      if (result == RADIOLIB_ERR_NONE && current.coding_rate != target.coding_rate) {
+        result = inst->setCodingRate(target.coding_rate);
+        if (result == RADIOLIB_ERR_NONE) current.coding_rate = target.coding_rate;
+      }
+      if (result == RADIOLIB_ERR_NONE && current.iq_polatization_inversion != target.iq_polatization_inversion) {
+        result = inst->invertIQ(target.iq_polatization_inversion);
+        if (result == RADIOLIB_ERR_NONE) current.iq_polatization_inversion = target.iq_polatization_inversion;
+      }
+      if (result == RADIOLIB_ERR_NONE && current.crc != target.crc) {
+        result = setCRC(target.crc);
+        if (result == RADIOLIB_ERR_NONE) current.crc = target.crc;
+      }
+      if (result == RADIOLIB_ERR_NONE && current.output_power_dbm != target.output_power_dbm) {
+        result = inst->setOutputPower(target.output_power_dbm);
+        if (result == RADIOLIB_ERR_NONE) current.output_power_dbm = target.output_power_dbm;
+      }
+      if (result == RADIOLIB_ERR_NONE && current.preamble_length != target.preamble_length) {
+        result = inst->setPreambleLength(target.preamble_length);
+        if (result == RADIOLIB_ERR_NONE) current.preamble_length = target.preamble_length;
+      }
+
+      // a partially applied state cannot be trusted anymore
+      if (result != RADIOLIB_ERR_NONE) current.valid = false;
+
+      return result;
+    }
+
+    int16_t setSpreadingFactor(uint8_t sf) override
+    { return inst->setSpreadingFactor(sf); }
+
+    int16_t scanChannel() override
+    { return inst->scanChannel(); }
+
+    int16_t startContinuousReceive() override
+    { return inst->startReceive(); }
+
+    float getRSSI() override
+    { return inst->getRSSI(); }
+
+  protected:
+    virtual int16_t setCRC(bool enabled) = 0;
+
+    ChipClass *inst;
+};
+
+template<typename ChipClass>
+class SX127xAdapter : public ChipAdapterBase<ChipClass>
+{
+  public:
+    explicit SX127xAdapter(Module *module) : ChipAdapterBase<ChipClass>(module)
+    { }
+
+    void reset(RADIOLIB_PIN_TYPE reset_pin) override
+    {
+      this->inst->reset();
+      pinMode(reset_pin, INPUT);
+      delay(5);
+    }
+
+    void readPacketStats(LoRaDataPkt_t &pkt, float &freq_err) override
+    {
+      pkt.RSSI = this->inst->getRSSI(true);
+      pkt.SNR = this->inst->getSNR();
+      freq_err = this->inst->getFrequencyError();
+    }
+
+    int txDoneIrqPin(const LoRaChipSettings_t &settings) override
+    { return settings.pin_dio0; }
+
+    int rxDoneGpioLine(const LoRaChipSettings_t &settings) override
+    { return settings.gpio_line_dio0; }
+
+  protected:
+    int16_t setCRC(bool enabled) override
+    { return this->inst->setCRC(enabled); }
+};
+
+template<typename ChipClass>
+class SX126xAdapter : public ChipAdapterBase<ChipClass>
+{
+  public:
+    explicit SX126xAdapter(Module *module) : ChipAdapterBase<ChipClass>(module)
+    {
+      this->inst->XTAL = true;
+      this->inst->standbyXOSC = true;
+    }
+
+    void reset(RADIOLIB_PIN_TYPE reset_pin) override
+    {
+      this->inst->reset();
+      delay(5);
+    }
+
+    int16_t begin(const LoRaChipSettings_t &settings, int8_t power, uint8_t current_limit_ma, uint8_t gain) override
+    {
+      int16_t result = ChipAdapterBase<ChipClass>::begin(settings, power, current_limit_ma, gain);
+      if (result == RADIOLIB_ERR_NONE) this->inst->setRxBoostedGainMode(true);
+      return result;
+    }
+
+    void readPacketStats(LoRaDataPkt_t &pkt, float &freq_err) override
+    {
+      pkt.RSSI = this->inst->getRSSI();
+      pkt.SNR = this->inst->getSNR();
+      freq_err = 0.0f; // inst->getFrequencyError(); undocumented, not recommeded
+    }
+
+    int txDoneIrqPin(const LoRaChipSettings_t &settings) override
+    { return settings.pin_dio1; }
+
+    int rxDoneGpioLine(const LoRaChipSettings_t &settings) override
+    { return settings.gpio_line_dio1; }
+
+  protected:
+    int16_t setCRC(bool enabled) override
+    { return this->inst->setCRC(enabled ? (uint8_t) 1 : (uint8_t) 0); }
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "CircuitBreaker.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+
+#include "TimeUtils.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static void LogTransition(const Server_t &server, const char *what) // {{{
+{
+  char asciiTime[25];
+  printf("(%s) %s:%hu %s\n", ts_asciitime(std::time(nullptr), asciiTime, sizeof(asciiTime)),
+    server.address.c_str(), server.port, what);
+  fflush(stdout);
+} // }}}
+
+bool CircuitAllowsSend(Server_t &server) // {{{
+{
+  ServerHealth_t &health = server.health;
+  if (health.state == CIRCUIT_CLOSED)
+  { return true; }
+
+  Clock::time_point now = Clock::now();
+  if (now < health.next_probe)
+  { return false; }
+
+  if (health.state == CIRCUIT_OPEN)
+  {
+    health.state = CIRCUIT_HALF_OPEN;
+    LogTransition(server, "gets probed");
+  }
+
+  // the next probe once this one had the time to get its ACK
+  health.next_probe = now + std::chrono::milliseconds(2 * server.receive_timeout_ms);
+  return true;
+} // }}}
+
+void RecordCircuitSuccess(Server_t &server) // {{{
+{
+  ServerHealth_t &health = server.health;
+  health.failures = 0;
+
+  if (health.state != CIRCUIT_CLOSED)
+  {
+    health.state = CIRCUIT_CLOSED;
+    health.open_s = 0;
+    LogTransition(server, "answers again, circuit closed");
+  }
+} // }}}
+
+void RecordCircuitFailure(Server_t &server) // {{{
+{
+  ServerHealth_t &health = server.health;
+  ++health.failures;
+
+  if ((health.state == CIRCUIT_CLOSED && health.failures >= CIRCUIT_FAILURE_THRESHOLD) ||
+      health.state == CIRCUIT_HALF_OPEN)
+  {
+    health.open_s = (health.open_s == 0 ? CIRCUIT_OPEN_MIN_S : std::min(health.open_s * 2, (uint32_t) CIRCUIT_OPEN_MAX_S));
+    health.next_probe = Clock::now() + std::chrono::seconds(health.open_s);
+
+    char what[96];
+    snprintf(what, sizeof(what), "doesn't answer (%u datagrams in a row), circuit open for %u s",
+      health.failures, health.open_s);
+    health.state = CIRCUIT_OPEN;
+    LogTransition(server, what);
+  }
+} // }}}
+
+const char* CircuitStateName(CircuitState_t state) // {{{
+{
+  switch (state)
+  {
+    case CIRCUIT_CLOSED: return "closed";
+    case CIRCUIT_OPEN: return "open";
+    case CIRCUIT_HALF_OPEN: return "half open";
+  }
+  return "?";
+} // }}}
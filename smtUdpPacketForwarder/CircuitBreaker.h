@@ -0,0 +1,22 @@
+#ifndef LORA_PF_CIRCUIT_BREAKER_H
+#define LORA_PF_CIRCUIT_BREAKER_H
+
+#include "config.h"
+
+#define CIRCUIT_FAILURE_THRESHOLD 5   /* datagrams failed in a row that open the circuit */
+#define CIRCUIT_OPEN_MIN_S 10         /* before the first probe, doubled each time a probe fails */
+#define CIRCUIT_OPEN_MAX_S 300
+
+// Health of each server: once a server leaves CIRCUIT_FAILURE_THRESHOLD datagrams in a row unacknowledged (or
+// unsent), its circuit opens and nothing is sent to it anymore, so that it holds back neither the pending ACK
+// slots nor the backhaul of the others. Once in a while the circuit half opens to let a single datagram through
+// as a probe, its ACK closes the circuit again. For the network exchange thread only.
+
+// Whether a datagram may be sent to the server now; a half open circuit lets one through per ACK timeout
+bool CircuitAllowsSend(Server_t &server);
+void RecordCircuitSuccess(Server_t &server);
+void RecordCircuitFailure(Server_t &server);
+
+const char* CircuitStateName(CircuitState_t state);
+
+#endif
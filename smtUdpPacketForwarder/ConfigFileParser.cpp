@@ -1,4 +1,5 @@
 #include <regex>
+#include <algorithm>
 #include "ConfigFileParser.h"
 #include "version.h"
 
@@ -19,6 +20,9 @@ void PrintConfiguration(PlatformInfo_t &cfg)
   printf("(WiringPI) Pins:\n  nss_cs=%d\n  dio0=%d\n  dio1=%d\n  rest=%d\n\n", cfg.lora_chip_settings.pin_nss_cs,
     cfg.lora_chip_settings.pin_dio0, cfg.lora_chip_settings.pin_dio1, cfg.lora_chip_settings.pin_rest);
 
+  printf("GPIO Edge Events:\n  chip=%s\n  dio0 line=%d\n  dio1 line=%d\n\n", cfg.lora_chip_settings.gpio_chip.c_str(),
+    cfg.lora_chip_settings.gpio_line_dio0, cfg.lora_chip_settings.gpio_line_dio1);
+
 
   printf("LoRa %s Chip:\n  Freq=%f MHz\n  BW=%.3f KHz\n  SF=%d\n  CR=4/%d\n  SyncWord=0x%x\n  PreambleLength=%d\n\n",
     cfg.lora_chip_settings.ic_model.c_str(),
@@ -31,6 +35,32 @@ void PrintConfiguration(PlatformInfo_t &cfg)
 
   printf("  Name/Definition: %s\n  E-mail: %s\n  Description: %s\n\n", cfg.platform_definition,
     cfg.platform_email, cfg.platform_description);
+
+  printf("Packet Buffers: %u (%u KiB)\n\n", cfg.packet_buffers, cfg.packet_buffers * PACKET_BUFFER_SIZE / 1024);
+
+  printf("Retransmission:\n  max attempts=%u\n  max age=%u s\n  backoff=%u..%u ms\n  max rate=%u/s per server\n\n",
+    cfg.retransmission.max_attempts, cfg.retransmission.max_age_s, cfg.retransmission.backoff_min_ms,
+    cfg.retransmission.backoff_max_ms, cfg.retransmission.max_per_s);
+
+  printf("Priority Classes (%s):\n", (cfg.priority_classes.strict ? "strict" : "weighted"));
+  for (int i = 0; i < PRIORITY_CLASSES; ++i)
+  {
+    printf("  %s: depth=%u weight=%u\n", PRIORITY_CLASS_NAMES[i], cfg.priority_classes.depths[i],
+      cfg.priority_classes.weights[i]);
+  }
+  printf("\n");
+
+  if (cfg.uplink_coalescing.hold_ms > 0)
+  {
+    printf("Uplink Coalescing:\n  hold=%u ms\n  max size=%u bytes\n\n", cfg.uplink_coalescing.hold_ms,
+      cfg.uplink_coalescing.max_bytes);
+  }
+
+  if (!cfg.uplink_spool.path.empty())
+  {
+    printf("Uplink Spool:\n  path=%s\n  size=%u KiB\n  replay=%u/s\n\n", cfg.uplink_spool.path.c_str(),
+      cfg.uplink_spool.size_kb, cfg.uplink_spool.replay_per_s);
+  }
   fflush(stdout);
 }
 
@@ -90,6 +120,10 @@ PlatformInfo_t LoadConfiguration(std::string configurationFile, const char overr
   result.lora_chip_settings.pin_dio1 = doc["pin_dio1"].GetInt();
   result.lora_chip_settings.pin_rest = doc["pin_rest"].GetInt();
 
+  result.lora_chip_settings.gpio_chip = (doc.HasMember("gpio_chip") ? doc["gpio_chip"].GetString() : "/dev/gpiochip0");
+  result.lora_chip_settings.gpio_line_dio0 = (doc.HasMember("gpio_line_dio0") ? doc["gpio_line_dio0"].GetInt() : -1);
+  result.lora_chip_settings.gpio_line_dio1 = (doc.HasMember("gpio_line_dio1") ? doc["gpio_line_dio1"].GetInt() : -1);
+
   int sf = doc["spreading_factor"].GetInt();
   if (sf < SpreadingFactor_t::SF_MIN || sf > SpreadingFactor_t::SF_MAX) {
     result.lora_chip_settings.all_spreading_factors = (sf == SpreadingFactor_t::SF_ALL);
@@ -111,6 +145,27 @@ PlatformInfo_t LoadConfiguration(std::string configurationFile, const char overr
   result.lora_chip_settings.sync_word = (uint8_t) doc["sync_word"].GetUint();
   result.lora_chip_settings.preamble_length = (uint16_t) doc["preamble_length"].GetUint();
 
+  result.lora_chip_settings.sim.spreading_factor = result.lora_chip_settings.spreading_factor;
+  if (doc.HasMember("sim") && doc["sim"].IsObject()) {
+    const rapidjson::Value& sim = doc["sim"];
+    SimRadioSettings_t &simSettings = result.lora_chip_settings.sim;
+
+    if (sim.HasMember("arrival_process"))
+      simSettings.arrival_process = (strcmp(sim["arrival_process"].GetString(), "periodic") == 0 ? SIM_ARRIVAL_PERIODIC : SIM_ARRIVAL_POISSON);
+    if (sim.HasMember("mean_interval_ms")) simSettings.mean_interval_ms = sim["mean_interval_ms"].GetUint();
+    if (sim.HasMember("spreading_factor")) {
+      int simSf = sim["spreading_factor"].GetInt();
+      simSettings.spreading_factor = (simSf < SpreadingFactor_t::SF7 || simSf > SpreadingFactor_t::SF_MAX ?
+        SpreadingFactor_t::SF_ALL : static_cast<SpreadingFactor_t>(simSf));
+    }
+    if (sim.HasMember("rssi_dbm")) simSettings.rssi_dbm = (float) sim["rssi_dbm"].GetDouble();
+    if (sim.HasMember("snr_db")) simSettings.snr_db = (float) sim["snr_db"].GetDouble();
+    if (sim.HasMember("payload_size")) simSettings.payload_size = sim["payload_size"].GetUint();
+    if (sim.HasMember("crc_error_ratio")) simSettings.crc_error_ratio = (float) sim["crc_error_ratio"].GetDouble();
+    if (sim.HasMember("seed")) simSettings.seed = sim["seed"].GetUint();
+    if (sim.HasMember("tx_log_file")) simSettings.tx_log_file = sim["tx_log_file"].GetString();
+  }
+
   result.latitude = (float) doc["latitude"].GetDouble();
   result.longtitude = (float) doc["longtitude"].GetDouble();
   result.altitude_meters = doc["altitude_meters"].GetInt();
@@ -135,6 +190,55 @@ PlatformInfo_t LoadConfiguration(std::string configurationFile, const char overr
     result.servers.push_back(serv);
   }
 
+  result.packet_buffers = (doc.HasMember("packet_buffers") ? doc["packet_buffers"].GetUint() : PACKET_BUFFER_POOL_DEFAULT_SIZE);
+  if (result.packet_buffers < PACKET_BUFFER_POOL_MIN_SIZE) {
+    printf("Raising packet_buffers from %u to %u, fewer would run out with the network servers merely slow\n",
+      result.packet_buffers, PACKET_BUFFER_POOL_MIN_SIZE);
+    result.packet_buffers = PACKET_BUFFER_POOL_MIN_SIZE;
+  }
+
+  if (doc.HasMember("retransmission") && doc["retransmission"].IsObject()) {
+    const rapidjson::Value& retx = doc["retransmission"];
+    RetransmissionSettings_t &retxSettings = result.retransmission;
+
+    if (retx.HasMember("max_attempts")) retxSettings.max_attempts = retx["max_attempts"].GetUint();
+    if (retx.HasMember("max_age_s")) retxSettings.max_age_s = retx["max_age_s"].GetUint();
+    if (retx.HasMember("backoff_min_ms")) retxSettings.backoff_min_ms = retx["backoff_min_ms"].GetUint();
+    if (retx.HasMember("backoff_max_ms")) retxSettings.backoff_max_ms = retx["backoff_max_ms"].GetUint();
+    if (retx.HasMember("max_per_s")) retxSettings.max_per_s = retx["max_per_s"].GetUint();
+  }
+
+  if (doc.HasMember("priority_classes") && doc["priority_classes"].IsObject()) {
+    const rapidjson::Value& classes = doc["priority_classes"];
+    PrioritySettings_t &prioritySettings = result.priority_classes;
+
+    if (classes.HasMember("strict")) prioritySettings.strict = classes["strict"].GetBool();
+    for (int i = 0; i < PRIORITY_CLASSES; ++i) {
+      if (!classes.HasMember(PRIORITY_CLASS_NAMES[i]) || !classes[PRIORITY_CLASS_NAMES[i]].IsObject()) continue;
+
+      const rapidjson::Value& priorityClass = classes[PRIORITY_CLASS_NAMES[i]];
+      if (priorityClass.HasMember("depth")) prioritySettings.depths[i] = std::max(1U, priorityClass["depth"].GetUint());
+      if (priorityClass.HasMember("weight")) prioritySettings.weights[i] = std::max(1U, priorityClass["weight"].GetUint());
+    }
+  }
+
+  if (doc.HasMember("uplink_coalescing") && doc["uplink_coalescing"].IsObject()) {
+    const rapidjson::Value& coalescing = doc["uplink_coalescing"];
+    UplinkCoalescingSettings_t &coalescingSettings = result.uplink_coalescing;
+
+    if (coalescing.HasMember("hold_ms")) coalescingSettings.hold_ms = coalescing["hold_ms"].GetUint();
+    if (coalescing.HasMember("max_bytes")) coalescingSettings.max_bytes = coalescing["max_bytes"].GetUint();
+  }
+
+  if (doc.HasMember("uplink_spool") && doc["uplink_spool"].IsObject()) {
+    const rapidjson::Value& spool = doc["uplink_spool"];
+    UplinkSpoolSettings_t &spoolSettings = result.uplink_spool;
+
+    if (spool.HasMember("path")) spoolSettings.path = spool["path"].GetString();
+    if (spool.HasMember("size_kb")) spoolSettings.size_kb = spool["size_kb"].GetUint();
+    if (spool.HasMember("replay_per_s")) spoolSettings.replay_per_s = spool["replay_per_s"].GetUint();
+  }
+
   fclose(p_file);
 
   return result;
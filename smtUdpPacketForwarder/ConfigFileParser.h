@@ -19,6 +19,7 @@
 #include "rapidjson/writer.h"
 
 #include "config.h"
+#include "PacketBufferPool.h"
 
 PlatformInfo_t LoadConfiguration(std::string configurationFile, const char overriddenEUI[25]);
 bool SetGatewayIdentifier(PlatformInfo_t &cfg, const char identifier[25]);
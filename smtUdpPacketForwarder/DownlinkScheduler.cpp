@@ -0,0 +1,131 @@
+#include "DownlinkScheduler.h"
+#include "TimeUtils.h"
+
+#include <algorithm>
+#include <vector>
+
+typedef struct ScheduledDownlink
+{
+  PackagedDataToSend_t packet;
+  uint32_t tx_start_us;
+  uint32_t tx_end_us;
+
+  ScheduledDownlink(PackagedDataToSend_t &&pkt, uint32_t start_us, uint32_t end_us)
+    : packet(std::move(pkt)), tx_start_us(start_us), tx_end_us(end_us)
+  { }
+} ScheduledDownlink_t;
+
+// min-heap ordered by the transmission start
+static std::vector<ScheduledDownlink_t> scheduled_downlinks;
+
+static inline int32_t TsDiff(uint32_t a, uint32_t b) // {{{
+{
+  // wrap-around safe as long as both points are less than ~35 minutes apart
+  return (int32_t) (a - b);
+} // }}}
+
+static bool StartsLater(const ScheduledDownlink_t &a, const ScheduledDownlink_t &b) // {{{
+{
+  return TsDiff(a.tx_start_us, b.tx_start_us) > 0;
+} // }}}
+
+DownlinkScheduleResult_t ScheduleDownlink(PackagedDataToSend_t &&packet, uint32_t now_us) // {{{
+{
+  if (!packet.downlink() || !packet.downlink()->initialised)
+  { return DL_INVALID; }
+
+  if (scheduled_downlinks.size() >= DOWNLINK_MAX_SCHEDULED)
+  { return DL_QUEUE_FULL; }
+
+  DownlinkPacket_t &downlink = *packet.downlink();
+  if (downlink.send_immediately)
+  { downlink.internal_ts_micros = now_us; }
+
+  int32_t ahead_us = TsDiff(downlink.internal_ts_micros, now_us);
+  if (ahead_us < -((int32_t) DOWNLINK_MAX_LATENESS_US))
+  { return DL_TOO_LATE; }
+  if (ahead_us > (int32_t) DOWNLINK_MAX_ADVANCE_US)
+  { return DL_TOO_EARLY; }
+
+  uint32_t start_us = downlink.internal_ts_micros;
+  uint32_t end_us = start_us + compute_time_on_air_us(
+    downlink.fsk_datarate_bps, downlink.payload_size,
+    (downlink.spreading_factor == SF_ALL ? SF_MAX : downlink.spreading_factor),
+    downlink.bandwidth_khz, downlink.coding_rate, downlink.preamble_length, !downlink.disable_crc);
+
+  // the radio is half-duplex and has a single TX path, so overlapping windows cannot both be served
+  for (const ScheduledDownlink_t &other : scheduled_downlinks)
+  {
+    if (TsDiff(start_us, other.tx_end_us) < 0 && TsDiff(other.tx_start_us, end_us) < 0)
+    { return DL_COLLISION_PACKET; }
+  }
+
+  scheduled_downlinks.emplace_back(std::move(packet), start_us, end_us);
+  std::push_heap(scheduled_downlinks.begin(), scheduled_downlinks.end(), StartsLater);
+
+  return DL_SCHEDULED;
+} // }}}
+
+PackagedDataToSend_t DequeueDueDownlink(uint32_t now_us) // {{{
+{
+  while (!scheduled_downlinks.empty() &&
+         TsDiff(scheduled_downlinks.front().tx_start_us, now_us) <= (int32_t) DOWNLINK_TX_LEAD_US)
+  {
+    std::pop_heap(scheduled_downlinks.begin(), scheduled_downlinks.end(), StartsLater);
+    ScheduledDownlink_t due{std::move(scheduled_downlinks.back())};
+    scheduled_downlinks.pop_back();
+
+    int32_t late_us = TsDiff(now_us, due.tx_start_us);
+    if (late_us > (int32_t) DOWNLINK_MAX_LATENESS_US)
+    {
+      printf("Dropping DOWNlink packet, %s by %d us!\n", DecodeDownlinkScheduleResult(DL_TOO_LATE), late_us);
+      continue;
+    }
+
+    return std::move(due.packet);
+  }
+
+  return PackagedDataToSend_t();
+} // }}}
+
+uint32_t DownlinkDueInMicros(uint32_t now_us) // {{{
+{
+  if (scheduled_downlinks.empty())
+  { return UINT32_MAX; }
+
+  int32_t due_in_us = TsDiff(scheduled_downlinks.front().tx_start_us, now_us) - (int32_t) DOWNLINK_TX_LEAD_US;
+  return (due_in_us > 0 ? (uint32_t) due_in_us : 0U);
+} // }}}
+
+size_t ScheduledDownlinksCount() // {{{
+{
+  return scheduled_downlinks.size();
+} // }}}
+
+const char* DecodeDownlinkScheduleResult(DownlinkScheduleResult_t result) // {{{
+{
+  // the names match the TX_ACK error values of the Semtech protocol where there is one
+  switch (result)
+  {
+    case DL_SCHEDULED: return "NONE";
+    case DL_TOO_LATE: return "TOO_LATE";
+    case DL_TOO_EARLY: return "TOO_EARLY";
+    case DL_COLLISION_PACKET: return "COLLISION_PACKET";
+    case DL_QUEUE_FULL: return "QUEUE_FULL";
+    case DL_INVALID: return "INVALID";
+  }
+
+  return "UNKNOWN";
+} // }}}
+
+const char* DownlinkScheduleTxAckError(DownlinkScheduleResult_t result) // {{{
+{
+  // no protocol value for those: a full queue is answered like the reference forwarder does,
+  // an undecoded downlink like the PULL_RESP validation does
+  switch (result)
+  {
+    case DL_QUEUE_FULL: return DecodeDownlinkScheduleResult(DL_COLLISION_PACKET);
+    case DL_INVALID: return "COLLISION_BEACON";
+    default: return DecodeDownlinkScheduleResult(result);
+  }
+} // }}}
@@ -0,0 +1,31 @@
+#ifndef LORA_PF_DOWNLINK_SCHEDULER_H
+#define LORA_PF_DOWNLINK_SCHEDULER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "UdpUtils.h"
+
+#define DOWNLINK_TX_LEAD_US 100000U          /* how early before its deadline a downlink leaves the scheduler */
+#define DOWNLINK_MAX_LATENESS_US 2000U       /* past the deadline a downlink is rejected as too late */
+#define DOWNLINK_MAX_ADVANCE_US 300000000U   /* downlinks further in the future are rejected as too early */
+#define DOWNLINK_MAX_SCHEDULED DOWNLINK_RX_QUEUE_CAPACITY
+
+typedef enum DownlinkScheduleResult
+{
+  DL_SCHEDULED = 0, DL_TOO_LATE, DL_TOO_EARLY, DL_COLLISION_PACKET, DL_QUEUE_FULL, DL_INVALID
+} DownlinkScheduleResult_t;
+
+// All of the functions below must be called from the radio thread only.
+// The timestamps are in the internal micros() time base and may wrap around.
+
+DownlinkScheduleResult_t ScheduleDownlink(PackagedDataToSend_t &&packet, uint32_t now_us);
+PackagedDataToSend_t DequeueDueDownlink(uint32_t now_us);
+uint32_t DownlinkDueInMicros(uint32_t now_us);
+size_t ScheduledDownlinksCount();
+
+const char* DecodeDownlinkScheduleResult(DownlinkScheduleResult_t result);
+// The error value of the TX_ACK answering the PULL_RESP
+const char* DownlinkScheduleTxAckError(DownlinkScheduleResult_t result);
+
+#endif
@@ -0,0 +1,78 @@
+#include "GpioEvents.h"
+#include "TimeUtils.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+static int64_t clock_ns(clockid_t clock) // {{{
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+} // }}}
+
+int open_gpio_rising_edges(const char *chip_path, int line_offset, const char *consumer) // {{{
+{
+  if (chip_path == nullptr || line_offset < 0)
+  { return -1; }
+
+  int chip_fd = open(chip_path, O_RDONLY | O_CLOEXEC);
+  if (chip_fd == -1)
+  {
+    perror(chip_path);
+    return -1;
+  }
+
+  struct gpioevent_request req;
+  memset(&req, 0, sizeof(req));
+  req.lineoffset = (uint32_t) line_offset;
+  req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+  req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+  strncpy(req.consumer_label, (consumer ? consumer : "LoRaPktFwrd"), sizeof(req.consumer_label) - 1);
+
+  int result = ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req);
+  int saved_errno = errno;
+  close(chip_fd); // the event fd stays valid on its own
+
+  if (result == -1)
+  {
+    printf("Cannot request edge events of %s line %d: %s\n", chip_path, line_offset, strerror(saved_errno));
+    return -1;
+  }
+
+  fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK);
+
+  return req.fd;
+} // }}}
+
+bool read_gpio_edge_micros(int edges_fd, uint32_t *edge_us) // {{{
+{
+  struct gpioevent_data event;
+  if (read(edges_fd, &event, sizeof(event)) != (ssize_t) sizeof(event))
+  { return false; }
+
+  // the v1 ABI stamps with CLOCK_MONOTONIC since Linux 5.7 and with CLOCK_REALTIME before
+  uint32_t now_us = micros();
+  int64_t mono_ns = clock_ns(CLOCK_MONOTONIC);
+  int64_t real_ns = clock_ns(CLOCK_REALTIME);
+
+  int64_t age_ns = mono_ns - (int64_t) event.timestamp;
+  int64_t age_real_ns = real_ns - (int64_t) event.timestamp;
+  if (age_ns < 0 || (age_real_ns >= 0 && age_real_ns < age_ns))
+  { age_ns = age_real_ns; }
+  if (age_ns < 0) age_ns = 0;
+
+  *edge_us = now_us - (uint32_t) (age_ns / 1000);
+  return true;
+} // }}}
+
+void close_gpio_edges(int edges_fd) // {{{
+{
+  if (edges_fd > -1) close(edges_fd);
+} // }}}
@@ -0,0 +1,18 @@
+#ifndef LORA_PF_GPIO_EVENTS_H
+#define LORA_PF_GPIO_EVENTS_H
+
+#include <cstdint>
+
+// Edge events of a single GPIO line through the Linux GPIO character device. The kernel
+// timestamps each edge in its interrupt handler, so the time is not affected by how late
+// the waiting thread gets scheduled.
+
+// returns a pollable file descriptor delivering the rising edges of the line, or -1
+int open_gpio_rising_edges(const char *chip_path, int line_offset, const char *consumer);
+
+// reads one pending edge event and converts its kernel timestamp into the micros() time base
+bool read_gpio_edge_micros(int edges_fd, uint32_t *edge_us);
+
+void close_gpio_edges(int edges_fd);
+
+#endif
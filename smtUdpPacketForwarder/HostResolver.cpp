@@ -0,0 +1,283 @@
+#include "HostResolver.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <sys/socket.h>
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct HostEntry
+{
+  HostAddresses_t addresses;
+  uint32_t failures = 0;
+  Clock::time_point next_refresh;
+} HostEntry_t;
+
+typedef struct Resolution
+{
+  bool ok;
+  HostAddresses_t addresses;
+  uint32_t ttl_s;
+} Resolution_t;
+
+// never destroyed, so exiting without StopHostResolver (e.g. Die) neither terminates the process nor hangs
+// destroying what the resolver thread waits on
+static std::mutex &resolver_mutex = *new std::mutex();
+static std::condition_variable &resolver_wakeup = *new std::condition_variable();
+static std::map<std::string, HostEntry_t, std::less<> > &host_entries = *new std::map<std::string, HostEntry_t, std::less<> >();
+static std::thread *resolver_thread = nullptr;
+static bool resolver_running = false;
+static uint32_t last_generation = 0;
+static void (*resolved_notifier)() = nullptr;
+
+static uint32_t QueryTtl(const char *hostname) // {{{
+{
+  // getaddrinfo doesn't tell the TTL, so ask the DNS for the A and AAAA records; 0 if it can't
+  struct __res_state state;
+  memset(&state, 0, sizeof(state));
+  if (res_ninit(&state) != 0)
+  { return 0; }
+
+  uint32_t ttl = 0;
+  for (ns_type type : { ns_t_a, ns_t_aaaa })
+  {
+    unsigned char answer[NS_PACKETSZ];
+    int len = res_nsearch(&state, hostname, ns_c_in, type, answer, sizeof(answer));
+
+    ns_msg msg;
+    if (len < 0 || ns_initparse(answer, len, &msg) != 0)
+    { continue; }
+
+    for (int i = 0; i < ns_msg_count(msg, ns_s_an); ++i)
+    {
+      ns_rr rr;
+      if (ns_parserr(&msg, ns_s_an, i, &rr) == 0 && ns_rr_type(rr) == type)
+      { ttl = (ttl == 0 ? ns_rr_ttl(rr) : std::min(ttl, (uint32_t) ns_rr_ttl(rr))); }
+    }
+  }
+
+  res_nclose(&state);
+  return ttl;
+} // }}}
+
+static void Resolve(const std::string &hostname, Resolution_t &result) // {{{
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_protocol = IPPROTO_UDP;
+
+  struct addrinfo* p_result = NULL;
+  result.ok = false;
+
+  int error = getaddrinfo(hostname.c_str(), NULL, &hints, &p_result);
+  if (error != 0) {
+    fprintf(stderr, "getaddrinfo %s: %s\n", hostname.c_str(), gai_strerror(error));
+    return;
+  }
+
+  HostAddresses_t &addresses = result.addresses;
+  addresses.count = 0;
+
+  for (struct addrinfo* p_rp = p_result; p_rp != NULL && addresses.count < RESOLVER_MAX_ADDRESSES; p_rp = p_rp->ai_next) {
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+
+    if (p_rp->ai_family == AF_INET) {
+      // IPv4-mapped, so that all of them can be handled alike
+      addr.sin6_addr.s6_addr[10] = 0xFF;
+      addr.sin6_addr.s6_addr[11] = 0xFF;
+      memcpy(&addr.sin6_addr.s6_addr[12], &((struct sockaddr_in*) p_rp->ai_addr)->sin_addr, 4);
+    } else if (p_rp->ai_family == AF_INET6) {
+      addr.sin6_addr = ((struct sockaddr_in6*) p_rp->ai_addr)->sin6_addr;
+      addr.sin6_scope_id = ((struct sockaddr_in6*) p_rp->ai_addr)->sin6_scope_id;
+    } else {
+      continue;
+    }
+
+    bool duplicate = false;
+    for (size_t i = 0; i < addresses.count && !duplicate; ++i)
+    { duplicate = (memcmp(&addresses.addrs[i].sin6_addr, &addr.sin6_addr, sizeof(addr.sin6_addr)) == 0); }
+
+    if (!duplicate) addresses.addrs[addresses.count++] = addr;
+  }
+  freeaddrinfo(p_result);
+
+  result.ok = (addresses.count > 0);
+
+  uint32_t ttl = (result.ok ? QueryTtl(hostname.c_str()) : 0);
+  result.ttl_s = (ttl == 0 ? RESOLVER_DEFAULT_TTL_S : std::max((uint32_t) RESOLVER_MIN_TTL_S,
+                                                               std::min(ttl, (uint32_t) RESOLVER_MAX_TTL_S)));
+} // }}}
+
+static void ResolveAll(const std::vector<std::string> &hostnames, std::vector<Resolution_t> &results) // {{{
+{
+  // in parallel, a slow name doesn't hold back the others
+  results.resize(hostnames.size());
+  if (hostnames.size() == 1)
+  {
+    Resolve(hostnames[0], results[0]);
+    return;
+  }
+
+  std::vector<std::thread> lookups;
+  for (size_t i = 0; i < hostnames.size(); ++i)
+  { lookups.emplace_back(Resolve, std::cref(hostnames[i]), std::ref(results[i])); }
+
+  for (std::thread &lookup : lookups)
+  { lookup.join(); }
+} // }}}
+
+static void ApplyResolutions(const std::vector<std::string> &hostnames, const std::vector<Resolution_t> &results) // {{{
+{
+  // called with resolver_mutex held
+  Clock::time_point now = Clock::now();
+
+  for (size_t i = 0; i < hostnames.size(); ++i)
+  {
+    HostEntry_t &entry = host_entries[hostnames[i]];
+    const Resolution_t &result = results[i];
+
+    if (result.ok)
+    {
+      HostAddresses_t &known = entry.addresses;
+      bool changed = (known.count != result.addresses.count);
+      for (size_t j = 0; j < known.count && !changed; ++j)
+      { changed = (memcmp(&known.addrs[j], &result.addresses.addrs[j], sizeof(known.addrs[j])) != 0); }
+
+      if (changed)
+      {
+        known = result.addresses;
+        known.generation = ++last_generation;
+
+        printf("%s resolved to", hostnames[i].c_str());
+        for (size_t j = 0; j < known.count; ++j)
+        {
+          char text[INET6_ADDRSTRLEN];
+          const struct in6_addr &addr = known.addrs[j].sin6_addr;
+          if (IN6_IS_ADDR_V4MAPPED(&addr)) inet_ntop(AF_INET, &addr.s6_addr[12], text, sizeof(text));
+          else inet_ntop(AF_INET6, &addr, text, sizeof(text));
+          printf(" %s", text);
+        }
+        printf(" (TTL %u s)\n", result.ttl_s);
+
+        if (resolved_notifier != nullptr) resolved_notifier();
+      }
+
+      entry.failures = 0;
+      // refreshed a bit ahead of the expiry
+      entry.next_refresh = now + std::chrono::seconds(result.ttl_s - result.ttl_s / 5);
+      continue;
+    }
+
+    uint32_t backoff = RESOLVER_RETRY_MIN_S << std::min(entry.failures, 6U);
+    backoff = std::min(backoff, (uint32_t) RESOLVER_RETRY_MAX_S);
+    ++entry.failures;
+    entry.next_refresh = now + std::chrono::seconds(backoff);
+
+    printf("Cannot resolve %s (%u failures in a row), retrying in %u s%s\n", hostnames[i].c_str(), entry.failures,
+      backoff, (entry.addresses.count > 0 ? ", the last known addresses are still used" : ""));
+  }
+  fflush(stdout);
+} // }}}
+
+static void ResolverWorker() // {{{
+{
+  std::vector<std::string> due;
+  std::vector<Resolution_t> results;
+
+  std::unique_lock<std::mutex> lock(resolver_mutex);
+  while (resolver_running)
+  {
+    Clock::time_point now = Clock::now();
+    Clock::time_point earliest = Clock::time_point::max();
+
+    due.clear();
+    for (auto &entry : host_entries)
+    {
+      if (entry.second.next_refresh <= now) due.push_back(entry.first);
+      else earliest = std::min(earliest, entry.second.next_refresh);
+    }
+
+    if (due.empty())
+    {
+      if (earliest == Clock::time_point::max()) resolver_wakeup.wait(lock);
+      else resolver_wakeup.wait_until(lock, earliest);
+      continue;
+    }
+
+    // the lookups may take as long as the resolver timeout, nobody waits for them
+    lock.unlock();
+    ResolveAll(due, results);
+    lock.lock();
+
+    ApplyResolutions(due, results);
+  }
+} // }}}
+
+void StartHostResolver(const std::vector<std::string> &hostnames) // {{{
+{
+  std::vector<std::string> unique{hostnames};
+  std::sort(unique.begin(), unique.end());
+  unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+
+  std::vector<Resolution_t> results;
+  ResolveAll(unique, results);
+
+  std::lock_guard<std::mutex> lock(resolver_mutex);
+  ApplyResolutions(unique, results);
+
+  resolver_running = true;
+  resolver_thread = new std::thread(ResolverWorker);
+} // }}}
+
+void StopHostResolver() // {{{
+{
+  {
+    std::lock_guard<std::mutex> lock(resolver_mutex);
+    if (!resolver_running) return;
+    resolver_running = false;
+  }
+  resolver_wakeup.notify_all();
+  resolver_thread->join();
+} // }}}
+
+bool LookupHost(const char *hostname, HostAddresses_t &addresses) // {{{
+{
+  std::lock_guard<std::mutex> lock(resolver_mutex);
+
+  auto iterator = host_entries.find(hostname);
+  if (iterator == host_entries.end())
+  {
+    host_entries.emplace(hostname, HostEntry_t{});   // due right away
+    resolver_wakeup.notify_one();
+    return false;
+  }
+
+  const HostAddresses_t &known = iterator->second.addresses;
+  if (known.count == 0)
+  { return false; }
+
+  if (known.generation != addresses.generation)
+  { addresses = known; }
+  return true;
+} // }}}
+
+void SetHostResolvedNotifier(void (*notifier)()) // {{{
+{
+  std::lock_guard<std::mutex> lock(resolver_mutex);
+  resolved_notifier = notifier;
+} // }}}
@@ -0,0 +1,38 @@
+#ifndef LORA_PF_HOST_RESOLVER_H
+#define LORA_PF_HOST_RESOLVER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+#define RESOLVER_DEFAULT_TTL_S 300   /* when the DNS doesn't tell, e.g. /etc/hosts entries and IP literals */
+#define RESOLVER_MIN_TTL_S 30
+#define RESOLVER_MAX_TTL_S 86400
+#define RESOLVER_RETRY_MIN_S 5       /* backoff after a failed lookup, doubled up to the max on each failure */
+#define RESOLVER_RETRY_MAX_S 300
+#define RESOLVER_MAX_ADDRESSES 8     /* kept per host, in the order getaddrinfo prefers them */
+
+typedef struct HostAddresses
+{
+  uint32_t generation = 0;    // changes whenever the set of addresses does, 0 if never resolved
+  size_t count = 0;
+  struct sockaddr_in6 addrs[RESOLVER_MAX_ADDRESSES];   // IPv4 ones mapped to ::ffff:a.b.c.d, no port
+} HostAddresses_t;
+
+// Resolves the host names in parallel and waits for that first round, then keeps refreshing them from a
+// background thread before their TTL runs out. A failed lookup is retried with backoff and meanwhile the
+// last good address is still served.
+void StartHostResolver(const std::vector<std::string> &hostnames);
+void StopHostResolver();
+
+// Never blocks: updates addresses if the resolver knows of another set than addresses.generation,
+// returns false if the host hasn't been resolved (yet). Host names unknown so far get resolved in the background.
+bool LookupHost(const char *hostname, HostAddresses_t &addresses);
+// Called from the resolver thread whenever the addresses of a host change, so that those waiting for them
+// don't have to poll; before StartHostResolver
+void SetHostResolvedNotifier(void (*notifier)());
+
+#endif
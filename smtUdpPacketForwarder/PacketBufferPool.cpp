@@ -0,0 +1,125 @@
+#include "PacketBufferPool.h"
+
+#include <atomic>
+#include <mutex>
+
+typedef struct PacketBufferSlot
+{
+  std::atomic<uint32_t> refs;
+  std::atomic<uint32_t> next_free;
+  uint8_t data[PACKET_BUFFER_SIZE];
+} PacketBufferSlot_t;
+
+#define NO_SLOT UINT32_MAX
+
+static uint32_t pool_size = PACKET_BUFFER_POOL_DEFAULT_SIZE;
+static PacketBufferSlot_t *slots = nullptr;
+static std::once_flag pool_created;
+
+// lock-free stack of the free slots: index in the low half, a change counter against ABA in the high one
+static std::atomic<uint64_t> free_head{NO_SLOT};
+
+static std::atomic<uint32_t> in_use{0};
+static std::atomic<uint32_t> high_water{0};
+static std::atomic<uint32_t> exhausted{0};
+
+static void CreatePool() // {{{
+{
+  slots = new PacketBufferSlot_t[pool_size];
+
+  for (uint32_t i = 0; i < pool_size; ++i)
+  {
+    slots[i].refs.store(0, std::memory_order_relaxed);
+    slots[i].next_free.store(i + 1 < pool_size ? i + 1 : NO_SLOT, std::memory_order_relaxed);
+  }
+  free_head.store(pool_size > 0 ? 0 : NO_SLOT, std::memory_order_release);
+} // }}}
+
+static void PushFreeSlot(uint32_t index) // {{{
+{
+  uint64_t head = free_head.load(std::memory_order_relaxed);
+  uint64_t newHead;
+  do
+  {
+    slots[index].next_free.store((uint32_t) head, std::memory_order_relaxed);
+    newHead = (((head >> 32) + 1) << 32) | index;
+  } while (!free_head.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed));
+} // }}}
+
+static uint32_t PopFreeSlot() // {{{
+{
+  uint64_t head = free_head.load(std::memory_order_acquire);
+  for (;;)
+  {
+    uint32_t index = (uint32_t) head;
+    if (index == NO_SLOT) return NO_SLOT;
+
+    uint64_t newHead = (((head >> 32) + 1) << 32) | slots[index].next_free.load(std::memory_order_relaxed);
+    if (free_head.compare_exchange_weak(head, newHead, std::memory_order_acquire, std::memory_order_acquire))
+    { return index; }
+  }
+} // }}}
+
+bool PacketBufferPoolSetup(uint32_t buffers) // {{{
+{
+  bool applied = false;
+  std::call_once(pool_created, [buffers, &applied]() {
+    pool_size = buffers;
+    CreatePool();
+    applied = true;
+  });
+  return applied;
+} // }}}
+
+PacketBufferRef AcquirePacketBuffer() // {{{
+{
+  std::call_once(pool_created, CreatePool);
+
+  uint32_t index = PopFreeSlot();
+  if (index == NO_SLOT)
+  {
+    exhausted.fetch_add(1, std::memory_order_relaxed);
+    return PacketBufferRef();
+  }
+
+  slots[index].refs.store(1, std::memory_order_relaxed);
+
+  uint32_t count = in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (count > high_water.load(std::memory_order_relaxed))
+  { high_water.store(count, std::memory_order_relaxed); }
+
+  return PacketBufferRef(index);
+} // }}}
+
+PacketBufferPoolStats_t GetPacketBufferPoolStats() // {{{
+{
+  PacketBufferPoolStats_t result;
+  result.capacity = pool_size;
+  result.in_use = in_use.load(std::memory_order_relaxed);
+  result.high_water_mark = high_water.load(std::memory_order_relaxed);
+  result.exhausted = exhausted.load(std::memory_order_relaxed);
+  return result;
+} // }}}
+
+uint8_t* PacketBufferRef::data() const // {{{
+{
+  return (index == NO_INDEX ? nullptr : slots[index].data);
+} // }}}
+
+void PacketBufferRef::retain() // {{{
+{
+  if (index != NO_INDEX)
+  { slots[index].refs.fetch_add(1, std::memory_order_relaxed); }
+} // }}}
+
+void PacketBufferRef::reset() // {{{
+{
+  if (index == NO_INDEX) return;
+
+  if (slots[index].refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+  {
+    in_use.fetch_sub(1, std::memory_order_relaxed);
+    PushFreeSlot(index);
+  }
+  index = NO_INDEX;
+} // }}}
@@ -0,0 +1,84 @@
+#ifndef LORA_PF_PACKET_BUFFER_POOL_H
+#define LORA_PF_PACKET_BUFFER_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define PACKET_BUFFER_SIZE 2048               /* the largest datagram, see TX_BUFF_UP_SIZE and RX_BUFF_DOWN_SIZE */
+#define PACKET_BUFFER_POOL_DEFAULT_SIZE 512   /* buffers, unless configured otherwise */
+#define PACKET_BUFFER_POOL_MIN_SIZE 384       /* a full window of pending ACKs, and of downlinks with their decoding */
+
+// Reference counted handle of a buffer of the pool; the buffer goes back to the pool with its last handle.
+// Handles to the same buffer may be copied and dropped from different threads.
+class PacketBufferRef
+{
+  public:
+    PacketBufferRef() : index(NO_INDEX)
+    { }
+
+    PacketBufferRef(const PacketBufferRef &other) : index(other.index)
+    { retain(); }
+
+    PacketBufferRef(PacketBufferRef &&other) : index(other.index)
+    { other.index = NO_INDEX; }
+
+    ~PacketBufferRef()
+    { reset(); }
+
+    PacketBufferRef& operator=(const PacketBufferRef &other)
+    {
+      if (this != &other)
+      {
+        reset();
+        index = other.index;
+        retain();
+      }
+      return *this;
+    }
+
+    PacketBufferRef& operator=(PacketBufferRef &&other)
+    {
+      if (this != &other)
+      {
+        reset();
+        index = other.index;
+        other.index = NO_INDEX;
+      }
+      return *this;
+    }
+
+    explicit operator bool() const
+    { return index != NO_INDEX; }
+
+    uint8_t* data() const;
+    void reset();
+
+  private:
+    friend PacketBufferRef AcquirePacketBuffer();
+
+    static const uint32_t NO_INDEX = UINT32_MAX;
+
+    explicit PacketBufferRef(uint32_t idx) : index(idx)
+    { }
+
+    void retain();
+
+    uint32_t index;
+};
+
+typedef struct PacketBufferPoolStats
+{
+  uint32_t capacity;
+  uint32_t in_use;
+  uint32_t high_water_mark;
+  uint32_t exhausted;   // times a buffer was asked for, but none was left
+} PacketBufferPoolStats_t;
+
+// Sets the number of PACKET_BUFFER_SIZE buffers of the pool, which is allocated once and never grows.
+// Only effective before the first buffer is taken, returns false otherwise.
+bool PacketBufferPoolSetup(uint32_t buffers);
+// A buffer of PACKET_BUFFER_SIZE bytes, or an empty handle if the pool is exhausted. Lock-free, any thread.
+PacketBufferRef AcquirePacketBuffer();
+PacketBufferPoolStats_t GetPacketBufferPoolStats();
+
+#endif
@@ -1,21 +1,30 @@
 #include "Radio.h"
 #include "TimeUtils.h"
+#include "DownlinkScheduler.h"
+#include "GpioEvents.h"
+#include "SfScanPlanner.h"
+#include "SimRadio.h"
 
 #include <ctime>
 #include <functional>
 #include <map>
 #include <string>
-#include <typeinfo>
 #include <cstdarg>
 #include <limits>
 #include <cmath>
 
-#include "rapidjson/document.h"
-#include "rapidjson/stringbuffer.h"
-#include "gpsTimestampUtils/GpsTimestampUtils.h"
-#include "base64/base64.h"
+#include <poll.h>
+#include <unistd.h>
 
-static uint8_t gfskSyncWord[] = { 0xC1, 0x94, 0xC1 };
+static const int8_t rxOutputPowerDbm = 17;
+
+// interrupt driven RX: kernel timestamped RxDone edges, the chip stays in continuous receive
+static const int rxWaitMaxMs = 1000;
+static int rxDoneEdgesFd = -1;
+static bool continuousRxArmed = false;
+
+// what a blocking receive() may wait for a preamble, like RadioLib does
+static const uint32_t rxBlockingSymbols = 100;
 
 const char* decodeRadioLibErrorCode(short errorCode) { // {{{
   static const std::map<short, const char*> ERRORS {
@@ -102,158 +111,77 @@ void hexPrint(uint8_t data[], int length, FILE *dest) { // {{{
   fflush(dest);
 } // }}}
 
-#define MODULE_RESET(chip_class, origin, is_reset, reset_pin) if (!is_reset) { \
-	  chip_class* module = dynamic_cast<chip_class*>(origin); \
-	  if (module != nullptr) { \
-	    is_reset = true; \
-	    module->reset(); \
-	    SX127x* sx127x_chip = dynamic_cast<SX127x*>(origin); \
-	    if (sx127x_chip != nullptr) { \
-	      pinMode(reset_pin, INPUT); \
-	    } \
-	    delay(5); \
-	  } \
-	}
-
-#define MODULE_DELAY_TRANSMISSION(chip_class, origin, is_delayed, until_ts_us) \
-  if (!is_delayed && origin != nullptr && typeid(*origin) == typeid(chip_class)) { \
-    is_delayed = true; \
-    chip_class* chip = static_cast<chip_class*>(origin); \
-    chip->holdTransmissionUntil(until_ts_us); \
-  } \
-
-#define MODULE_REINIT(chip_class, origin, is_reinitted, result, pi_cfg, power, current_lim_ma, gain) \
-	if (!is_reinitted && origin != nullptr && typeid(*origin) == typeid(chip_class)) { \
-	  is_reinitted = true; \
-	  chip_class* chip = static_cast<chip_class*>(origin); \
-	  result = chip->begin( \
-	    pi_cfg.lora_chip_settings.carrier_frequency_mhz, \
-	    pi_cfg.lora_chip_settings.bandwidth_khz, \
-	    pi_cfg.lora_chip_settings.spreading_factor, \
-	    pi_cfg.lora_chip_settings.coding_rate, \
-	    pi_cfg.lora_chip_settings.sync_word, \
-	    power, \
-	    pi_cfg.lora_chip_settings.preamble_length, \
-	    gain \
-	  ); \
-	  if (result == RADIOLIB_ERR_NONE) result = chip->setCurrentLimit(current_lim_ma); \
-	  if (result == RADIOLIB_ERR_NONE) { \
-	    SX127x* sx127x_chip = dynamic_cast<SX127x*>(origin); \
-	    if (sx127x_chip != nullptr) { \
-	      result = sx127x_chip->invertIQ(false); \
-	      if (result == RADIOLIB_ERR_NONE) { \
-	        result = sx127x_chip->setCRC(true); \
-	      } \
-	    } else { \
-	      SX126x* sx126x_chip = dynamic_cast<SX126x*>(origin); \
-	      if (sx126x_chip != nullptr) { \
-	        result = sx126x_chip->invertIQ(false); \
-	        if (result == RADIOLIB_ERR_NONE) { \
-	          result = sx126x_chip->setCRC((uint8_t) 1); \
-	        } \
-	        sx126x_chip->setRxBoostedGainMode(true); \
-	      } else { \
-	        result = RADIOLIB_ERR_UNKNOWN; \
-	      } \
-	    } \
-	  } \
-	}
-
-#define MODULE_REINIT_FOR_TX(chip_class, origin, is_reinitted, result, pi_cfg, downlink_pkt, current_lim_ma, gain) \
-	if (!is_reinitted && origin != nullptr && typeid(*origin) == typeid(chip_class)) { \
-	  is_reinitted = true; \
-	  chip_class* chip = static_cast<chip_class*>(origin); \
-	  if (downlink_pkt.fsk_datarate_bps == 0) { \
-	    result = chip->begin( \
-	      downlink_pkt.carrier_frequency_mhz, \
-	      downlink_pkt.bandwidth_khz, \
-	      downlink_pkt.spreading_factor, \
-	      downlink_pkt.coding_rate, \
-	      pi_cfg.lora_chip_settings.sync_word, \
-	      (int8_t) downlink_pkt.output_power_dbm, \
-	      downlink_pkt.preamble_length, \
-	      gain \
-	    ); \
-	    if (result == RADIOLIB_ERR_NONE) { \
-	      SX127x* sx127x_chip = dynamic_cast<SX127x*>(origin); \
-	      if (sx127x_chip != nullptr) { \
-	        result = sx127x_chip->invertIQ(downlink_pkt.iq_polatization_inversion); \
-	        if (result == RADIOLIB_ERR_NONE) { \
-	          result = sx127x_chip->setCRC(!downlink_pkt.disable_crc); \
-	        } \
-	      } else { \
-	        SX126x* sx126x_chip = dynamic_cast<SX126x*>(origin); \
-	        if (sx126x_chip != nullptr) { \
-	          result = sx126x_chip->invertIQ(downlink_pkt.iq_polatization_inversion); \
-	          if (result == RADIOLIB_ERR_NONE) { \
-	            result = sx126x_chip->setCRC(downlink_pkt.disable_crc ? (uint8_t) 0 : (uint8_t) 1); \
-	          } \
-	        } else { \
-	          result = RADIOLIB_ERR_UNKNOWN; \
-	        } \
-	      } \
-	    } \
-	  } else { \
-	    result = chip->beginFSK( \
-	      downlink_pkt.carrier_frequency_mhz, \
-	      downlink_pkt.fsk_datarate_bps / 1000.0, \
-	      downlink_pkt.fsk_freq_deviation_hz / 1000.0, \
-	      downlink_pkt.bandwidth_khz, \
-	      (int8_t) downlink_pkt.output_power_dbm, \
-	      downlink_pkt.preamble_length, \
-	      false /* don't use OOK */ \
-	    ); \
-	    if (result == RADIOLIB_ERR_NONE) result = chip->setSyncWord(gfskSyncWord, ((uint8_t) sizeof(gfskSyncWord))); \
-	  } \
-	  if (result == RADIOLIB_ERR_NONE) result = chip->setCurrentLimit(current_lim_ma); \
-	}
-
-void doRestartLoRaChip(PhysicalLayer *lora, PlatformInfo_t &cfg) { // {{{
+static RadioModemState_t rxModemState(PlatformInfo_t &cfg, int8_t power) { // {{{
+  RadioModemState_t result;
+  result.valid = true;
+  result.carrier_frequency_mhz = cfg.lora_chip_settings.carrier_frequency_mhz;
+  result.bandwidth_khz = cfg.lora_chip_settings.bandwidth_khz;
+  result.spreading_factor = cfg.lora_chip_settings.spreading_factor;
+  result.coding_rate = cfg.lora_chip_settings.coding_rate;
+  result.iq_polatization_inversion = false;
+  result.crc = true;
+  result.output_power_dbm = power;
+  result.preamble_length = cfg.lora_chip_settings.preamble_length;
+  return result;
+} // }}}
+
+static RadioModemState_t txModemState(const DownlinkPacket_t &downlink_pkt) { // {{{
+  RadioModemState_t result;
+  result.valid = true;
+  result.fsk = (downlink_pkt.fsk_datarate_bps != 0);
+  result.carrier_frequency_mhz = downlink_pkt.carrier_frequency_mhz;
+  result.bandwidth_khz = downlink_pkt.bandwidth_khz;
+  result.spreading_factor = downlink_pkt.spreading_factor;
+  result.coding_rate = downlink_pkt.coding_rate;
+  result.iq_polatization_inversion = downlink_pkt.iq_polatization_inversion;
+  result.crc = !downlink_pkt.disable_crc;
+  result.output_power_dbm = (int8_t) downlink_pkt.output_power_dbm;
+  result.preamble_length = downlink_pkt.preamble_length;
+  return result;
+} // }}}
+
+static int16_t reconfigureLoRaChip(ChipAdapter *lora, const RadioModemState_t &target) { // {{{
+  // incremental switch between two LoRa configurations; FSK or an unknown state need a full reinit
+  if (!lora->modem_state.valid || lora->modem_state.fsk || target.fsk)
+  { return RADIOLIB_ERR_WRONG_MODEM; }
+
+  return lora->applyModemState(lora->modem_state, target);
+} // }}}
+
+void doRestartLoRaChip(ChipAdapter *lora, PlatformInfo_t &cfg) { // {{{
   if (cfg.lora_chip_settings.pin_rest > -1) {
-    bool is_reset = false;
-    RADIOLIB_PIN_TYPE reset_pin = (RADIOLIB_PIN_TYPE) cfg.lora_chip_settings.pin_rest;
-    MODULE_RESET(SX1261, lora, is_reset, reset_pin); MODULE_RESET(SX1262, lora, is_reset, reset_pin); MODULE_RESET(SX1268, lora, is_reset, reset_pin); MODULE_RESET(LLCC68, lora, is_reset, reset_pin);
-    MODULE_RESET(SX1272, lora, is_reset, reset_pin); MODULE_RESET(SX1273, lora, is_reset, reset_pin); MODULE_RESET(SX1276, lora, is_reset, reset_pin);
-    MODULE_RESET(SX1277, lora, is_reset, reset_pin); MODULE_RESET(SX1278, lora, is_reset, reset_pin); MODULE_RESET(SX1279, lora, is_reset, reset_pin);
-    MODULE_RESET(RFM95, lora, is_reset, reset_pin); MODULE_RESET(RFM96, lora, is_reset, reset_pin); MODULE_RESET(RFM97, lora, is_reset, reset_pin);
+    lora->reset((RADIOLIB_PIN_TYPE) cfg.lora_chip_settings.pin_rest);
   }
 } // }}}
 
-uint16_t restartLoRaChip(PhysicalLayer *lora, PlatformInfo_t &cfg) { // {{{
+uint16_t restartLoRaChip(ChipAdapter *lora, PlatformInfo_t &cfg) { // {{{
   doRestartLoRaChip(lora, cfg);
+  continuousRxArmed = false;
+
+  int8_t power = rxOutputPowerDbm, currentLimit_ma = 100, gain = 0;
+  uint16_t result = lora->begin(cfg.lora_chip_settings, power, currentLimit_ma, gain);
 
-  int8_t power = 17, currentLimit_ma = 100, gain = 0;
-  bool is_reinitted = false;
-  uint16_t result = RADIOLIB_ERR_NONE + 1;
-
-  MODULE_REINIT(SX1261, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(SX1262, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(SX1268, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(LLCC68, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(SX1272, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(SX1273, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(SX1276, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(SX1277, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(SX1278, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(SX1279, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(RFM95, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(RFM96, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
-  MODULE_REINIT(RFM97, lora, is_reinitted, result, cfg, power, currentLimit_ma, gain);
+  lora->modem_state = rxModemState(cfg, power);
+  lora->modem_state.valid = (result == RADIOLIB_ERR_NONE);
 
   return result;
 } // }}}
 
-#define MODULE_INIT_PAIR(origin_class_name, origin_class) { #origin_class_name, [](Module* lora_module_settings) { return new origin_class(lora_module_settings); } }
+#define SX127X_CHIP(origin_class_name, origin_class) { #origin_class_name, [](Module* lora_module_settings) -> ChipAdapter* { return new SX127xAdapter<origin_class>(lora_module_settings); } }
+#define SX126X_CHIP(origin_class_name, origin_class) { #origin_class_name, [](Module* lora_module_settings) -> ChipAdapter* { return new SX126xAdapter<origin_class>(lora_module_settings); } }
 
-PhysicalLayer* instantiateLoRaChip(LoRaChipSettings_t& lora_chip_settings, SPIClass &spiClass, SPISettings &spiSettings) { // {{{
-  static const std::map<std::string, std::function<PhysicalLayer*(Module*)> > LORA_CHIPS {
-    MODULE_INIT_PAIR(SX1261, SX1261), MODULE_INIT_PAIR(SX1262, SX1262), MODULE_INIT_PAIR(SX1268, SX1268), MODULE_INIT_PAIR(LLCC68, LLCC68),
-    MODULE_INIT_PAIR(SX1272, SX1272), MODULE_INIT_PAIR(SX1273, SX1273), MODULE_INIT_PAIR(SX1276, SX1276),
-    MODULE_INIT_PAIR(SX1277, SX1277), MODULE_INIT_PAIR(SX1278, SX1278), MODULE_INIT_PAIR(SX1279, SX1279),
-    MODULE_INIT_PAIR(RFM95, RFM95), MODULE_INIT_PAIR(RFM96, RFM96), MODULE_INIT_PAIR(RFM97, RFM97),
-    MODULE_INIT_PAIR(RFM98, RFM96) // like RFM96
+ChipAdapter* instantiateLoRaChip(LoRaChipSettings_t& lora_chip_settings, SPIClass &spiClass, SPISettings &spiSettings) { // {{{
+  static const std::map<std::string, std::function<ChipAdapter*(Module*)> > LORA_CHIPS {
+    SX126X_CHIP(SX1261, SX1261), SX126X_CHIP(SX1262, SX1262), SX126X_CHIP(SX1268, SX1268), SX126X_CHIP(LLCC68, LLCC68),
+    SX127X_CHIP(SX1272, SX1272), SX127X_CHIP(SX1273, SX1273), SX127X_CHIP(SX1276, SX1276),
+    SX127X_CHIP(SX1277, SX1277), SX127X_CHIP(SX1278, SX1278), SX127X_CHIP(SX1279, SX1279),
+    SX127X_CHIP(RFM95, RFM95), SX127X_CHIP(RFM96, RFM96), SX127X_CHIP(RFM97, RFM97),
+    SX127X_CHIP(RFM98, RFM96) // like RFM96
  };
 
+  if (lora_chip_settings.ic_model == "SIM")
+  { return new SimRadioAdapter(lora_chip_settings); }
+
   Module *module_settings = new Module(
     lora_chip_settings.pin_nss_cs,
     lora_chip_settings.pin_dio0,
@@ -263,75 +191,154 @@ PhysicalLayer* instantiateLoRaChip(LoRaChipSettings_t& lora_chip_settings, SPICl
     spiSettings
   );
 
-  auto instance = LORA_CHIPS.at(lora_chip_settings.ic_model)(module_settings);
+  return LORA_CHIPS.at(lora_chip_settings.ic_model)(module_settings);
+} // }}}
 
-  SX126x* sx126x_chip = dynamic_cast<SX126x*>(instance);
-  if (sx126x_chip != nullptr)
-  {
-    sx126x_chip->XTAL = true;
-    sx126x_chip->standbyXOSC = true;
+bool setupLoRaRxEdgeEvents(ChipAdapter *lora, PlatformInfo_t &cfg) { // {{{
+  // the channel activity scan of all spreading factors needs the chip in CAD mode, not in continuous RX
+  int line = lora->rxDoneGpioLine(cfg.lora_chip_settings);
+  if (cfg.lora_chip_settings.all_spreading_factors || line < 0)
+  { return false; }
+
+  close_gpio_edges(rxDoneEdgesFd);
+  rxDoneEdgesFd = open_gpio_rising_edges(cfg.lora_chip_settings.gpio_chip.c_str(), line, "LoRaPktFwrd RxDone");
+  continuousRxArmed = false;
+
+  return (rxDoneEdgesFd > -1);
+} // }}}
+
+static uint32_t spiByteMicros(PlatformInfo_t &cfg) { // {{{
+  return 8000000U / (cfg.lora_chip_settings.spi_speed_hz > 0 ? cfg.lora_chip_settings.spi_speed_hz : 1U) + 1;
+} // }}}
+
+static uint32_t spiReadoutMicros(PlatformInfo_t &cfg, int msg_length) { // {{{
+  // the FIFO burst plus the handful of register accesses readData() does around it
+  return (uint32_t) (msg_length + 8) * spiByteMicros(cfg);
+} // }}}
+
+static uint32_t symbolMicros(PlatformInfo_t &cfg, uint8_t sf) { // {{{
+  return (uint32_t) ((1U << sf) * 1000.0 / cfg.lora_chip_settings.bandwidth_khz);
+} // }}}
+
+static uint32_t rxDeadlineMs() { // {{{
+  // waiting for an uplink must not make the next scheduled downlink late, nor hold the uplinks being
+  // coalesced past their time; UINT32_MAX / 1000 if there's neither
+  uint32_t waitMs = DownlinkDueInMicros(micros()) / 1000;
+
+  int coalescedDueMs = CoalescedUplinksDueInMs();
+  if (coalescedDueMs >= 0 && (uint32_t) coalescedDueMs < waitMs) waitMs = coalescedDueMs;
+
+  return waitMs;
+} // }}}
+
+static uint32_t rxWaitBoundMs() { // {{{
+  uint32_t waitMs = rxDeadlineMs();
+  return (waitMs > (uint32_t) rxWaitMaxMs ? (uint32_t) rxWaitMaxMs : waitMs);
+} // }}}
+
+static bool waitForDownlinkQueue(int waitMs) { // {{{
+  struct pollfd fds[1] = { { DownlinkQueueEventFd(), POLLIN, 0 } };
+  if (poll(fds, 1, waitMs) <= 0)
+  { return false; }
+
+  uint64_t signalled;
+  while (read(DownlinkQueueEventFd(), &signalled, sizeof(signalled)) > 0);
+  return true;
+} // }}}
+
+static int receiveOnRxDoneEdge(ChipAdapter *lora, PlatformInfo_t &cfg, uint8_t msg[], uint32_t &edgeMicros,
+                               bool &edgeStamped) { // {{{
+  edgeStamped = false;
+
+  if (!continuousRxArmed) {
+    int16_t state = lora->startContinuousReceive();
+    if (state != RADIOLIB_ERR_NONE) return state;
+    continuousRxArmed = true;
   }
 
-  return instance;
+  // don't oversleep the next scheduled downlink nor the held uplinks; a freshly queued downlink wakes us up too
+  uint32_t waitMs = rxWaitBoundMs();
+
+  struct pollfd fds[2] = { { rxDoneEdgesFd, POLLIN, 0 }, { DownlinkQueueEventFd(), POLLIN, 0 } };
+  int ready = poll(fds, 2, (int) waitMs);
+
+  if (ready > 0 && (fds[1].revents & POLLIN)) {
+    uint64_t signalled;
+    while (read(DownlinkQueueEventFd(), &signalled, sizeof(signalled)) > 0);
+  }
+
+  if (ready <= 0 || !(fds[0].revents & POLLIN))
+  { return RADIOLIB_ERR_RX_TIMEOUT; }
+
+  // only the latest edge belongs to the frame sitting in the FIFO
+  while (read_gpio_edge_micros(rxDoneEdgesFd, &edgeMicros)) edgeStamped = true;
+
+  continuousRxArmed = false;
+  return lora->readData(msg, RADIOLIB_SX127X_MAX_PACKET_LENGTH);
 } // }}}
 
-#define PKT_ENRICHER(origin_class, instance_ptr, inst_type_info, lora_packet, freq_err) \
-	if (inst_type_info == typeid(origin_class)) { \
-	  origin_class *inst = static_cast<origin_class*>(instance_ptr); \
-	  lora_packet.RSSI = inst->getRSSI(true); \
-	  lora_packet.SNR = inst->getSNR(); \
-	  freq_err = inst->getFrequencyError(); \
-	  return; \
-	}
-#define PKT_ENRICHER_NO_FREQ_ERR(origin_class, instance_ptr, inst_type_info, lora_packet, freq_err) \
-	if (inst_type_info == typeid(origin_class)) { \
-	  origin_class *inst = static_cast<origin_class*>(instance_ptr); \
-	  lora_packet.RSSI = inst->getRSSI(); \
-	  lora_packet.SNR = inst->getSNR(); \
-	  freq_err = 0.0f; /* inst->getFrequencyError(); undocumented, not recommeded */ \
-	  return; \
-	}
-
-void enrichWithRadioStats(PhysicalLayer *lora, LoRaDataPkt_t &pkt, float &freqErr) { // {{{
-  const std::type_info &loraInstTypeInfo = typeid(*lora);
-
-  PKT_ENRICHER_NO_FREQ_ERR(SX1261, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER_NO_FREQ_ERR(SX1262, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER_NO_FREQ_ERR(SX1268, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER_NO_FREQ_ERR(LLCC68, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER(SX1272, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER(SX1273, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER(SX1276, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER(SX1277, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER(SX1278, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER(SX1279, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER(RFM95, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER(RFM96, lora, loraInstTypeInfo, pkt, freqErr);
-  PKT_ENRICHER(RFM97, lora, loraInstTypeInfo, pkt, freqErr);
-
-  // else:
-  pkt.RSSI = 1.0f;
-  pkt.SNR = 1.0f;
-  freqErr = 0.0f;
+static uint32_t maxFrameMicros(PlatformInfo_t &cfg, uint8_t sf) { // {{{
+  return compute_time_on_air_us(0, RADIOLIB_SX127X_MAX_PACKET_LENGTH, sf, cfg.lora_chip_settings.bandwidth_khz,
+                                cfg.lora_chip_settings.coding_rate, cfg.lora_chip_settings.preamble_length, true);
 } // }}}
 
-#define ITER_ALL_SF(origin_class, lora, lora_type, is_matched, state, insist_data_recv_fail, sf_min, sf_max, recv_ts_micros, curr_sf) \
-	if (!is_matched && lora_type == typeid(origin_class)) { \
-	  is_matched = true; \
-	  origin_class* inst = static_cast<origin_class*>(lora); \
-	  for (unsigned i = sf_min; i <= sf_max; ++i) {\
-	    inst->setSpreadingFactor(i); \
-	    curr_sf = decltype(curr_sf)(i); \
-	    state = inst->scanChannel(); \
-	    if (state == RADIOLIB_PREAMBLE_DETECTED) /*&& lora->getRSSI() > -124.0) */{ \
-	      state = inst->receive(msg, RADIOLIB_SX127X_MAX_PACKET_LENGTH); \
-	      recvTsMicros = micros(); \
-	      insist_data_recv_fail = (state != RADIOLIB_ERR_NONE); \
-	      printf("Got preamble at SF%d, RSSI %f!\n", i, inst->getRSSI()); \
-	      break; \
-	    } \
-	  } \
-	}
+static int receiveBounded(ChipAdapter *lora, PlatformInfo_t &cfg, uint8_t msg[], uint8_t sf,
+                          bool preambleDetected) { // {{{
+  // the IRQ pin signals RxDone as well, polling it lets the wait end in time for the next downlink
+  int irqPin = lora->txDoneIrqPin(cfg.lora_chip_settings);
+  if (irqPin < 0) {
+    // receive() can't be cut short, so none is started that a deadline falls within; the held uplinks
+    // rather go right away than keep the radio from listening
+    uint64_t blockingMicros = (uint64_t) rxBlockingSymbols * symbolMicros(cfg, sf);
+    uint32_t deadlineMs = rxDeadlineMs();
+    if ((uint64_t) deadlineMs * 1000 < blockingMicros && CoalescedUplinksDueInMs() >= 0) {
+      FlushCoalescedUplinks(true);
+      deadlineMs = rxDeadlineMs();
+    }
+    if ((uint64_t) deadlineMs * 1000 < blockingMicros) {
+      waitForDownlinkQueue(deadlineMs > (uint32_t) rxWaitMaxMs ? rxWaitMaxMs : (int) deadlineMs);
+      return RADIOLIB_ERR_RX_TIMEOUT;
+    }
+    return lora->receive(msg, RADIOLIB_SX127X_MAX_PACKET_LENGTH);
+  }
+
+  uint32_t waitMs = rxWaitBoundMs();
+  if (!continuousRxArmed) {
+    int16_t state = lora->startContinuousReceive();
+    if (state != RADIOLIB_ERR_NONE) return state;
+    continuousRxArmed = true;
+  }
+
+  // a frame whose preamble was detected is on air already: it gets as long as the longest one of its SF takes,
+  // only the next downlink may cut it short, the held uplinks wait for it
+  uint32_t deadlineMicros = micros() + waitMs * 1000;
+  if (preambleDetected) {
+    uint32_t frameMicros = maxFrameMicros(cfg, sf);
+    uint32_t downlinkDueMicros = DownlinkDueInMicros(micros());
+    deadlineMicros = micros() + (downlinkDueMicros < frameMicros ? downlinkDueMicros : frameMicros);
+  }
+
+  for (unsigned polls = 1; !digitalRead(irqPin); ++polls) {
+    if ((int32_t) (micros() - deadlineMicros) >= 0)
+    { return RADIOLIB_ERR_RX_TIMEOUT; }
+
+    // a freshly queued downlink may be due before the deadline; the frame being received keeps listening,
+    // with the downlink scheduled, until it's due
+    if (polls % 10 == 0 && waitForDownlinkQueue(0)) {
+      if (!preambleDetected) return RADIOLIB_ERR_RX_TIMEOUT;
+
+      scheduleLoRaDownlinkData();
+      uint32_t downlinkDueMicros = DownlinkDueInMicros(micros());
+      if (downlinkDueMicros < UINT32_MAX && (int32_t) (micros() + downlinkDueMicros - deadlineMicros) < 0)
+      { deadlineMicros = micros() + downlinkDueMicros; }
+    }
+
+    delayMicroseconds(100);
+  }
+
+  continuousRxArmed = false;
+  return lora->readData(msg, RADIOLIB_SX127X_MAX_PACKET_LENGTH);
+} // }}}
 
 static void logMessage(const char *format, ...) {
   time_t timestamp{std::time(nullptr)};
@@ -346,7 +353,7 @@ static void logMessage(const char *format, ...) {
   fflush(stdout);
 }
 
-LoRaRecvStat recvLoRaUplinkData(PhysicalLayer *lora, PlatformInfo_t &cfg, LoRaDataPkt_t &pkt,
+LoRaRecvStat recvLoRaUplinkData(ChipAdapter *lora, PlatformInfo_t &cfg, LoRaDataPkt_t &pkt,
                                 uint8_t msg[], LoRaPacketTrafficStats_t &loraPacketStats) { // {{{
 
   int state = RADIOLIB_ERR_RX_TIMEOUT;
@@ -354,35 +361,53 @@ LoRaRecvStat recvLoRaUplinkData(PhysicalLayer *lora, PlatformInfo_t &cfg, LoRaDa
 
   SpreadingFactor_t usedSF;
   uint32_t recvTsMicros;
+  bool edgeStamped = false;
 
-  if (!cfg.lora_chip_settings.all_spreading_factors){
-    state = lora->receive(msg, RADIOLIB_SX127X_MAX_PACKET_LENGTH);
+  if (!cfg.lora_chip_settings.all_spreading_factors && rxDoneEdgesFd > -1) {
+    state = receiveOnRxDoneEdge(lora, cfg, msg, recvTsMicros, edgeStamped);
+    usedSF = cfg.lora_chip_settings.spreading_factor;
+  } else if (!cfg.lora_chip_settings.all_spreading_factors) {
+    state = receiveBounded(lora, cfg, msg, cfg.lora_chip_settings.spreading_factor, false);
     recvTsMicros = micros();
     usedSF = cfg.lora_chip_settings.spreading_factor;
   } else {
-    const std::type_info &loraTypeInfo = typeid(*lora);
-    bool is_matched = false;
-    ITER_ALL_SF(SX1261, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(SX1262, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(SX1268, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(LLCC68, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(SX1272, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(SX1273, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(SX1276, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(SX1277, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(SX1278, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(SX1279, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(RFM95, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(RFM96, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
-    ITER_ALL_SF(RFM97, lora, loraTypeInfo, is_matched, state, insistDataReceiveFailure, SpreadingFactor_t::SF7, SpreadingFactor_t::SF_MAX, recvTsMicros, usedSF);
+    // as many scans per call as there are spreading factors, their order is up to the planner
+    for (unsigned n = SpreadingFactor_t::SF7; n <= SpreadingFactor_t::SF_MAX; ++n) {
+      // the next downlink and the held uplinks go first
+      if (rxWaitBoundMs() == 0) break;
+
+      SpreadingFactor_t sf = SfScanNext(micros());
+      if (!lora->modem_state.valid || lora->modem_state.spreading_factor != sf) {
+        if (lora->setSpreadingFactor(sf) == RADIOLIB_ERR_NONE) lora->modem_state.spreading_factor = sf;
+        else lora->modem_state.valid = false;
+      }
+      usedSF = sf;
+
+      uint32_t scanStartMicros = micros();
+      continuousRxArmed = false; // a scan leaves the receive mode
+      state = lora->scanChannel();
+      if (state == RADIOLIB_PREAMBLE_DETECTED || state == RADIOLIB_CHANNEL_FREE)
+      { SfScanRecord(sf, scanStartMicros, micros(), state == RADIOLIB_PREAMBLE_DETECTED); }
+
+      if (state == RADIOLIB_PREAMBLE_DETECTED) /*&& lora->getRSSI() > -124.0) */{
+        state = receiveBounded(lora, cfg, msg, sf, true);
+        recvTsMicros = micros();
+        insistDataReceiveFailure = (state != RADIOLIB_ERR_NONE);
+        printf("Got preamble at SF%d, RSSI %f!\n", sf, lora->getRSSI());
+        break;
+      }
+    }
   }
 
   if (state == RADIOLIB_ERR_NONE) {
 
-    int msg_length = lora->getPacketLength(false);
+    int msg_length = lora->getPacketLength();
     float freqErr = 0.0f;
 
-    enrichWithRadioStats(lora, pkt, freqErr);
+    // without the edge timestamp the closest estimate of RxDone is before the FIFO readout
+    if (!edgeStamped) recvTsMicros -= spiReadoutMicros(cfg, msg_length);
+
+    lora->readPacketStats(pkt, freqErr);
 
     ++loraPacketStats.recv_packets;
     ++loraPacketStats.recv_packets_crc_good;
@@ -415,218 +440,101 @@ LoRaRecvStat recvLoRaUplinkData(PhysicalLayer *lora, PlatformInfo_t &cfg, LoRaDa
   return (insistDataReceiveFailure ? LoRaRecvStat::DATARECVFAIL : LoRaRecvStat::NODATA);
 } // }}}
 
-static struct DownlinkPacket
-{
-  bool initialised = false;
-
-  bool send_immediately;
-  std::time_t unix_epoch_timestamp;
-  uint32_t internal_ts_micros;
+// startTransmit() latency besides the SPI transfer of the payload, learned on the fly
+static int32_t txStartBaseLatencyUs = 300;
 
-  unsigned long concentrator_rf_chain;
+static int16_t transmitLoRaChipAt(ChipAdapter *lora, PlatformInfo_t &cfg, const DownlinkPacket_t &downlink_pkt) { // {{{
+  // the modem is configured already; what is left is the FIFO load and the TX opcode, so only that
+  // part's duration is started ahead of the deadline - the rest of the setup doesn't add jitter
+  int32_t payloadLoadUs = (int32_t) ((downlink_pkt.payload_size + 2) * spiByteMicros(cfg));
 
-  float output_power_dbm = 0;
-  SpreadingFactor_t spreading_factor = SpreadingFactor_t::SF_ALL;
-  float carrier_frequency_mhz = 0;
-  float bandwidth_khz = 0;
-  CodingRate_t coding_rate = CodingRate_t::CR_MIN;
-  unsigned char preamble_length = 8;
+  int32_t lateUs = sleep_until_micros(downlink_pkt.internal_ts_micros - (uint32_t) (txStartBaseLatencyUs + payloadLoadUs));
 
-  unsigned long fsk_datarate_bps = 0;
-  unsigned long fsk_freq_deviation_hz = 0;
+  uint32_t txCallMicros = micros();
+  int16_t result = lora->startTransmit(const_cast<uint8_t*>(downlink_pkt.payload), downlink_pkt.payload_size);
+  uint32_t txStartedMicros = micros();
 
-  bool iq_polatization_inversion = true;
+  if (result != RADIOLIB_ERR_NONE)
+  { return result; }
 
-  unsigned long payload_size = 0;
-  unsigned char payload[255];
+  int32_t measuredBaseUs = (int32_t) (txStartedMicros - txCallMicros) - payloadLoadUs;
+  if (measuredBaseUs < 0) measuredBaseUs = 0;
+  txStartBaseLatencyUs = (txStartBaseLatencyUs * 7 + measuredBaseUs) / 8;
 
-  bool disable_crc = true;
-} NO_DP_DATA;
-
-static DownlinkPacket downlinkTxJsonToPacket(PackagedDataToSend_t &pkt, const LoRaChipSettings_t &chip_settings) {
-    rapidjson::Document doc;
-    doc.Parse(reinterpret_cast<const char*>(pkt.data.get()));
-    if (doc.HasParseError()) {
-      logMessage("Failed to parse the JSON payload!\n");
-      return NO_DP_DATA;
-    }
-
-    if (!doc.IsObject() || !doc.HasMember("txpk") || !doc["txpk"].IsObject()) {
-      logMessage("No txpk recognized!\n");
-      return NO_DP_DATA;
-    }
+  if (lateUs > 1000)
+  { logMessage("DOWNlink transmission started %d us late!\n", lateUs); }
 
-    DownlinkPacket result;
+  int irqPin = lora->txDoneIrqPin(cfg.lora_chip_settings);
 
-    const rapidjson::Value& txpkt = doc["txpk"].GetObject();
-    result.send_immediately = (txpkt.HasMember("imme") ? txpkt["imme"].GetBool() : false);
-    if (!result.send_immediately && (txpkt.HasMember("tmst") || txpkt.HasMember("tmms"))) {
+  uint32_t timeOnAirUs = compute_time_on_air_us(
+    downlink_pkt.fsk_datarate_bps, downlink_pkt.payload_size, downlink_pkt.spreading_factor,
+    downlink_pkt.bandwidth_khz, downlink_pkt.coding_rate, downlink_pkt.preamble_length, !downlink_pkt.disable_crc);
 
-      bool isFutureSchedOk = false;
-
-      std::time_t now{std::time(nullptr)};
-      uint32_t internalTsMicrosNow = micros();
-
-      if (txpkt.HasMember("tmst")) {
-        uint32_t diffMicros = diff_timestamps(internalTsMicrosNow, txpkt["tmst"].GetUint(), isFutureSchedOk);
-
-        if ((!isFutureSchedOk && diffMicros > 1500000UL) || (isFutureSchedOk && diffMicros < UINT32_MAX - 20000000UL))
-        { isFutureSchedOk = true; }
-
-        result.internal_ts_micros = internalTsMicrosNow + diffMicros;
-        result.unix_epoch_timestamp = add_seconds(now, ((int)(diffMicros / 1000000U)) * (isFutureSchedOk ? 1 : -1));
-      } else {
-        double gpsTsMillis = txpkt["tmms"].GetDouble();
-        std::time_t scheduledTs = static_cast<std::time_t>(gps2unix(gpsTsMillis / 1000.0, false));
-
-        isFutureSchedOk = (now <= scheduledTs || now <= add_seconds(scheduledTs, 1));
-
-        result.unix_epoch_timestamp = scheduledTs;
-        result.internal_ts_micros = internalTsMicrosNow + static_cast<uint32_t>(difftime(scheduledTs, now) * 1000000.0);
-        result.internal_ts_micros += (remainder(gpsTsMillis, 1000.0) * 1000);
-      }
+  // no point in polling the IRQ line before the frame has had a chance to leave
+  sleep_until_micros(txStartedMicros + timeOnAirUs);
 
-      if (!isFutureSchedOk) {
-        logMessage("Invalid time scheduled: %lu (%lu internal ts micros); local ts %lu, internal ts(micros) %lu!\n",
-            result.unix_epoch_timestamp, result.internal_ts_micros, now, internalTsMicrosNow);
-        return NO_DP_DATA;
+  if (irqPin > -1) {
+    uint32_t timeoutMicros = txStartedMicros + timeOnAirUs + timeOnAirUs / 2 + 100000U;
+    while (!digitalRead(irqPin)) {
+      if ((int32_t) (micros() - timeoutMicros) > 0) {
+        lora->standby();
+        return RADIOLIB_ERR_TX_TIMEOUT;
       }
-    } else {
-      logMessage("Missing tx schedule!\n");
-      return NO_DP_DATA;
-    }
-
-    if (!txpkt.HasMember("modu")) {
-      logMessage("Missing tx modulation information!\n");
-      return NO_DP_DATA;
-    }
-    if (!txpkt.HasMember("datr")) {
-      logMessage("Missing tx data rate information!\n");
+      delayMicroseconds(100);
     }
+  }
 
-    if (txpkt.HasMember("freq"))
-    { result.carrier_frequency_mhz = static_cast<float>(txpkt["freq"].GetDouble()); }
-    if (txpkt.HasMember("rfch"))
-    { result.concentrator_rf_chain = txpkt["rfch"].GetUint(); }
-    if (txpkt.HasMember("powe"))
-    { result.output_power_dbm = static_cast<float>(txpkt["powe"].GetDouble()); }
-
-    bool isLoraModulation = (strcmp(txpkt["modu"].GetString(), "LORA") == 0 &&
-        txpkt["datr"].IsString() && txpkt.HasMember("codr"));
-    if (isLoraModulation) {
-      int sf = 0;
-      float bw = 0;
-
-      if (sscanf(txpkt["datr"].GetString(), "%*[SF]%d%*[BW]%f", &sf, &bw) < 2 ||
-          sf < SF_MIN || sf > SF_MAX || bw < 1.0F || bw > 500.0F) {
-        logMessage("Invalid SF or BW!\n");
-        return NO_DP_DATA;
-      }
-      result.spreading_factor = SpreadingFactor_t(sf);
-      result.bandwidth_khz = bw;
-
-      int cr = 0;
-      if (sscanf(txpkt["codr"].GetString(), "%*[4/]%d", &cr) < 1 ||
-          cr < CodingRate_t::CR_MIN || cr > CodingRate_t::CR_MAX) {
-        logMessage("Invalid codr!\n");
-        return NO_DP_DATA;
-      }
-      result.coding_rate = static_cast<CodingRate_t>(cr);
+  return lora->standby();
+} // }}}
 
-      if (txpkt.HasMember("ipol")) {
-        result.iq_polatization_inversion = txpkt["ipol"].GetBool();
-      }
+size_t scheduleLoRaDownlinkData() // {{{
+{
+  size_t scheduled = 0;
 
-    } else if (txpkt["datr"].IsNumber() && txpkt.HasMember("fdev")) {
-      result.fsk_datarate_bps = txpkt["datr"].GetUint();
-      result.fsk_freq_deviation_hz = txpkt["fdev"].GetUint();
-    } else {
-      logMessage("Invalid data rate / frequency deviation for the specified modulation!\n");
-      return NO_DP_DATA;
-    }
+  for (;;)
+  {
+    PackagedDataToSend_t pkt{DequeuePacket(DOWN_RX)};
+    if (pkt.data_len == 0) break;
 
-    if (txpkt.HasMember("prea")) {
-        int preamble = txpkt["prea"].GetUint();
-        if (preamble > 5 && preamble < 256) {
-          result.preamble_length = static_cast<unsigned char>(preamble);
-        } else {
-          logMessage("Invalid preamble length!\n");
-          return NO_DP_DATA;
-        }
-    } else if (result.fsk_datarate_bps != 0) {
-      result.preamble_length = 5;
-    }
+    logMessage("Received DOWNlink packet:\n");
+    hexPrint(pkt.body.data(), pkt.data_len, stdout);
 
-    if (txpkt.HasMember("size")) {
-      result.payload_size = txpkt["size"].GetUint();
-      if (result.payload_size > 255) {
-        logMessage("Invalid payload size!\n");
-        return NO_DP_DATA;
-      }
-    }
+    uint32_t nowMicros = micros();
+    uint32_t txMicros = (pkt.downlink() ? pkt.downlink()->internal_ts_micros : nowMicros);
+    bool immediately = (pkt.downlink() && pkt.downlink()->send_immediately);
+    time_t when = (pkt.downlink() ? pkt.downlink()->unix_epoch_timestamp : std::time(nullptr));
+    DownlinkAck_t txAck = PrepareDownlinkAck(pkt);
 
-    if (txpkt.HasMember("data")) {
-      result.payload_size = b64_to_bin(txpkt["data"].GetString(), txpkt["data"].GetStringLength(), result.payload, 255);
+    DownlinkScheduleResult_t result = ScheduleDownlink(std::move(pkt), nowMicros);
+    AcknowledgeDownlink(std::move(txAck), DownlinkScheduleTxAckError(result));
+    if (result != DL_SCHEDULED)
+    {
+      logMessage("DOWNlink packet rejected: %s\n", DecodeDownlinkScheduleResult(result));
+      continue;
     }
 
-    if (txpkt.HasMember("ncrc")) {
-      result.disable_crc = txpkt["ncrc"].GetBool();
+    ++scheduled;
+    if (immediately)
+    { logMessage("Scheduling DOWNlink packet for immediate transmission\n"); }
+    else
+    {
+      char asciiTime[25];
+      ts_asciitime(when, asciiTime, sizeof(asciiTime));
+      logMessage("Scheduling DOWNlink packet for %s (in %d ms)\n", asciiTime, ((int32_t) (txMicros - nowMicros)) / 1000);
     }
+  }
 
-    uint32_t usCorrection = compute_rf_tx_timestamp_correction_us(
-      result.fsk_datarate_bps, result.payload_size, result.spreading_factor, result.bandwidth_khz,
-      result.coding_rate, !result.disable_crc, false, chip_settings.spi_speed_hz);
-
-    result.internal_ts_micros -= usCorrection;
-
-    if (usCorrection >= 1000000U)
-    { result.unix_epoch_timestamp -= (usCorrection / 1000000U); }
-
-    result.initialised = true;
-    return result;
-}
+  return scheduled;
+} // }}}
 
-LoRaRecvStat sendLoRaDownlinkData(PhysicalLayer *lora, PlatformInfo_t &cfg, PackagedDataToSend_t &pkt,
+LoRaRecvStat sendLoRaDownlinkData(ChipAdapter *lora, PlatformInfo_t &cfg, PackagedDataToSend_t &pkt,
                                   LoRaPacketTrafficStats_t &loraPacketStats) // {{{
 {
-  bool newPacket = false;
-  if (!pkt.logged)
-  {
-    logMessage("Received DOWNlink packet:\n");
-    hexPrint(pkt.data.get(), pkt.data_len, stdout);
-    pkt.logged = true;
-    newPacket = true;
-  }
-
-  DownlinkPacket converted = downlinkTxJsonToPacket(pkt, cfg.lora_chip_settings);
-  if (!converted.initialised)
+  // decoded upon arrival and handed over by the downlink scheduler once due
+  if (!pkt.downlink() || !pkt.downlink()->initialised)
   { return LoRaRecvStat::DATARECVFAIL; }
 
-  time_t now{std::time(nullptr)};
-  time_t when = (converted.send_immediately ? now : (newPacket ? converted.unix_epoch_timestamp : pkt.schedule));
-
-  if (!converted.send_immediately)
-  {
-    if (now < add_seconds(when, -2))
-    {
-      if (newPacket)
-      {
-        pkt.schedule = converted.unix_epoch_timestamp;
-        char asciiTime[25];
-        ts_asciitime(converted.unix_epoch_timestamp, asciiTime, sizeof(asciiTime));
-        logMessage("Scheduling DOWNlink packet for %s\n", asciiTime);
-      }
-      RequeuePacket(std::move(pkt), 7000000, DOWN_RX);
-      return LoRaRecvStat::DATARECVFAIL;
-    }
-    else if (now > add_seconds(when, 1))
-    {
-      char asciiTime[25];
-      ts_asciitime(converted.unix_epoch_timestamp, asciiTime, sizeof(asciiTime));
-      logMessage("DOWNlink packet's schedule's too late: %s\n", asciiTime);
-      return LoRaRecvStat::DATARECVFAIL;
-    }
-  }
+  DownlinkPacket_t converted{*pkt.downlink()};
 
   if (converted.spreading_factor == SF_ALL)
   { converted.spreading_factor = cfg.lora_chip_settings.spreading_factor; }
@@ -639,51 +547,33 @@ LoRaRecvStat sendLoRaDownlinkData(PhysicalLayer *lora, PlatformInfo_t &cfg, Pack
   if (converted.output_power_dbm > 20.0f)
   { converted.output_power_dbm = 20.0f; }
 
-  doRestartLoRaChip(lora, cfg);
-
-  int8_t currentLimit_ma = 100, gain = 0;
-  bool is_reinitted = false;
-  uint16_t result = RADIOLIB_ERR_NONE + 1;
-
-  MODULE_REINIT_FOR_TX(SX1261, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(SX1262, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(SX1268, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(LLCC68, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(SX1272, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(SX1273, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(SX1276, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(SX1277, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(SX1278, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(SX1279, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(RFM95, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(RFM96, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
-  MODULE_REINIT_FOR_TX(RFM97, lora, is_reinitted, result, cfg, converted, currentLimit_ma, gain);
+  const RadioModemState_t txState = txModemState(converted);
+  continuousRxArmed = false;
 
-  if (result == RADIOLIB_ERR_NONE)
+  // RX -> TX with a few register writes when possible, the full chip reset is only a fallback
+  uint16_t result = reconfigureLoRaChip(lora, txState);
+  if (result != RADIOLIB_ERR_NONE)
   {
-    bool is_delayed = false;
-    MODULE_DELAY_TRANSMISSION(SX1261, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(SX1262, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(SX1268, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(LLCC68, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(SX1272, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(SX1273, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(SX1276, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(SX1277, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(SX1278, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(SX1279, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(RFM95, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(RFM96, lora, is_delayed, converted.internal_ts_micros);
-    MODULE_DELAY_TRANSMISSION(RFM97, lora, is_delayed, converted.internal_ts_micros);
-    result = lora->transmit(converted.payload, converted.payload_size);
+    doRestartLoRaChip(lora, cfg);
+
+    int8_t currentLimit_ma = 100, gain = 0;
+    result = lora->beginForTx(cfg.lora_chip_settings, converted, currentLimit_ma, gain);
+
+    lora->modem_state = txState;
+    lora->modem_state.valid = (result == RADIOLIB_ERR_NONE);
   }
 
+  if (result == RADIOLIB_ERR_NONE)
+  { result = transmitLoRaChipAt(lora, cfg, converted); }
+
   if (result == RADIOLIB_ERR_NONE)
   { ++loraPacketStats.downlink_tx_packets; }
   else
   { logMessage("Transmission error: %d\n", result); }
 
-  restartLoRaChip(lora, cfg);
+  // TX -> RX the same way, the chip gets fully reinitialised only after FSK or errors
+  if (result != RADIOLIB_ERR_NONE || reconfigureLoRaChip(lora, rxModemState(cfg, rxOutputPowerDbm)) != RADIOLIB_ERR_NONE)
+  { restartLoRaChip(lora, cfg); }
 
   return (result == RADIOLIB_ERR_NONE ? LoRaRecvStat::NODATA : LoRaRecvStat::DATARECVFAIL);
 }  //}}}
@@ -8,21 +8,26 @@
 #include <PhysicalLayer/PhysicalLayer.h>
 #include "ConfigFileParser.h"
 #include "UdpUtils.h"
+#include "ChipAdapter.h"
 
 
 enum class LoRaRecvStat { NODATA, DATARECV, DATARECVFAIL };
 
-PhysicalLayer* instantiateLoRaChip(LoRaChipSettings_t& lora_chip_settings, SPIClass &spiClass,
-                                   SPISettings &spiSettings);
+ChipAdapter* instantiateLoRaChip(LoRaChipSettings_t& lora_chip_settings, SPIClass &spiClass,
+                                 SPISettings &spiSettings);
 
-uint16_t restartLoRaChip(PhysicalLayer *lora, PlatformInfo_t &cfg);
+uint16_t restartLoRaChip(ChipAdapter *lora, PlatformInfo_t &cfg);
+
+bool setupLoRaRxEdgeEvents(ChipAdapter *lora, PlatformInfo_t &cfg);
 
 void hexPrint(uint8_t data[], int length, FILE *dest);
 
-LoRaRecvStat recvLoRaUplinkData(PhysicalLayer *lora, PlatformInfo_t &cfg, LoRaDataPkt_t &pkt,
+LoRaRecvStat recvLoRaUplinkData(ChipAdapter *lora, PlatformInfo_t &cfg, LoRaDataPkt_t &pkt,
                                 uint8_t msg[], LoRaPacketTrafficStats_t &loraPacketStats);
 
-LoRaRecvStat sendLoRaDownlinkData(PhysicalLayer *lora, PlatformInfo_t &cfg, PackagedDataToSend_t &pkt,
+size_t scheduleLoRaDownlinkData();
+
+LoRaRecvStat sendLoRaDownlinkData(ChipAdapter *lora, PlatformInfo_t &cfg, PackagedDataToSend_t &pkt,
                                   LoRaPacketTrafficStats_t &loraPacketStats);
 
 const char* decodeRadioLibErrorCode(short errorCode);
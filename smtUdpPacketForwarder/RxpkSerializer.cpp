@@ -0,0 +1,243 @@
+#include "RxpkSerializer.h"
+#include "base64/base64.h"
+#include "gpsTimestampUtils/GpsTimestampUtils.h"
+#include "rapidjson/internal/dtoa.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#define LSNR_TABLE_MIN_TENTHS -400
+#define LSNR_TABLE_MAX_TENTHS 400
+#define DTOA_BUFFER_SIZE 25   /* what rapidjson::Writer reserves for a double */
+
+// the literals and the numbers besides the fragments and the payload never need more than that
+#define RXPK_FIXED_MAX_LENGTH 256
+
+typedef struct RxpkRadioFragment
+{
+  bool valid = false;
+  double freq_mhz;
+  double bandwidth_khz;
+  SpreadingFactor_t sf;
+  CodingRate_t coding_rate;
+
+  // freq value up to the rssi key: 868.1,"chan":0,...,"codr":"4/5","rssi":
+  char text[160];
+  size_t len;
+} RxpkRadioFragment_t;
+
+typedef struct RxpkTimeFragment
+{
+  bool valid = false;
+  time_t tv_sec;
+  char text[24];   // YYYY-MM-DDTHH:MM:SS
+  size_t len;
+} RxpkTimeFragment_t;
+
+typedef struct LsnrText
+{
+  char text[8];
+  uint8_t len;
+} LsnrText_t;
+
+static RxpkRadioFragment_t radio_fragment;
+static RxpkTimeFragment_t time_fragment;
+static LsnrText_t lsnr_texts[LSNR_TABLE_MAX_TENTHS - LSNR_TABLE_MIN_TENTHS + 1];
+static bool lsnr_texts_ready = false;
+
+static inline char* AppendLiteral(char *p, const char *literal, size_t len) // {{{
+{
+  memcpy(p, literal, len);
+  return p + len;
+} // }}}
+
+#define APPEND_LITERAL(p, literal) AppendLiteral((p), (literal), sizeof(literal) - 1)
+
+static char* AppendUint(char *p, uint64_t value) // {{{
+{
+  char digits[20];
+  int n = 0;
+
+  do
+  {
+    digits[n++] = (char) ('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+
+  while (n > 0) *p++ = digits[--n];
+  return p;
+} // }}}
+
+static char* AppendInt(char *p, int64_t value) // {{{
+{
+  if (value >= 0) return AppendUint(p, (uint64_t) value);
+
+  *p++ = '-';
+  return AppendUint(p, 0 - (uint64_t) value);
+} // }}}
+
+static void UpdateRadioFragment(const LoRaDataPkt_t &pkt, CodingRate_t coding_rate) // {{{
+{
+  RxpkRadioFragment_t &frag = radio_fragment;
+  if (frag.valid && frag.freq_mhz == pkt.freq_mhz && frag.bandwidth_khz == pkt.bandwidth_khz &&
+      frag.sf == pkt.sf && frag.coding_rate == coding_rate)
+  { return; }
+
+  // the formatting (and its truncation) of the former encoder, only done when these values change
+  char datr[32];
+  snprintf(datr, sizeof(datr), "SF%hhuBW%g", pkt.sf, pkt.bandwidth_khz);
+  datr[sizeof("SFxxBWxxxxxx") - 1] = '\0';
+
+  char cr[4] = "4/x";
+  snprintf(cr, sizeof(cr), "4/%d", coding_rate);
+
+  char *p = rapidjson::internal::dtoa(pkt.freq_mhz, frag.text, 6);
+  p = APPEND_LITERAL(p, ",\"chan\":0,\"rfch\":0,\"stat\":1,\"modu\":\"LORA\",\"datr\":\"");
+  p = AppendLiteral(p, datr, strlen(datr));
+  p = APPEND_LITERAL(p, "\",\"codr\":\"");
+  p = AppendLiteral(p, cr, strlen(cr));
+  p = APPEND_LITERAL(p, "\",\"rssi\":");
+
+  frag.len = p - frag.text;
+  frag.freq_mhz = pkt.freq_mhz;
+  frag.bandwidth_khz = pkt.bandwidth_khz;
+  frag.sf = pkt.sf;
+  frag.coding_rate = coding_rate;
+  frag.valid = true;
+} // }}}
+
+static char* AppendTime(char *p, const struct timeval &now) // {{{
+{
+  RxpkTimeFragment_t &frag = time_fragment;
+  if (!frag.valid || frag.tv_sec != now.tv_sec)
+  {
+    struct tm tm;
+    frag.len = 0;
+    if (gmtime_r(&now.tv_sec, &tm) != NULL)
+    { frag.len = strftime(frag.text, sizeof(frag.text), "%FT%T", &tm); }
+
+    frag.tv_sec = now.tv_sec;
+    frag.valid = true;
+  }
+
+  // like iso8601_utc_extended_now, an empty string if the date can't be formatted
+  if (frag.len == 0) return p;
+
+  p = AppendLiteral(p, frag.text, frag.len);
+  *p++ = '.';
+  uint32_t usec = (uint32_t) now.tv_usec;
+  for (int i = 5; i >= 0; --i)
+  {
+    p[i] = (char) ('0' + usec % 10);
+    usec /= 10;
+  }
+  p += 6;
+  *p++ = 'Z';
+  return p;
+} // }}}
+
+static void PrepareLsnrTexts() // {{{
+{
+  char buffer[DTOA_BUFFER_SIZE];
+
+  for (int tenths = LSNR_TABLE_MIN_TENTHS; tenths <= LSNR_TABLE_MAX_TENTHS; ++tenths)
+  {
+    LsnrText_t &entry = lsnr_texts[tenths - LSNR_TABLE_MIN_TENTHS];
+    float lsnr = static_cast<float>(tenths) / 10;
+    char *end = rapidjson::internal::dtoa(lsnr, buffer, 1);
+
+    entry.len = (uint8_t) (end - buffer);
+    memcpy(entry.text, buffer, entry.len);
+  }
+  lsnr_texts_ready = true;
+} // }}}
+
+static char* AppendLsnr(char *p, float snr) // {{{
+{
+  if (!lsnr_texts_ready) PrepareLsnrTexts();
+
+  float tenths = std::round(snr * 10);
+  if (tenths >= LSNR_TABLE_MIN_TENTHS && tenths <= LSNR_TABLE_MAX_TENTHS && !(tenths == 0 && std::signbit(tenths)))
+  {
+    const LsnrText_t &entry = lsnr_texts[(int) tenths - LSNR_TABLE_MIN_TENTHS];
+    return AppendLiteral(p, entry.text, entry.len);
+  }
+
+  return rapidjson::internal::dtoa(tenths / 10, p, 1);
+} // }}}
+
+// writes the {...} element of the rxpk array at p, nullptr if the payload didn't fit before end
+static char* AppendRxpkElement(char *p, char *end, const LoRaDataPkt_t &pkt, const struct timeval &now) // {{{
+{
+  // unix epoch in seconds ts to GPS timestamp in millis
+  uint64_t tmms = std::round( (unix2gps(now.tv_sec, false) * 1000.0) + (now.tv_usec / 1000) );
+
+  p = APPEND_LITERAL(p, "{\"time\":\"");
+  p = AppendTime(p, now);
+  p = APPEND_LITERAL(p, "\",\"tmms\":");
+  p = AppendUint(p, tmms);
+  p = APPEND_LITERAL(p, ",\"tmst\":");
+  p = AppendUint(p, pkt.internal_recv_ts_us);
+  p = APPEND_LITERAL(p, ",\"freq\":");
+  p = AppendLiteral(p, radio_fragment.text, radio_fragment.len);
+  p = AppendInt(p, (int) pkt.RSSI);
+  p = APPEND_LITERAL(p, ",\"lsnr\":");
+  p = AppendLsnr(p, pkt.SNR);
+  p = APPEND_LITERAL(p, ",\"size\":");
+  p = AppendUint(p, pkt.msg_sz);
+  p = APPEND_LITERAL(p, ",\"data\":\"");
+
+  int b64_len = bin_to_b64(pkt.msg, pkt.msg_sz, p, (int) (end - p));
+  if (b64_len < 0) return nullptr;
+  p += b64_len;
+
+  return APPEND_LITERAL(p, "\"}");
+} // }}}
+
+static size_t RxpkRoomNeeded(const LoRaDataPkt_t &pkt, CodingRate_t coding_rate) // {{{
+{
+  UpdateRadioFragment(pkt, coding_rate);
+
+  size_t b64_len_max = (pkt.msg_sz + 2) / 3 * 4;
+  return RXPK_FIXED_MAX_LENGTH + radio_fragment.len + b64_len_max;
+} // }}}
+
+int SerializeRxpk(char *dest, size_t dest_sz, const LoRaDataPkt_t &pkt, CodingRate_t coding_rate, const struct timeval &now) // {{{
+{
+  // see https://github.com/Lora-net/packet_forwarder/blob/master/PROTOCOL.TXT
+  if (dest_sz < RxpkRoomNeeded(pkt, coding_rate))
+  { return -1; }
+
+  char *p = APPEND_LITERAL(dest, "{\"rxpk\":[");
+  p = AppendRxpkElement(p, dest + dest_sz, pkt, now);
+  if (p == nullptr) return -1;
+
+  p = APPEND_LITERAL(p, "]}");
+  *p = '\0';
+
+  return (int) (p - dest);
+} // }}}
+
+int AppendRxpk(char *dest, size_t dest_sz, size_t json_len, const LoRaDataPkt_t &pkt, CodingRate_t coding_rate,
+               const struct timeval &now) // {{{
+{
+  // in place of the closing ]}
+  if (json_len < 2 || dest_sz < json_len + 1 + RxpkRoomNeeded(pkt, coding_rate))
+  { return -1; }
+
+  char *p = dest + json_len - 2;
+  *p++ = ',';
+  p = AppendRxpkElement(p, dest + dest_sz, pkt, now);
+  if (p == nullptr)
+  {
+    memcpy(dest + json_len - 2, "]}", 3);
+    return -1;
+  }
+
+  p = APPEND_LITERAL(p, "]}");
+  *p = '\0';
+
+  return (int) (p - dest);
+} // }}}
@@ -0,0 +1,21 @@
+#ifndef LORA_PF_RXPK_SERIALIZER_H
+#define LORA_PF_RXPK_SERIALIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/time.h>
+
+#include "config.h"
+
+// Formats the PUSH_DATA JSON object of one received packet, i.e. {"rxpk":[{...}]}, straight into dest.
+// The output is byte for byte what the rapidjson::Writer based encoding produced, but it's put together
+// from literal fragments and integer formatting; the fields that rarely change (freq, datr, codr) are
+// formatted once and reused until they differ. Not thread safe, meant for the radio thread only.
+// Returns the length of the JSON (no null char is counted, but one is written) or -1 if it didn't fit.
+int SerializeRxpk(char *dest, size_t dest_sz, const LoRaDataPkt_t &pkt, CodingRate_t coding_rate, const struct timeval &now);
+// Adds the element of another received packet to the rxpk array of the json_len bytes SerializeRxpk wrote to dest.
+// Returns the new length of the JSON or -1 if it didn't fit, the JSON being left as it was.
+int AppendRxpk(char *dest, size_t dest_sz, size_t json_len, const LoRaDataPkt_t &pkt, CodingRate_t coding_rate,
+               const struct timeval &now);
+
+#endif
@@ -0,0 +1,232 @@
+#include "ServerEndpoints.h"
+#include "HostResolver.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static_assert(SERVER_MAX_ENDPOINTS >= RESOLVER_MAX_ADDRESSES, "a server keeps all the addresses of its host");
+
+static inline bool SameAddress(const struct sockaddr_in6 &a, const struct sockaddr_in6 &b) // {{{
+{
+  return a.sin6_port == b.sin6_port && memcmp(&a.sin6_addr, &b.sin6_addr, sizeof(a.sin6_addr)) == 0;
+} // }}}
+
+bool RefreshServerEndpoints(Server_t &server, int family) // {{{
+{
+  HostAddresses_t resolved;
+  resolved.generation = server.endpoints_generation;
+
+  if (!LookupHost(server.address.c_str(), resolved))
+  { return server.endpoints_count > 0; }
+
+  if (resolved.generation == server.endpoints_generation)
+  { return server.endpoints_count > 0; }
+
+  ServerEndpoint_t previous[SERVER_MAX_ENDPOINTS];
+  uint8_t previousCount = server.endpoints_count;
+  memcpy(previous, server.endpoints, sizeof(previous));
+  struct sockaddr_in6 current = server.endpoints[server.current_endpoint].addr;
+
+  server.endpoints_count = 0;
+  server.current_endpoint = 0;
+
+  for (size_t i = 0; i < resolved.count; ++i)
+  {
+    if (family == AF_INET && !IN6_IS_ADDR_V4MAPPED(&resolved.addrs[i].sin6_addr))
+    { continue; } // no IPv6 here
+
+    ServerEndpoint_t &endpoint = server.endpoints[server.endpoints_count];
+    endpoint.addr = resolved.addrs[i];
+    endpoint.addr.sin6_port = htons(server.port);
+    endpoint.srtt_ms = -1;
+    endpoint.missed_acks = 0;
+    endpoint.last_ack = Clock::time_point();
+    endpoint.last_miss = Clock::time_point();
+
+    for (uint8_t j = 0; j < previousCount; ++j)
+    {
+      if (SameAddress(previous[j].addr, endpoint.addr))
+      { endpoint = previous[j]; break; }
+    }
+
+    if (previousCount > 0 && SameAddress(endpoint.addr, current))
+    { server.current_endpoint = server.endpoints_count; }
+
+    ++server.endpoints_count;
+  }
+
+  server.endpoints_generation = resolved.generation;
+  return server.endpoints_count > 0;
+} // }}}
+
+int SelectServerEndpoint(Server_t &server, bool probe) // {{{
+{
+  if (server.endpoints_count == 0)
+  { return -1; }
+
+  Clock::time_point now = Clock::now();
+
+  // the measured ones that still answer first, the fastest of them
+  int best = -1;
+  for (int i = 0; i < server.endpoints_count; ++i)
+  {
+    const ServerEndpoint_t &endpoint = server.endpoints[i];
+    if (endpoint.missed_acks >= ENDPOINT_MAX_MISSED_ACKS)
+    { continue; }
+
+    if (best < 0 || (endpoint.srtt_ms >= 0 &&
+        (server.endpoints[best].srtt_ms < 0 || endpoint.srtt_ms < server.endpoints[best].srtt_ms)))
+    { best = i; }
+  }
+
+  // none of them answers, go round them, the one that failed the longest ago first
+  if (best < 0)
+  {
+    best = 0;
+    for (int i = 1; i < server.endpoints_count; ++i)
+    {
+      if (server.endpoints[i].last_miss < server.endpoints[best].last_miss)
+      { best = i; }
+    }
+  }
+
+  if (probe)
+  {
+    int candidate = -1;
+    for (int i = 0; i < server.endpoints_count; ++i)
+    {
+      const ServerEndpoint_t &endpoint = server.endpoints[i];
+      if (i == best || now - endpoint.last_ack < std::chrono::seconds(ENDPOINT_PROBE_INTERVAL_S))
+      { continue; }
+      if (endpoint.missed_acks >= ENDPOINT_MAX_MISSED_ACKS &&
+          now - endpoint.last_miss < std::chrono::seconds(ENDPOINT_RETRY_INTERVAL_S))
+      { continue; }
+
+      if (candidate < 0 || endpoint.last_ack < server.endpoints[candidate].last_ack)
+      { candidate = i; }
+    }
+
+    if (candidate >= 0)
+    { return candidate; }
+  }
+
+  if (best != server.current_endpoint)
+  {
+    char from[INET6_ADDRSTRLEN + 8], to[INET6_ADDRSTRLEN + 8];
+    printf("Switching %s from %s to %s\n", server.address.c_str(),
+      ServerEndpointToString(server.endpoints[server.current_endpoint], from, sizeof(from)),
+      ServerEndpointToString(server.endpoints[best], to, sizeof(to)));
+    server.current_endpoint = (uint8_t) best;
+  }
+
+  return best;
+} // }}}
+
+int FindServerEndpoint(const Server_t &server, const struct sockaddr *addr, socklen_t addr_len) // {{{
+{
+  struct sockaddr_in6 wanted;
+  memset(&wanted, 0, sizeof(wanted));
+
+  if (addr->sa_family == AF_INET && addr_len >= sizeof(struct sockaddr_in))
+  {
+    const struct sockaddr_in *in = (const struct sockaddr_in *) addr;
+    wanted.sin6_port = in->sin_port;
+    wanted.sin6_addr.s6_addr[10] = 0xFF;
+    wanted.sin6_addr.s6_addr[11] = 0xFF;
+    memcpy(&wanted.sin6_addr.s6_addr[12], &in->sin_addr, 4);
+  }
+  else if (addr->sa_family == AF_INET6 && addr_len >= sizeof(struct sockaddr_in6))
+  {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+    wanted.sin6_port = in6->sin6_port;
+    wanted.sin6_addr = in6->sin6_addr;
+  }
+  else
+  { return -1; }
+
+  for (int i = 0; i < server.endpoints_count; ++i)
+  {
+    if (SameAddress(server.endpoints[i].addr, wanted))
+    { return i; }
+  }
+  return -1;
+} // }}}
+
+socklen_t ServerEndpointSockaddr(const ServerEndpoint_t &endpoint, int family, struct sockaddr_storage &result) // {{{
+{
+  memset(&result, 0, sizeof(result));
+
+  if (family == AF_INET6)
+  {
+    memcpy(&result, &endpoint.addr, sizeof(endpoint.addr));
+    return sizeof(endpoint.addr);
+  }
+
+  if (!IN6_IS_ADDR_V4MAPPED(&endpoint.addr.sin6_addr))
+  { return 0; }
+
+  struct sockaddr_in *in = (struct sockaddr_in *) &result;
+  in->sin_family = AF_INET;
+  in->sin_port = endpoint.addr.sin6_port;
+  memcpy(&in->sin_addr, &endpoint.addr.sin6_addr.s6_addr[12], 4);
+  return sizeof(*in);
+} // }}}
+
+void RecordEndpointAck(Server_t &server, int endpoint, uint32_t generation, double rtt_ms) // {{{
+{
+  if (endpoint < 0 || generation != server.endpoints_generation)
+  { return; }
+
+  ServerEndpoint_t &target = server.endpoints[endpoint];
+  target.srtt_ms = (target.srtt_ms < 0 ? rtt_ms : target.srtt_ms + (rtt_ms - target.srtt_ms) / 8);
+  target.missed_acks = 0;
+  target.last_ack = Clock::now();
+} // }}}
+
+void RecordEndpointMiss(Server_t &server, int endpoint, uint32_t generation) // {{{
+{
+  if (endpoint < 0 || generation != server.endpoints_generation)
+  { return; }
+
+  ServerEndpoint_t &target = server.endpoints[endpoint];
+  target.last_miss = Clock::now();
+
+  if (++target.missed_acks == ENDPOINT_MAX_MISSED_ACKS)
+  {
+    char text[INET6_ADDRSTRLEN + 8];
+    printf("%s at %s stopped answering\n", server.address.c_str(), ServerEndpointToString(target, text, sizeof(text)));
+  }
+} // }}}
+
+bool ServerAnswering(const Server_t &server) // {{{
+{
+  for (int i = 0; i < server.endpoints_count; ++i)
+  {
+    const ServerEndpoint_t &endpoint = server.endpoints[i];
+    if (endpoint.srtt_ms >= 0 && endpoint.missed_acks == 0 && endpoint.last_ack > endpoint.last_miss)
+    { return true; }
+  }
+  return false;
+} // }}}
+
+const char* ServerEndpointToString(const ServerEndpoint_t &endpoint, char *buffer, size_t buffer_sz) // {{{
+{
+  char text[INET6_ADDRSTRLEN];
+  const struct in6_addr &addr = endpoint.addr.sin6_addr;
+
+  if (IN6_IS_ADDR_V4MAPPED(&addr))
+  {
+    inet_ntop(AF_INET, &addr.s6_addr[12], text, sizeof(text));
+    snprintf(buffer, buffer_sz, "%s:%hu", text, ntohs(endpoint.addr.sin6_port));
+  }
+  else
+  {
+    inet_ntop(AF_INET6, &addr, text, sizeof(text));
+    snprintf(buffer, buffer_sz, "[%s]:%hu", text, ntohs(endpoint.addr.sin6_port));
+  }
+  return buffer;
+} // }}}
@@ -0,0 +1,37 @@
+#ifndef LORA_PF_SERVER_ENDPOINTS_H
+#define LORA_PF_SERVER_ENDPOINTS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+
+#include "config.h"
+
+#define ENDPOINT_MAX_MISSED_ACKS 2     /* in a row, then the datagrams go to the next address */
+#define ENDPOINT_RETRY_INTERVAL_S 60   /* before an address that stopped answering gets probed again */
+#define ENDPOINT_PROBE_INTERVAL_S 60   /* how old the RTT of an address not in use may get */
+
+// Each server keeps all the addresses its host name resolves to, along with the RTT of their ACKs.
+// The datagrams go to the fastest address that still answers, the stat ones (first attempts only)
+// probe the other addresses now and then, so that their RTT is known. For the network exchange thread only.
+
+// Takes over the addresses from the host resolver whenever they change, the ones already known keep their stats.
+// Returns false if there's no address usable with a socket of that family.
+bool RefreshServerEndpoints(Server_t &server, int family);
+// The endpoint to send to, or -1 if there's none
+int SelectServerEndpoint(Server_t &server, bool probe);
+// The endpoint with that address and port, or -1
+int FindServerEndpoint(const Server_t &server, const struct sockaddr *addr, socklen_t addr_len);
+// The address of the endpoint for a socket of that family, returns its length (0 if not applicable)
+socklen_t ServerEndpointSockaddr(const ServerEndpoint_t &endpoint, int family, struct sockaddr_storage &result);
+
+// generation is the server's endpoints_generation at the time of sending, stale samples are ignored
+void RecordEndpointAck(Server_t &server, int endpoint, uint32_t generation, double rtt_ms);
+void RecordEndpointMiss(Server_t &server, int endpoint, uint32_t generation);
+
+// Whether the last datagram sent to one of its addresses got acknowledged
+bool ServerAnswering(const Server_t &server);
+
+const char* ServerEndpointToString(const ServerEndpoint_t &endpoint, char *buffer, size_t buffer_sz);
+
+#endif
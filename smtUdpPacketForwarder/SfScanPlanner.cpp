@@ -0,0 +1,139 @@
+#include "SfScanPlanner.h"
+
+#include <cmath>
+
+#define SF_SCAN_COUNT (SF_MAX - SF7 + 1)
+
+typedef struct SfScanState
+{
+  uint32_t symbol_us = 0;
+  uint32_t preamble_us = 0;
+  uint32_t dwell_us = 0;
+
+  bool scanned = false;
+  uint32_t last_end_us = 0;
+  double heat = 0.0;
+
+  uint32_t scans = 0;
+  uint32_t preambles = 0;
+  uint64_t observed_us = 0;
+  uint64_t blind_us = 0;
+  uint64_t detection_latency_us = 0;
+} SfScanState_t;
+
+static SfScanState_t sf_states[SF_SCAN_COUNT];
+
+static inline int32_t TsDiff(uint32_t a, uint32_t b) // {{{
+{
+  return (int32_t) (a - b);
+} // }}}
+
+static uint32_t DetectionWindowUs(const SfScanState_t &state) // {{{
+{
+  // a CAD has to start early enough to fit entirely within the preamble
+  return (state.preamble_us > state.dwell_us ? state.preamble_us - state.dwell_us : state.dwell_us);
+} // }}}
+
+static uint32_t RevisitIntervalUs(const SfScanState_t &state) // {{{
+{
+  return (uint32_t) (DetectionWindowUs(state) / (1.0 + state.heat));
+} // }}}
+
+void SfScanPlannerSetup(double bandwidth_khz, uint16_t preamble_length) // {{{
+{
+  if (bandwidth_khz <= 0.0) bandwidth_khz = 125.0;
+
+  for (int i = 0; i < SF_SCAN_COUNT; ++i)
+  {
+    SfScanState_t &state = sf_states[i];
+    state = SfScanState_t{};
+    state.symbol_us = (uint32_t) ((double) (1U << (SF7 + i)) * 1000.0 / bandwidth_khz);
+    state.preamble_us = state.symbol_us * preamble_length;
+    state.dwell_us = state.symbol_us * SF_SCAN_INITIAL_CAD_SYMBOLS;
+  }
+} // }}}
+
+SpreadingFactor_t SfScanNext(uint32_t now_us) // {{{
+{
+  int best = 0;
+  int32_t best_slack_us = INT32_MAX;
+
+  for (int i = 0; i < SF_SCAN_COUNT; ++i)
+  {
+    const SfScanState_t &state = sf_states[i];
+    if (!state.scanned)
+    { return SpreadingFactor_t(SF7 + i); }
+
+    int32_t slack_us = TsDiff(state.last_end_us + RevisitIntervalUs(state), now_us);
+    if (slack_us < best_slack_us)
+    {
+      best_slack_us = slack_us;
+      best = i;
+    }
+  }
+
+  return SpreadingFactor_t(SF7 + best);
+} // }}}
+
+void SfScanRecord(SpreadingFactor_t sf, uint32_t started_us, uint32_t finished_us, bool preamble_detected) // {{{
+{
+  if (sf < SF7 || sf > SF_MAX) return;
+  SfScanState_t &state = sf_states[sf - SF7];
+
+  uint32_t dwell_us = finished_us - started_us;
+  state.dwell_us = (state.scans == 0 ? dwell_us : (state.dwell_us * 7 + dwell_us) / 8);
+
+  if (state.scanned)
+  {
+    uint32_t gap_us = (TsDiff(started_us, state.last_end_us) > 0 ? started_us - state.last_end_us : 0);
+    uint32_t window_us = DetectionWindowUs(state);
+
+    // any preamble that started more than one window before this scan is gone unnoticed
+    state.observed_us += gap_us + dwell_us;
+    if (gap_us > window_us) state.blind_us += gap_us - window_us;
+
+    state.heat *= std::pow(0.5, (gap_us + dwell_us) / (SF_SCAN_HEAT_HALF_LIFE_S * 1000000.0));
+
+    if (preamble_detected)
+    { state.detection_latency_us += (gap_us < window_us ? gap_us : window_us) / 2 + dwell_us; }
+  }
+
+  ++state.scans;
+  if (preamble_detected)
+  {
+    ++state.preambles;
+    state.heat += 1.0;
+  }
+
+  state.scanned = true;
+  state.last_end_us = finished_us;
+} // }}}
+
+SfScanStats_t GetSfScanStats(SpreadingFactor_t sf) // {{{
+{
+  SfScanStats_t result{};
+  if (sf < SF7 || sf > SF_MAX) return result;
+
+  const SfScanState_t &state = sf_states[sf - SF7];
+  result.scans = state.scans;
+  result.preambles = state.preambles;
+  result.cad_dwell_us = state.dwell_us;
+  result.avg_detection_latency_us = (state.preambles > 0 ? (uint32_t) (state.detection_latency_us / state.preambles) : 0);
+  result.blind_ratio = (state.observed_us > 0 ? (float) ((double) state.blind_us / state.observed_us) : 0.0f);
+  result.heat = (float) state.heat;
+  return result;
+} // }}}
+
+void PrintSfScanStats(FILE *dest) // {{{
+{
+  fprintf(dest, "Spreading factor scan statistics:\n");
+  for (int sf = SF7; sf <= SF_MAX; ++sf)
+  {
+    SfScanStats_t stats = GetSfScanStats(SpreadingFactor_t(sf));
+    fprintf(dest, "  SF%-2d scans=%u preambles=%u CAD=%u us latency~%u us blind~%.1f%% heat=%.2f\n", sf,
+      stats.scans, stats.preambles, stats.cad_dwell_us, stats.avg_detection_latency_us,
+      stats.blind_ratio * 100.0f, stats.heat);
+  }
+  fprintf(dest, "\n");
+  fflush(dest);
+} // }}}
@@ -0,0 +1,34 @@
+#ifndef LORA_PF_SF_SCAN_PLANNER_H
+#define LORA_PF_SF_SCAN_PLANNER_H
+
+#include <cstdio>
+#include <cstdint>
+
+#include "config.h"
+
+#define SF_SCAN_HEAT_HALF_LIFE_S 600   /* how fast the preamble hits of a spreading factor are forgotten */
+#define SF_SCAN_INITIAL_CAD_SYMBOLS 2  /* assumed CAD duration until it gets measured */
+
+typedef struct SfScanStats
+{
+  uint32_t scans;
+  uint32_t preambles;
+  uint32_t cad_dwell_us;
+  uint32_t avg_detection_latency_us; // from the preamble start till its CAD hit, estimated
+  float blind_ratio;                 // share of the time a preamble could have passed unnoticed
+  float heat;
+} SfScanStats_t;
+
+// Orders the channel activity scans of all_spreading_factors mode. Each spreading factor has to be
+// revisited before a preamble of it could fully pass by, so the next one to scan is the one whose
+// window closes first. The windows of the recently active spreading factors are shortened.
+// All of the functions below must be called from the radio thread only.
+
+void SfScanPlannerSetup(double bandwidth_khz, uint16_t preamble_length);
+SpreadingFactor_t SfScanNext(uint32_t now_us);
+void SfScanRecord(SpreadingFactor_t sf, uint32_t started_us, uint32_t finished_us, bool preamble_detected);
+
+SfScanStats_t GetSfScanStats(SpreadingFactor_t sf);
+void PrintSfScanStats(FILE *dest);
+
+#endif
@@ -0,0 +1,245 @@
+#include "SimRadio.h"
+#include "TimeUtils.h"
+
+#include <cstring>
+
+// receive() gives up after that many symbols without a preamble, like the RX single mode does
+static const uint32_t rxSingleTimeoutSymbols = 100;
+static const uint32_t cadSymbols = 2;
+
+static inline int32_t TsDiff(uint32_t a, uint32_t b) // {{{
+{
+  return (int32_t) (a - b);
+} // }}}
+
+SimRadioAdapter::SimRadioAdapter(const LoRaChipSettings_t &settings) // {{{
+  : sim(settings.sim), bandwidth_khz(settings.bandwidth_khz), coding_rate(settings.coding_rate),
+    preamble_length(settings.preamble_length), current_sf(settings.spreading_factor), rng(settings.sim.seed),
+    next_uplink_end_us(0), next_uplink_sf(SF7), preamble_locked(false),
+    uplinks_generated(0), uplinks_delivered(0), uplinks_missed(0), transmissions(0), last_length(0),
+    tx_log(nullptr)
+{
+  if (sim.payload_size > sizeof(last_payload)) sim.payload_size = sizeof(last_payload);
+  if (sim.mean_interval_ms == 0) sim.mean_interval_ms = 1;
+
+  if (!sim.tx_log_file.empty())
+  {
+    tx_log = fopen(sim.tx_log_file.c_str(), "w");
+    if (tx_log == nullptr) perror(sim.tx_log_file.c_str());
+    else fprintf(tx_log, "started_us,bytes,freq_mhz,bw_khz,sf,power_dbm\n");
+  }
+
+  next_uplink_end_us = micros();
+  scheduleNextUplink();
+} // }}}
+
+SimRadioAdapter::~SimRadioAdapter() // {{{
+{
+  printStats(stdout);
+  if (tx_log != nullptr) fclose(tx_log);
+} // }}}
+
+uint32_t SimRadioAdapter::symbolMicros(uint8_t sf) const // {{{
+{
+  return (uint32_t) ((double) (1U << sf) * 1000.0 / bandwidth_khz);
+} // }}}
+
+uint32_t SimRadioAdapter::uplinkTimeOnAir(uint8_t sf) const // {{{
+{
+  return compute_time_on_air_us(0, sim.payload_size, sf, bandwidth_khz, coding_rate, preamble_length, true);
+} // }}}
+
+void SimRadioAdapter::scheduleNextUplink() // {{{
+{
+  next_uplink_sf = (sim.spreading_factor == SF_ALL ?
+    (uint8_t) std::uniform_int_distribution<int>(SF7, SF_MAX)(rng) : (uint8_t) sim.spreading_factor);
+
+  double interval_ms = sim.mean_interval_ms;
+  if (sim.arrival_process == SIM_ARRIVAL_POISSON)
+  { interval_ms = std::exponential_distribution<double>(1.0 / sim.mean_interval_ms)(rng); }
+
+  // the transmitter is half-duplex too, the next frame can't start before the previous one ended
+  uint32_t interval_us = (uint32_t) (interval_ms * 1000.0);
+  uint32_t toa_us = uplinkTimeOnAir(next_uplink_sf);
+  next_uplink_end_us += (interval_us > toa_us ? interval_us : toa_us);
+
+  preamble_locked = false;
+  ++uplinks_generated;
+} // }}}
+
+void SimRadioAdapter::dropPassedUplinks(uint32_t now_us) // {{{
+{
+  // uplinks whose preamble is over by now went by unnoticed - not listening, wrong SF or busy with TX
+  for (;;)
+  {
+    uint32_t preamble_end_us = next_uplink_end_us - uplinkTimeOnAir(next_uplink_sf) +
+      preamble_length * symbolMicros(next_uplink_sf);
+
+    if (preamble_locked ? TsDiff(next_uplink_end_us, now_us) >= 0 : TsDiff(preamble_end_us, now_us) > 0)
+    { break; }
+
+    ++uplinks_missed;
+    scheduleNextUplink();
+  }
+} // }}}
+
+int16_t SimRadioAdapter::deliverUplink(uint8_t *data, size_t len) // {{{
+{
+  bool crc_error = std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) < sim.crc_error_ratio;
+
+  // an unconfirmed data up MHDR, the sequence number, then filler
+  last_length = sim.payload_size;
+  last_payload[0] = 0x40;
+  for (size_t i = 1; i < last_length; ++i)
+  { last_payload[i] = (i < 5 ? (uint8_t) (uplinks_generated >> (8 * (i - 1))) : (uint8_t) rng()); }
+
+  memcpy(data, last_payload, (len < last_length ? len : last_length));
+
+  ++uplinks_delivered;
+  scheduleNextUplink();
+
+  return (crc_error ? RADIOLIB_ERR_CRC_MISMATCH : RADIOLIB_ERR_NONE);
+} // }}}
+
+void SimRadioAdapter::reset(RADIOLIB_PIN_TYPE reset_pin) // {{{
+{ } // }}}
+
+int16_t SimRadioAdapter::begin(const LoRaChipSettings_t &settings, int8_t power, uint8_t current_limit_ma, uint8_t gain) // {{{
+{
+  current_sf = settings.spreading_factor;
+  return RADIOLIB_ERR_NONE;
+} // }}}
+
+int16_t SimRadioAdapter::beginForTx(const LoRaChipSettings_t &settings, const DownlinkPacket_t &downlink_pkt,
+                                    uint8_t current_limit_ma, uint8_t gain) // {{{
+{
+  current_sf = downlink_pkt.spreading_factor;
+  return RADIOLIB_ERR_NONE;
+} // }}}
+
+int16_t SimRadioAdapter::applyModemState(RadioModemState_t &current, const RadioModemState_t &target) // {{{
+{
+  current = target;
+  current_sf = target.spreading_factor;
+  return RADIOLIB_ERR_NONE;
+} // }}}
+
+int16_t SimRadioAdapter::setSpreadingFactor(uint8_t sf) // {{{
+{
+  current_sf = sf;
+  return RADIOLIB_ERR_NONE;
+} // }}}
+
+int16_t SimRadioAdapter::scanChannel() // {{{
+{
+  uint32_t start_us = micros();
+  uint32_t end_us = start_us + cadSymbols * symbolMicros(current_sf);
+
+  dropPassedUplinks(start_us);
+  sleep_until_micros(end_us);
+
+  uint32_t preamble_start_us = next_uplink_end_us - uplinkTimeOnAir(next_uplink_sf);
+  uint32_t preamble_end_us = preamble_start_us + preamble_length * symbolMicros(next_uplink_sf);
+
+  if (next_uplink_sf == current_sf && TsDiff(preamble_start_us, start_us) <= 0 && TsDiff(end_us, preamble_end_us) <= 0)
+  {
+    preamble_locked = true;
+    return RADIOLIB_PREAMBLE_DETECTED;
+  }
+
+  return RADIOLIB_CHANNEL_FREE;
+} // }}}
+
+int16_t SimRadioAdapter::startContinuousReceive() // {{{
+{
+  return RADIOLIB_ERR_NONE;
+} // }}}
+
+int16_t SimRadioAdapter::receive(uint8_t *data, size_t len) // {{{
+{
+  uint32_t now_us = micros();
+  uint32_t timeout_us = now_us + rxSingleTimeoutSymbols * symbolMicros(current_sf);
+
+  for (;;)
+  {
+    dropPassedUplinks(now_us);
+
+    uint32_t preamble_start_us = next_uplink_end_us - uplinkTimeOnAir(next_uplink_sf);
+    if (TsDiff(preamble_start_us, timeout_us) > 0)
+    { break; }
+
+    if (next_uplink_sf != current_sf)
+    {
+      // not demodulable at this SF, it just passes by
+      ++uplinks_missed;
+      scheduleNextUplink();
+      continue;
+    }
+
+    sleep_until_micros(next_uplink_end_us);
+    return deliverUplink(data, len);
+  }
+
+  sleep_until_micros(timeout_us);
+  return RADIOLIB_ERR_RX_TIMEOUT;
+} // }}}
+
+int16_t SimRadioAdapter::readData(uint8_t *data, size_t len) // {{{
+{
+  memcpy(data, last_payload, (len < last_length ? len : last_length));
+  return RADIOLIB_ERR_NONE;
+} // }}}
+
+size_t SimRadioAdapter::getPacketLength() // {{{
+{
+  return last_length;
+} // }}}
+
+int16_t SimRadioAdapter::startTransmit(uint8_t *data, size_t len) // {{{
+{
+  uint32_t started_us = micros();
+  ++transmissions;
+
+  if (tx_log != nullptr)
+  {
+    fprintf(tx_log, "%u,%u,%.6f,%.3f,%u,%d\n", started_us, (unsigned) len, modem_state.carrier_frequency_mhz,
+      modem_state.bandwidth_khz, (unsigned) current_sf, (int) modem_state.output_power_dbm);
+    fflush(tx_log);
+  }
+
+  return RADIOLIB_ERR_NONE;
+} // }}}
+
+int16_t SimRadioAdapter::standby() // {{{
+{
+  return RADIOLIB_ERR_NONE;
+} // }}}
+
+void SimRadioAdapter::readPacketStats(LoRaDataPkt_t &pkt, float &freq_err) // {{{
+{
+  pkt.RSSI = sim.rssi_dbm;
+  pkt.SNR = sim.snr_db;
+  freq_err = 0.0f;
+} // }}}
+
+float SimRadioAdapter::getRSSI() // {{{
+{
+  return sim.rssi_dbm;
+} // }}}
+
+int SimRadioAdapter::txDoneIrqPin(const LoRaChipSettings_t &settings) // {{{
+{
+  return -1; // the transmission is over once its time on air has passed
+} // }}}
+
+int SimRadioAdapter::rxDoneGpioLine(const LoRaChipSettings_t &settings) // {{{
+{
+  return -1;
+} // }}}
+
+void SimRadioAdapter::printStats(FILE *dest) // {{{
+{
+  fprintf(dest, "Simulated radio: %u uplinks generated, %u delivered, %u missed, %u transmissions accepted\n",
+    uplinks_generated, uplinks_delivered, uplinks_missed, transmissions);
+  fflush(dest);
+} // }}}
@@ -0,0 +1,70 @@
+#ifndef LORA_PF_SIM_RADIO_H
+#define LORA_PF_SIM_RADIO_H
+
+#include <cstdio>
+#include <cstdint>
+#include <random>
+
+#include "ChipAdapter.h"
+
+// Hardware-free radio, selected with ic_model "SIM". It generates uplinks according to the
+// configured arrival process and accepts the downlink transmissions, logging when they started.
+// Everything runs in the micros() time base, so the forwarder itself works unchanged against it.
+class SimRadioAdapter : public ChipAdapter
+{
+  public:
+    explicit SimRadioAdapter(const LoRaChipSettings_t &settings);
+    ~SimRadioAdapter();
+
+    void reset(RADIOLIB_PIN_TYPE reset_pin) override;
+    int16_t begin(const LoRaChipSettings_t &settings, int8_t power, uint8_t current_limit_ma, uint8_t gain) override;
+    int16_t beginForTx(const LoRaChipSettings_t &settings, const DownlinkPacket_t &downlink_pkt,
+                       uint8_t current_limit_ma, uint8_t gain) override;
+    int16_t applyModemState(RadioModemState_t &current, const RadioModemState_t &target) override;
+    int16_t setSpreadingFactor(uint8_t sf) override;
+    int16_t scanChannel() override;
+    int16_t startContinuousReceive() override;
+
+    int16_t receive(uint8_t *data, size_t len) override;
+    int16_t readData(uint8_t *data, size_t len) override;
+    size_t getPacketLength() override;
+    int16_t startTransmit(uint8_t *data, size_t len) override;
+    int16_t standby() override;
+
+    void readPacketStats(LoRaDataPkt_t &pkt, float &freq_err) override;
+    float getRSSI() override;
+    int txDoneIrqPin(const LoRaChipSettings_t &settings) override;
+    int rxDoneGpioLine(const LoRaChipSettings_t &settings) override;
+
+    void printStats(FILE *dest);
+
+  private:
+    uint32_t symbolMicros(uint8_t sf) const;
+    uint32_t uplinkTimeOnAir(uint8_t sf) const;
+    void scheduleNextUplink();
+    void dropPassedUplinks(uint32_t now_us);
+    int16_t deliverUplink(uint8_t *data, size_t len);
+
+    SimRadioSettings_t sim;
+    double bandwidth_khz;
+    uint8_t coding_rate;
+    uint16_t preamble_length;
+    uint8_t current_sf;
+
+    std::mt19937 rng;
+
+    uint32_t next_uplink_end_us;   // its RxDone
+    uint8_t next_uplink_sf;
+    bool preamble_locked;          // a CAD has seen the next uplink, receive() may catch it late
+
+    uint32_t uplinks_generated;
+    uint32_t uplinks_delivered;
+    uint32_t uplinks_missed;
+    uint32_t transmissions;
+    size_t last_length;
+    uint8_t last_payload[256];
+
+    FILE *tx_log;
+};
+
+#endif
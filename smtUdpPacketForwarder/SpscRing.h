@@ -0,0 +1,112 @@
+#ifndef LORA_PF_SPSC_RING_H
+#define LORA_PF_SPSC_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bounded lock-free single-producer / single-consumer ring buffer.
+// push() may only be called from the producer thread, front() and pop()
+// only from the consumer one. Neither of them ever blocks.
+template<typename T>
+class SpscRing
+{
+  public:
+    explicit SpscRing(size_t capacity) : mask(roundUpPow2(capacity) - 1),
+      slots(new Slot[mask + 1]), head(0), tail(0), high_water(0), drops(0)
+    { }
+
+    ~SpscRing()
+    {
+      while (front() != nullptr) pop();
+    }
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    // the cache line alignment of the indices has to hold on the heap too, which C++14 new doesn't see to
+    static void* operator new(size_t size)
+    {
+      void *memory;
+      if (posix_memalign(&memory, alignof(SpscRing), size) != 0) throw std::bad_alloc();
+      return memory;
+    }
+
+    static void operator delete(void *memory)
+    { free(memory); }
+
+    bool push(T &&item)
+    {
+      size_t h = head.load(std::memory_order_relaxed);
+      size_t t = tail.load(std::memory_order_acquire);
+
+      if (h - t > mask)
+      {
+        drops.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+
+      new (&slots[h & mask]) T(std::move(item));
+      head.store(h + 1, std::memory_order_release);
+
+      uint32_t depth = (uint32_t) (h + 1 - t);
+      if (depth > high_water.load(std::memory_order_relaxed))
+      { high_water.store(depth, std::memory_order_relaxed); }
+
+      return true;
+    }
+
+    T* front()
+    {
+      size_t t = tail.load(std::memory_order_relaxed);
+      if (t == head.load(std::memory_order_acquire))
+      { return nullptr; }
+
+      return reinterpret_cast<T*>(&slots[t & mask]);
+    }
+
+    void pop()
+    {
+      size_t t = tail.load(std::memory_order_relaxed);
+      reinterpret_cast<T*>(&slots[t & mask])->~T();
+      tail.store(t + 1, std::memory_order_release);
+    }
+
+    size_t size() const
+    { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    size_t capacity() const
+    { return mask + 1; }
+
+    uint32_t highWaterMark() const
+    { return high_water.load(std::memory_order_relaxed); }
+
+    uint32_t dropped() const
+    { return drops.load(std::memory_order_relaxed); }
+
+  private:
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    static size_t roundUpPow2(size_t n)
+    {
+      size_t result = 1;
+      while (result < n) result <<= 1;
+      return result;
+    }
+
+    const size_t mask;
+    std::unique_ptr<Slot[]> slots;
+
+    // producer and consumer indices on separate cache lines to avoid false sharing
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) std::atomic<uint32_t> high_water;
+    std::atomic<uint32_t> drops;
+};
+
+#endif
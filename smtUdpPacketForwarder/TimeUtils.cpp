@@ -3,6 +3,8 @@
 #include <cstring>
 #include <mutex>
 #include <chrono>
+#include <cmath>
+#include <cerrno>
 
 std::mutex tm_mutex;
 
@@ -137,3 +139,67 @@ uint32_t compute_rf_tx_timestamp_correction_us(
 
     return offset + timestamp_correction + (uint32_t)(spi_freq_correction_ns / 1000);
 }
+
+uint32_t compute_time_on_air_us(
+  uint32_t fsk_datarate_bauds, uint32_t packet_size, uint32_t spreading_factor,
+  double bandwidth_khz, uint32_t coding_rate, uint32_t preamble_length, bool is_crc_enabled)
+{
+    if (fsk_datarate_bauds != 0)
+    {
+        // preamble + 3 bytes sync word + 1 byte length + payload + 2 bytes CRC
+        uint64_t bits = 8ULL * (preamble_length + 3 + 1 + packet_size + (is_crc_enabled ? 2 : 0));
+        return (uint32_t) ((bits * 1000000ULL) / fsk_datarate_bauds);
+    }
+
+    if (spreading_factor < 6 || spreading_factor > 12 || bandwidth_khz <= 0.0)
+    { return 0; }
+
+    // see the SX1276 datasheet, section 4.1.1.7 "Time on air"; explicit header assumed
+    double symbol_us = (double) (1U << spreading_factor) * 1000.0 / bandwidth_khz;
+    int low_dr_optimize = (symbol_us >= 16000.0 ? 1 : 0);
+
+    double payload_symbols = std::ceil(
+        (8.0 * packet_size - 4.0 * spreading_factor + 28 + (is_crc_enabled ? 16 : 0)) /
+        (4.0 * (spreading_factor - 2 * low_dr_optimize))
+    ) * coding_rate;
+
+    if (payload_symbols < 0) payload_symbols = 0;
+
+    return (uint32_t) ((preamble_length + 4.25 + 8 + payload_symbols) * symbol_us);
+}
+
+int32_t sleep_until_micros(uint32_t target_us)
+{
+    // coarse clock_nanosleep(), woken up early by the learned scheduler overshoot, then a short busy wait
+    static int32_t wakeup_overshoot_us = 100;
+    const int32_t spin_us = 200;
+
+    int32_t remaining_us = (int32_t) (target_us - micros());
+    int32_t sleep_us = remaining_us - spin_us - wakeup_overshoot_us;
+
+    if (sleep_us > 0)
+    {
+        uint32_t expected_wakeup_us = micros() + sleep_us;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += sleep_us / 1000000;
+        deadline.tv_nsec += (long) (sleep_us % 1000000) * 1000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR);
+
+        int32_t overshoot_us = (int32_t) (micros() - expected_wakeup_us);
+        if (overshoot_us < 0) overshoot_us = 0;
+        wakeup_overshoot_us = (wakeup_overshoot_us * 7 + overshoot_us) / 8;
+    }
+
+    uint32_t now_us;
+    while ((int32_t) (target_us - (now_us = micros())) > 0);
+
+    return (int32_t) (now_us - target_us);
+}
@@ -45,3 +45,10 @@ uint32_t compute_rf_tx_timestamp_correction_us(
   uint32_t fsk_rx_datarate_bauds, uint32_t packet_size, uint32_t spreading_factor,
   uint32_t bandwidth_khz, uint32_t coding_rate, bool is_crc_enabled, bool is_ppm_mode,
   uint32_t spi_freq_hz);
+
+uint32_t compute_time_on_air_us(
+  uint32_t fsk_datarate_bauds, uint32_t packet_size, uint32_t spreading_factor,
+  double bandwidth_khz, uint32_t coding_rate, uint32_t preamble_length, bool is_crc_enabled);
+
+// blocks until the internal micros() clock reaches target_us, returns how late that happened
+int32_t sleep_until_micros(uint32_t target_us);
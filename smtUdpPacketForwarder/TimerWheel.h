@@ -0,0 +1,197 @@
+#ifndef LORA_PF_TIMER_WHEEL_H
+#define LORA_PF_TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+// Hierarchical timer wheel owning the items scheduled on it: 4 levels of 64 slots, so that scheduling and
+// expiring are O(1) whatever the number of items. An item lands in the level whose slots are as coarse as its
+// distance in time and is moved down a level each time the coarser slot comes round, until it expires.
+// Not thread safe, the deadlines are rounded up to whole ticks.
+template<typename T>
+class TimerWheel
+{
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit TimerWheel(uint32_t tick_ms) : tick(std::chrono::milliseconds(tick_ms)), origin(Clock::now()),
+      current(0), count(0), free_nodes(NO_NODE)
+    {
+      for (auto &level : slots)
+        for (uint32_t &slot : level) slot = NO_NODE;
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    void schedule(T &&item, Clock::time_point due)
+    {
+      uint32_t index = free_nodes;
+      if (index == NO_NODE)
+      {
+        index = (uint32_t) nodes.size();
+        nodes.emplace_back();
+      }
+      else free_nodes = nodes[index].next;
+
+      Node &node = nodes[index];
+      node.item = std::move(item);
+      node.due_tick = std::max(toTick(due), current + 1);
+      insert(index);
+      ++count;
+    }
+
+    // Hands each item whose time has come over to onExpired(T&&), the earliest ticks first
+    template<typename F>
+    void advance(Clock::time_point now, F &&onExpired)
+    {
+      uint64_t target = (now <= origin ? 0 : (uint64_t) ((now - origin) / tick));
+      if (count == 0)
+      {
+        if (target > current) current = target;
+        return;
+      }
+
+      while (current < target && count > 0)
+      {
+        ++current;
+
+        // the coarser slots that come round get spread over the finer levels first
+        for (int level = 1; level < LEVELS && (current & ((1ULL << (SLOT_BITS * level)) - 1)) == 0; ++level)
+        {
+          uint32_t &slot = slots[level][(current >> (SLOT_BITS * level)) & SLOT_MASK];
+          uint32_t index = slot;
+          slot = NO_NODE;
+          while (index != NO_NODE)
+          {
+            uint32_t next = nodes[index].next;
+            insert(index);
+            index = next;
+          }
+        }
+
+        uint32_t &slot = slots[0][current & SLOT_MASK];
+        uint32_t index = slot;
+        slot = NO_NODE;
+        while (index != NO_NODE)
+        {
+          Node &node = nodes[index];
+          uint32_t next = node.next;
+          T item{std::move(node.item)};
+          release(index);
+          onExpired(std::move(item));
+          index = next;
+        }
+      }
+
+      if (current < target && count == 0) current = target;
+    }
+
+    // Time until the next item may expire, -1 if there's none
+    int msUntilNext(Clock::time_point now) const
+    {
+      if (count == 0) return -1;
+
+      // the next non empty slot of each level; those of the coarser ones only tell when they get spread
+      uint64_t earliest = UINT64_MAX;
+      for (int level = 0; level < LEVELS; ++level)
+      {
+        int shift = SLOT_BITS * level;
+        uint64_t position = current >> shift;
+        for (uint64_t step = 1; step <= SLOTS; ++step)
+        {
+          if (slots[level][(position + step) & SLOT_MASK] == NO_NODE) continue;
+
+          earliest = std::min(earliest, (position + step) << shift);
+          break;
+        }
+      }
+
+      auto due = origin + tick * (earliest == UINT64_MAX ? current + 1 : earliest);
+      return (due <= now ? 0 : (int) std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1);
+    }
+
+    // Hands all the items over to onReleased(T&&), whatever their deadline
+    template<typename F>
+    void drain(F &&onReleased)
+    {
+      for (auto &level : slots)
+      {
+        for (uint32_t &slot : level)
+        {
+          uint32_t index = slot;
+          slot = NO_NODE;
+          while (index != NO_NODE)
+          {
+            uint32_t next = nodes[index].next;
+            T item{std::move(nodes[index].item)};
+            release(index);
+            onReleased(std::move(item));
+            index = next;
+          }
+        }
+      }
+    }
+
+    size_t size() const
+    { return count; }
+
+  private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const uint64_t SLOTS = 1ULL << SLOT_BITS;
+    static const uint64_t SLOT_MASK = SLOTS - 1;
+    static const uint32_t NO_NODE = UINT32_MAX;
+
+    struct Node
+    {
+      T item;
+      uint64_t due_tick = 0;
+      uint32_t next = NO_NODE;
+    };
+
+    uint64_t toTick(Clock::time_point when) const
+    {
+      if (when <= origin) return 0;
+      return (uint64_t) ((when - origin + tick - Clock::duration(1)) / tick);
+    }
+
+    void insert(uint32_t index)
+    {
+      Node &node = nodes[index];
+      uint64_t delta = (node.due_tick > current ? node.due_tick - current : 1);
+
+      int level = 0;
+      while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1)))) ++level;
+
+      // beyond the coarsest level, the item waits in its last slot and gets spread again from there
+      uint64_t dueTick = (level == LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * LEVELS)) ?
+                          current + (1ULL << (SLOT_BITS * LEVELS)) - 1 : node.due_tick);
+
+      uint32_t &slot = slots[level][(dueTick >> (SLOT_BITS * level)) & SLOT_MASK];
+      node.next = slot;
+      slot = index;
+    }
+
+    void release(uint32_t index)
+    {
+      nodes[index].next = free_nodes;
+      free_nodes = index;
+      --count;
+    }
+
+    const Clock::duration tick;
+    const Clock::time_point origin;
+    uint64_t current;   // the last tick expired
+    size_t count;
+
+    std::vector<Node> nodes;
+    uint32_t free_nodes;
+    uint32_t slots[LEVELS][SLOTS];
+};
+
+#endif
@@ -1,26 +1,133 @@
 #include "UdpUtils.h"
 #include "TimeUtils.h"
+#include "RxpkSerializer.h"
+#include "ServerEndpoints.h"
+#include "HostResolver.h"
+#include "CircuitBreaker.h"
+#include "UplinkSpool.h"
+#include "rapidjson/document.h"
+#include <algorithm>
 #include <string>
 #include <utility>
+#include <type_traits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
 
-static std::queue<PackagedDataToSend> uplink_data_queue, downlink_tx_data_queue, downlink_recv_data_queue;
-static std::timed_mutex g_uplink_data_queue_mutex, g_downlink_tx_data_queue_mutex, g_downlink_rx_data_queue_mutex;
+static_assert(PACKET_BUFFER_POOL_MIN_SIZE >= MAX_PENDING_ACKS + 2 * DOWNLINK_RX_QUEUE_CAPACITY,
+              "the smallest pool holds the pending ACKs and the queued downlinks");
 
-static const std::map<Direction, std::queue<PackagedDataToSend>&> direction_to_queue = {
-  { UP_TX, uplink_data_queue },
-  { DOWN_TX, downlink_tx_data_queue },
-  { DOWN_RX, downlink_recv_data_queue }
-};
-static const std::map<Direction, std::timed_mutex&> direction_to_mutex = {
-  { UP_TX, g_uplink_data_queue_mutex },
-  { DOWN_TX, g_downlink_tx_data_queue_mutex },
-  { DOWN_RX, g_downlink_rx_data_queue_mutex }
+typedef std::unique_ptr<SpscRing<PackagedDataToSend_t>> PacketRing_t;
+
+typedef struct PacketQueue
+{
+  // lock-free, producer -> consumer; one per PriorityClass_t, a queue that doesn't tell them
+  // apart only has the PRIORITY_NORMAL one
+  PacketRing_t rings[PRIORITY_CLASSES];
+  // touched by the consumer thread only
+  TimerWheel<PackagedDataToSend_t> retries;       // waiting for their backoff to pass
+  int current_class;                              // weighted round robin among the rings
+  uint32_t credit;                                // packets current_class may still dequeue in a row
+
+  PacketQueue(size_t capacity) : retries(RETRY_TICK_MS), current_class(PRIORITY_NORMAL), credit(0)
+  {
+    rings[PRIORITY_NORMAL].reset(new SpscRing<PackagedDataToSend_t>(capacity));
+  }
+
+  PacketQueue(const PrioritySettings_t &settings) : retries(RETRY_TICK_MS), current_class(PRIORITY_CRITICAL),
+    credit(settings.weights[PRIORITY_CRITICAL])
+  {
+    for (int i = 0; i < PRIORITY_CLASSES; ++i)
+    { rings[i].reset(new SpscRing<PackagedDataToSend_t>(settings.depths[i])); }
+  }
+} PacketQueue_t;
+
+// indexed by Direction
+static PacketQueue_t packet_queues[] = {
+  { PrioritySettings_t() },         // UP_TX: radio thread -> network exchange worker
+  { DOWNLINK_TX_QUEUE_CAPACITY },   // DOWN_TX: radio thread -> network exchange worker
+  { DOWNLINK_RX_QUEUE_CAPACITY }    // DOWN_RX: network exchange worker -> radio thread
 };
 
-static Server_t NO_SERVER;
-PackagedDataToSend_t NO_PACKAGED_DATA{0UL, STAT_PUSH, 0UL, {}, NO_SERVER};
+static PrioritySettings_t priority_settings;
+
+static bool PushPacket(Direction direction, PriorityClass_t priority, PackagedDataToSend_t &&packet);
+
+// the PUSH_DATA the uplinks are being packed into, radio thread only
+typedef struct CoalescedUplinks
+{
+  PacketBufferRef body;
+  uint32_t json_len = 0;
+  uint16_t frames = 0;
+  PriorityClass_t priority = PRIORITY_NORMAL;
+  std::chrono::steady_clock::time_point due;
+} CoalescedUplinks_t;
 
-static std::map<std::string, std::pair<time_t, struct in_addr> > hostname_cache;
+static UplinkCoalescingSettings_t coalescing;
+static CoalescedUplinks_t coalesced;
+
+static SpscRing<DownlinkAck_t> downlink_acks(DOWNLINK_RX_QUEUE_CAPACITY);
+
+// signalled whenever there is something new for the network exchange worker to send
+static int packet_queue_event_fd = -1;
+// signalled whenever a downlink gets queued for the radio thread
+static int downlink_queue_event_fd = -1;
+
+// the ones packets refer to by index
+static std::vector<Server_t> *registered_servers = nullptr;
+
+// what each server gets on its own, so that one which doesn't answer holds back none of the others
+typedef struct ServerQueue
+{
+  std::deque<PackagedDataToSend_t> due[2];   // UP_TX, DOWN_TX: retries whose time has come, and replayed uplinks
+  // UP_TX, DOWN_TX: dequeued while it had no pending ACK slot left or no address yet, in the order dequeued;
+  // as many as its direction queues at most, it's cut off past that
+  std::unique_ptr<SpscRing<PackagedDataToSend_t>> held[2];
+  double retry_tokens = 0;                   // token bucket of its retries, both directions
+  std::chrono::steady_clock::time_point retry_tokens_at;
+  size_t pending = 0;                        // pending ACK slots it holds
+} ServerQueue_t;
+
+// indexed like the registered servers
+static std::vector<ServerQueue_t> server_queues;
+static size_t pending_slots_per_server = MAX_PENDING_ACKS;
+// the server whose due, and held, packets get dequeued first next time, by direction
+static size_t next_due_server[2] = { 0, 0 };
+static size_t next_held_server[2] = { 0, 0 };
+
+static RetransmissionSettings_t retransmission;
+
+typedef struct PendingAck
+{
+  bool in_use = false;
+  uint8_t generation = 0;
+  int socket;
+  uint16_t token;
+  uint16_t server;
+  PackagedDataToSend_t packet;
+  Direction direction;
+  std::chrono::steady_clock::time_point sent_at;
+  int endpoint;                     // of the destination server, as of its endpoints_generation then
+  uint32_t endpoints_generation;
+  struct sockaddr_storage dest;
+  socklen_t dest_len;
+} PendingAck_t;
+
+// datagrams sent, but not acknowledged yet; the low byte of the token is the slot, the high one
+// changes each time the slot is taken, so an ACK finds its datagram without any lookup structure
+static PendingAck_t pending_acks[MAX_PENDING_ACKS];
+static uint8_t free_pending_slots[MAX_PENDING_ACKS];
+static size_t free_pending_count = 0;
+static size_t pending_count = 0;
+
+static_assert(MAX_PENDING_ACKS <= 256, "the pending ACK slot has to fit the low byte of the token");
+static_assert(TX_BUFF_UP_SIZE <= PACKET_BUFFER_SIZE && RX_BUFF_DOWN_SIZE <= PACKET_BUFFER_SIZE,
+              "the datagrams are composed in packet buffers");
+static_assert(std::is_trivially_destructible<ReceivedDownlink_t>::value && sizeof(ReceivedDownlink_t) <= PACKET_BUFFER_SIZE,
+              "decoded downlinks are kept in packet buffers");
+
+static bool MatchPendingAck(int socket, const char *resp, int respSz, const struct sockaddr *from, socklen_t fromLen,
+                            std::function<void(PackagedDataToSend_t&, Direction)> *onAcked);
 
 void Die(const char *s) // {{{
 {
@@ -28,79 +135,179 @@ void Die(const char *s) // {{{
   exit(1);
 } // }}}
 
-bool SolveHostname(const char* p_hostname, uint16_t port, struct sockaddr_in* p_sin) // {{{
+static void SizeHeldPackets() // {{{
 {
-  auto iterator = hostname_cache.find(p_hostname);
-  if (iterator != hostname_cache.end() && iterator->second.first > std::time(nullptr))
+  // a server is never further behind than the queue of the direction would have let it be
+  size_t capacity[2] = { 0, DOWNLINK_TX_QUEUE_CAPACITY };
+  for (uint32_t depth : priority_settings.depths) capacity[UP_TX] += depth;
+
+  for (ServerQueue_t &serverQueue : server_queues)
   {
-     p_sin->sin_addr = iterator->second.second;
-     return true;
+    for (Direction direction : { UP_TX, DOWN_TX })
+    { serverQueue.held[direction].reset(new SpscRing<PackagedDataToSend_t>(capacity[direction])); }
   }
+} // }}}
 
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_protocol = IPPROTO_UDP;
+void RegisterServers(std::vector<Server_t> &servers) // {{{
+{
+  registered_servers = &servers;
+  server_queues = std::vector<ServerQueue_t>(servers.size());
+  pending_slots_per_server = std::max((size_t) 1, MAX_PENDING_ACKS / std::max((size_t) 1, servers.size()));
+  SizeHeldPackets();
 
-  char service[6] = { '\0' };
-  snprintf(service, 6, "%hu", port);
+  // the packets held for a server that had no address yet go as soon as it has one
+  SetHostResolvedNotifier(NotifyPacketQueue);
+} // }}}
 
-  struct addrinfo* p_result = NULL;
+void SetRetransmissionSettings(const RetransmissionSettings_t &settings) // {{{
+{
+  retransmission = settings;
+  for (ServerQueue_t &serverQueue : server_queues)
+  { serverQueue.retry_tokens = settings.max_per_s; }
+} // }}}
 
-  // Resolve the domain name into a list of addresses
-  int error = getaddrinfo(p_hostname, service, &hints, &p_result);
-  if (error != 0) {
-    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(error));
-    return false;
-  }
+void SetPriorityClasses(const PrioritySettings_t &settings) // {{{
+{
+  priority_settings = settings;
+
+  PacketQueue_t &queue = packet_queues[UP_TX];
+  for (int i = 0; i < PRIORITY_CLASSES; ++i)
+  { queue.rings[i].reset(new SpscRing<PackagedDataToSend_t>(settings.depths[i])); }
+  queue.current_class = PRIORITY_CRITICAL;
+  queue.credit = settings.weights[PRIORITY_CRITICAL];
 
-  // Loop over all returned results
-  for (struct addrinfo* p_rp = p_result; p_rp != NULL; p_rp = p_rp->ai_next) {
-    struct sockaddr_in* p_saddr = (struct sockaddr_in*)p_rp->ai_addr;
-    //printf("%s solved to %s\n", p_hostname, inet_ntoa(p_saddr->sin_addr));
-    p_sin->sin_addr = p_saddr->sin_addr;
-    hostname_cache[p_hostname] = std::make_pair(std::time(nullptr) + 300, p_saddr->sin_addr);
+  SizeHeldPackets();
+} // }}}
+
+Server_t& PacketDestination(const PackagedDataToSend_t &packet) // {{{
+{
+  return (*registered_servers)[packet.server];
+} // }}}
+
+static PendingAck_t* TakePendingSlot(uint16_t server) // {{{
+{
+  static bool initialised = false;
+  if (!initialised)
+  {
+    uint8_t generation = (uint8_t) rand(); /* random tokens */
+    for (size_t i = 0; i < MAX_PENDING_ACKS; ++i)
+    {
+      pending_acks[i].generation = generation;
+      free_pending_slots[i] = (uint8_t) (MAX_PENDING_ACKS - 1 - i);
+    }
+    free_pending_count = MAX_PENDING_ACKS;
+    initialised = true;
   }
 
-  freeaddrinfo(p_result);
-  return true;
+  if (free_pending_count == 0 || server_queues[server].pending >= pending_slots_per_server)
+  { return nullptr; }
+
+  uint8_t slot = free_pending_slots[--free_pending_count];
+  PendingAck_t &pending = pending_acks[slot];
+  pending.in_use = true;
+  pending.server = server;
+  ++server_queues[server].pending;
+  pending.token = (uint16_t) ((++pending.generation << 8) | slot);
+  ++pending_count;
+  return &pending;
 } // }}}
 
-bool RecvUdp(Server_t &server, char *msg, int size,
-             std::function<bool(char*, int, char*, int*)> &validator) // {{{
+static void ReleasePendingSlot(PendingAck_t &pending) // {{{
 {
-  NetworkConf_t &networkConf = server.downlink_network_cfg;
+  pending.in_use = false;
+  pending.packet = PackagedDataToSend_t();
+  free_pending_slots[free_pending_count++] = (uint8_t) (pending.token & 0xFF);
+  --server_queues[pending.server].pending;
+  --pending_count;
+} // }}}
 
-  networkConf.si_other.sin_port = htons(server.port);
+static void SendTxAck(int socket, const uint8_t header[PROTOCOL_HEADER_SIZE], const struct sockaddr *dest,
+                      socklen_t destLen, const char *error) // {{{
+{
+  // a successful one is the bare header
+  char ack[PROTOCOL_HEADER_SIZE + 64];
+  memcpy(ack, header, PROTOCOL_HEADER_SIZE);
+  int ackSize = PROTOCOL_HEADER_SIZE;
+  if (strcmp(error, "NONE") != 0)
+  { ackSize += snprintf(ack + PROTOCOL_HEADER_SIZE, sizeof(ack) - PROTOCOL_HEADER_SIZE, "{\"txpk_ack\":{\"error\":\"%s\"}}", error); }
+
+  sendto(socket, ack, ackSize, MSG_DONTWAIT, dest, destLen);
+} // }}}
 
-  if (!SolveHostname(server.address.c_str(), server.port, &networkConf.si_other))
-  { return false; }
+DownlinkAck_t PrepareDownlinkAck(const PackagedDataToSend_t &packet) // {{{
+{
+  DownlinkAck_t ack{};
+  ack.server = packet.server;
+  memcpy(ack.header, packet.header, PROTOCOL_HEADER_SIZE);
 
-  socklen_t srcAddrMaxSz = sizeof(networkConf.si_other2);
-  int maxAttempts = 2;
+  const ReceivedDownlink_t *received = packet.received();
+  if (received != nullptr)
+  {
+    ack.dest = received->source;
+    ack.dest_len = received->source_len;
+  }
+  return ack;
+} // }}}
+
+void AcknowledgeDownlink(DownlinkAck_t &&ack, const char *error) // {{{
+{
+  ack.error = error;
 
-  for (int i = 0; i < maxAttempts; ++i)
+  if (!downlink_acks.push(std::move(ack)))
   {
-    networkConf.si_other2_addr_len = srcAddrMaxSz;
-    int j = recvfrom(networkConf.socket, msg, size, 0,
-        (struct sockaddr *) &networkConf.si_other2, &networkConf.si_other2_addr_len);
+    printf("TX_ACK queue is full (%u dropped so far)! Giving up on that TX_ACK!\n", downlink_acks.dropped());
+    return;
+  }
+  NotifyPacketQueue();
+} // }}}
+
+size_t SendDownlinkAcks() // {{{
+{
+  size_t sent = 0;
 
-    if (j == -1)
+  for (DownlinkAck_t *ack = downlink_acks.front(); ack != nullptr; ack = downlink_acks.front())
+  {
+    // back to where its PULL_RESP came from, on the socket it came in on
+    if (ack->dest_len > 0)
     {
-      if (errno == EAGAIN) continue; // timeout
-      else return false;
+      SendTxAck((*registered_servers)[ack->server].downlink_network_cfg.socket, ack->header,
+                (struct sockaddr *) &ack->dest, ack->dest_len, ack->error);
+      ++sent;
     }
-    if (networkConf.si_other2_addr_len > srcAddrMaxSz ||
-        networkConf.si_other.sin_port != networkConf.si_other2.sin_port ||
-        networkConf.si_other.sin_addr.s_addr != networkConf.si_other2.sin_addr.s_addr) {
+    downlink_acks.pop();
+  }
 
-      // server sender address mismatch
-      if (i < maxAttempts - 1) continue;
-      else return false;
-    }
+  return sent;
+} // }}}
+
+int RecvUdp(uint16_t serverIndex, char *msg, int size,
+            std::function<bool(char*, int, DownlinkPacket_t&, char*, int*)> &validator) // {{{
+{
+  // never blocks: called when the socket is readable, all that has arrived is handled right away,
+  // each PULL_RESP validated and handed over to the radio thread, or TX_ACKed with the reason it's invalid
+  Server_t &server = (*registered_servers)[serverIndex];
+  NetworkConf_t &networkConf = server.downlink_network_cfg;
+
+  bool knownServer = RefreshServerEndpoints(server, networkConf.family);
+
+  struct sockaddr_storage from;
+  socklen_t srcAddrMaxSz = sizeof(from);
+  int queued = 0;
+
+  for (;;)
+  {
+    socklen_t fromLen = srcAddrMaxSz;
+    int j = recvfrom(networkConf.socket, msg, size, MSG_DONTWAIT, (struct sockaddr *) &from, &fromLen);
+
+    if (j == -1) break; // nothing more to read, or server connection error
+
+    if (!knownServer || fromLen > srcAddrMaxSz || FindServerEndpoint(server, (struct sockaddr *) &from, fromLen) < 0)
+    { continue; } // server sender address mismatch
 
-    uint8_t ack[12 + 22 + 219]= { PROTOCOL_VERSION, msg[1], msg[2], PKT_TX_ACK,
+    if (MatchPendingAck(networkConf.socket, msg, j, (struct sockaddr *) &from, fromLen, nullptr))
+    { continue; } // PULL_ACK of an earlier PULL_DATA
+
+    uint8_t ack[12 + 22 + 219]= { PROTOCOL_VERSION, (uint8_t) msg[1], (uint8_t) msg[2], PKT_TX_ACK,
         (uint8_t)networkConf.ifr.ifr_hwaddr.sa_data[0],
         (uint8_t)networkConf.ifr.ifr_hwaddr.sa_data[1],
         (uint8_t)networkConf.ifr.ifr_hwaddr.sa_data[2],
@@ -115,17 +322,37 @@ bool RecvUdp(Server_t &server, char *msg, int size,
 
     int jsonResponseSize = 219;
 
-    if (validator(msg, j, (char*)(ack + 12 + 22), &jsonResponseSize))
-    {
-      sendto(networkConf.socket, ack, 12, 0, (struct sockaddr *) &networkConf.si_other,
-          sizeof(networkConf.si_other));
-
-      uint8_t *packet = new uint8_t[j - 3];
-      memcpy(packet, msg + 4, j - 4);
-      packet[j - 4] = '\0';
-      EnqueuePacket(packet, j - 4, DOWNLINK_TRANSMIT, server, DOWN_RX);
+    // decoded straight into a buffer of the pool, the JSON goes along for the logs
+    PacketBufferRef payload = AcquirePacketBuffer();
+    PacketBufferRef decodedBuffer = AcquirePacketBuffer();
+    if (!payload || !decodedBuffer) {
+      printf("No packet buffer left for the downlink, dropping it!\n");
+      continue;
+    }
+    ReceivedDownlink_t *decoded = new (decodedBuffer.data()) ReceivedDownlink_t();
 
-      return true;
+    if (validator(msg, j, decoded->downlink, (char*)(ack + 12 + 22), &jsonResponseSize))
+    {
+      decoded->source = from;
+      decoded->source_len = fromLen;
+
+      memcpy(payload.data(), msg + 4, j - 4);
+      payload.data()[j - 4] = '\0';
+
+      // the TX_ACK goes along, it's only sent once the radio thread knows whether the downlink fits its schedule
+      PackagedDataToSend_t packet{ DOWNLINK_TRANSMIT, std::move(payload), (uint32_t) (j - 4), serverIndex,
+                                   std::move(decodedBuffer) };
+      memcpy(packet.header, ack, PROTOCOL_HEADER_SIZE);
+      packet.queued_at = std::chrono::steady_clock::now();
+
+      if (!PushPacket(DOWN_RX, PRIORITY_NORMAL, std::move(packet)))
+      {
+        SendTxAck(networkConf.socket, ack, (struct sockaddr *) &from, fromLen, "COLLISION_PACKET");
+        continue;
+      }
+
+      NotifyDownlinkQueue();
+      ++queued;
     }
     else
     {
@@ -134,90 +361,388 @@ bool RecvUdp(Server_t &server, char *msg, int size,
       ack[jsonResponseSize++] = '}';
       ack[jsonResponseSize++] = '}';
 
-      sendto(networkConf.socket, ack, jsonResponseSize, 0,
-          (struct sockaddr *) &networkConf.si_other, sizeof(networkConf.si_other));
+      sendto(networkConf.socket, ack, jsonResponseSize, MSG_DONTWAIT, (struct sockaddr *) &from, fromLen);
     }
   }
 
-  return false;
+  return queued;
 } // }}}
 
-bool SendUdp(Server_t &server, char *msg, int length, Direction direction,
-             std::function<bool(char*, int, char*, int)> &validator) // {{{
+static bool MatchPendingAck(int socket, const char *resp, int respSz, const struct sockaddr *from, socklen_t fromLen,
+                            std::function<void(PackagedDataToSend_t&, Direction)> *onAcked) // {{{
 {
-  NetworkConf_t &networkConf = (direction == UP_TX ? server.uplink_network_cfg : server.downlink_network_cfg);
+  if (resp == nullptr || respSz < 4 || resp[0] != PROTOCOL_VERSION ||
+      (resp[3] != PKT_PUSH_ACK && resp[3] != PKT_PULL_ACK))
+  { return false; }
 
-  networkConf.si_other.sin_port = htons(server.port);
- 
-  if (!SolveHostname(server.address.c_str(), server.port, &networkConf.si_other))
+  uint16_t token = (uint16_t) (((uint8_t) resp[1] << 8) | (uint8_t) resp[2]);
+  if ((token & 0xFF) >= MAX_PENDING_ACKS)
   { return false; }
-  
-  if (sendto(networkConf.socket, msg, length, 0, (struct sockaddr *) &networkConf.si_other,
-      sizeof(networkConf.si_other)) == -1)
+
+  PendingAck_t &pending = pending_acks[token & 0xFF];
+  if (!pending.in_use || pending.socket != socket || pending.token != token)
+  { return false; } // late or duplicated ACK
+
+  uint8_t expectedAck = (pending.direction == UP_TX ? PKT_PUSH_ACK : PKT_PULL_ACK);
+  if (resp[3] != expectedAck)
   { return false; }
 
-  char resp[32];
+  // a socket shared by several servers only takes the ACK from the address the datagram was sent to
+  Server_t &server = (*registered_servers)[pending.server];
+  int endpoint = FindServerEndpoint(server, from, fromLen);
+  if (endpoint < 0 || (pending.endpoints_generation == server.endpoints_generation && endpoint != pending.endpoint))
+  { return false; } // server sender address mismatch
+
+  RecordCircuitSuccess(server);
+
+  auto rtt = std::chrono::steady_clock::now() - pending.sent_at;
+  RecordEndpointAck(server, pending.endpoint, pending.endpoints_generation,
+                    std::chrono::duration<double, std::milli>(rtt).count());
+
+  if (onAcked != nullptr)
+  { (*onAcked)(pending.packet, pending.direction); }
+
+  ReleasePendingSlot(pending);
+  return true;
+} // }}}
+
+static int SendableInMs(size_t server, Direction direction, const PackagedDataToSend_t &packet,
+                        std::chrono::steady_clock::time_point now) // {{{
+{
+  // 0 if the packet can go to its server now, else the ms until it can, -1 if only an ACK (or its expiry)
+  // or the resolver can change that; the ones too old to wait for an address are given up by the sender
+  if (server_queues[server].pending >= pending_slots_per_server)
+  { return -1; }
+
+  Server_t &destination = (*registered_servers)[server];
+  NetworkConf_t &networkConf = (direction == UP_TX ? destination.uplink_network_cfg : destination.downlink_network_cfg);
+  if (RefreshServerEndpoints(destination, networkConf.family))
+  { return 0; }
+
+  auto expiry = packet.queued_at + std::chrono::seconds(retransmission.max_age_s);
+  return (expiry < now ? 0 : (int) std::chrono::duration_cast<std::chrono::milliseconds>(expiry - now).count() + 1);
+} // }}}
+
+static void HoldPacket(PackagedDataToSend_t &&packet, Direction direction,
+                       std::function<void(PackagedDataToSend_t&&, Direction)> &onRefused) // {{{
+{
+  SpscRing<PackagedDataToSend_t> &held = *server_queues[packet.server].held[direction];
+  if (!held.push(std::move(packet)))
+  { onRefused(std::move(packet), direction); }
+} // }}}
 
-  socklen_t srcAddrMaxSz = sizeof(networkConf.si_other2);
-  int maxAttempts = 2;
+size_t SendUdpBatchAsync(std::vector<PackagedDataToSend_t> &packets, Direction direction,
+                         std::function<void(PackagedDataToSend_t&&, Direction)> &onRefused) // {{{
+{
+  // one sendmmsg per run of datagrams going out through the same socket; each one is a 2 elements
+  // iovec, its own header and the body it shares with the copies for the other servers
+  struct mmsghdr msgs[SEND_BATCH_MAX];
+  struct iovec iovs[SEND_BATCH_MAX][2];
+  PendingAck_t *inFlight[SEND_BATCH_MAX];
+  size_t unsent = 0;
+
+  auto now = std::chrono::steady_clock::now();
+  size_t prepared = 0;
+
+  for (PackagedDataToSend_t &packet : packets)
+  {
+    if (prepared == SEND_BATCH_MAX || packet.data_len < PROTOCOL_HEADER_SIZE)
+    { packets[unsent++] = std::move(packet); continue; }
+
+    Server_t &server = PacketDestination(packet);
+    NetworkConf_t &networkConf = (direction == UP_TX ? server.uplink_network_cfg : server.downlink_network_cfg);
 
-  for (int i = 0; i < maxAttempts; ++i) {
-    networkConf.si_other2_addr_len = srcAddrMaxSz;
-    int j = recvfrom(networkConf.socket, resp, sizeof(resp), 0,
-        (struct sockaddr *) &networkConf.si_other2, &networkConf.si_other2_addr_len);
+    // a server that doesn't answer only gets the odd probe
+    if (!CircuitAllowsSend(server))
+    { onRefused(std::move(packet), direction); continue; }
 
-    if (j == -1) {
-      if (errno == EAGAIN) continue; // timeout
-      else return false; // server connection error
+    // not the server's fault, its name just hasn't resolved yet: nothing for the breaker, the packet
+    // is held until it's too old to be retried anyway
+    if (!RefreshServerEndpoints(server, networkConf.family))
+    {
+      if (now - packet.queued_at > std::chrono::seconds(retransmission.max_age_s))
+      { packets[unsent++] = std::move(packet); }
+      else
+      { HoldPacket(std::move(packet), direction, onRefused); }
+      continue;
     }
-    if (networkConf.si_other2_addr_len > srcAddrMaxSz ||
-        networkConf.si_other.sin_port != networkConf.si_other2.sin_port ||
-        networkConf.si_other.sin_addr.s_addr != networkConf.si_other2.sin_addr.s_addr) {
 
-      // server sender address mismatch
-      if (i < maxAttempts - 1) continue;
-      else return false;
+    // nothing wrong with the server, it has just used up its share of the pending ACKs
+    PendingAck_t *pending = TakePendingSlot(packet.server);
+    if (pending == nullptr)
+    { HoldPacket(std::move(packet), direction, onRefused); continue; }
+
+    // the first attempts of the stat datagrams measure the other addresses of the server
+    int endpoint = SelectServerEndpoint(server, packet.data_type == STAT_PUSH && packet.curr_attempt == 0);
+
+    pending->socket = networkConf.socket;
+    pending->direction = direction;
+    pending->sent_at = now;
+    pending->endpoint = endpoint;
+    pending->endpoints_generation = server.endpoints_generation;
+    pending->dest_len = ServerEndpointSockaddr(server.endpoints[endpoint], networkConf.family, pending->dest);
+    pending->packet = std::move(packet);
+
+    PackagedDataToSend_t &queued = pending->packet;
+    queued.header[1] = (uint8_t) (pending->token >> 8);
+    queued.header[2] = (uint8_t) (pending->token & 0xFF);
+
+    iovs[prepared][0].iov_base = queued.header;
+    iovs[prepared][0].iov_len = PROTOCOL_HEADER_SIZE;
+    iovs[prepared][1].iov_base = queued.body.data();
+    iovs[prepared][1].iov_len = queued.data_len - PROTOCOL_HEADER_SIZE;
+
+    memset(&msgs[prepared], 0, sizeof(msgs[prepared]));
+    msgs[prepared].msg_hdr.msg_name = &pending->dest;
+    msgs[prepared].msg_hdr.msg_namelen = pending->dest_len;
+    msgs[prepared].msg_hdr.msg_iov = iovs[prepared];
+    msgs[prepared].msg_hdr.msg_iovlen = (queued.body ? 2 : 1);
+
+    inFlight[prepared++] = pending;
+  }
+
+  size_t sent = 0;
+  for (size_t first = 0; first < prepared; )
+  {
+    int socket = inFlight[first]->socket;
+    size_t last = first + 1;
+    while (last < prepared && inFlight[last]->socket == socket) ++last;
+
+    int count = sendmmsg(socket, msgs + first, (unsigned int) (last - first), MSG_DONTWAIT);
+    if (count < 0) count = 0;
+
+    for (size_t i = first + count; i < last; ++i)
+    {
+      RecordCircuitFailure((*registered_servers)[inFlight[i]->server]);
+      packets[unsent++] = std::move(inFlight[i]->packet);
+      ReleasePendingSlot(*inFlight[i]);
     }
+
+    sent += count;
+    first = last;
   }
 
-  return validator(msg, length, resp, sizeof(resp));
+  // what's left for the caller to requeue
+  packets.resize(unsent);
+  return sent;
 } // }}}
 
+int CollectUdpAcks(int socket, std::function<void(PackagedDataToSend_t&, Direction)> &onAcked) // {{{
+{
+  // PULL_ACKs arrive on the downlink sockets and are handled by RecvUdp
+  char resp[32];
+  int acked = 0;
+
+  struct sockaddr_storage from;
+  socklen_t srcAddrMaxSz = sizeof(from);
+
+  for (;;) {
+    socklen_t fromLen = srcAddrMaxSz;
+    int j = recvfrom(socket, resp, sizeof(resp), MSG_DONTWAIT, (struct sockaddr *) &from, &fromLen);
+
+    if (j == -1) break; // nothing more to read, or server connection error
+
+    if (fromLen > srcAddrMaxSz)
+    { continue; }
+
+    if (MatchPendingAck(socket, resp, j, (struct sockaddr *) &from, fromLen, &onAcked))
+    { ++acked; }
+  }
+
+  return acked;
+} // }}}
 
-NetworkConf_t PrepareNetworking(const char* networkInterfaceName, suseconds_t dataRecvTimeout,
-	                        char gatewayId[25]) // {{{
+size_t ExpirePendingAcks(std::function<void(PackagedDataToSend_t&&, Direction)> &onExpired) // {{{
 {
-  NetworkConf_t result;
+  auto now = std::chrono::steady_clock::now();
+  size_t expired = 0;
+
+  for (PendingAck_t &pending : pending_acks)
+  {
+    if (!pending.in_use) continue;
 
-  if ((result.socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-    Die("socket");
+    // same patience as the former blocking sender - 2 receive attempts
+    Server_t &server = (*registered_servers)[pending.server];
+    auto ackTimeout = std::chrono::milliseconds(2 * server.receive_timeout_ms);
+    if (now - pending.sent_at < ackTimeout)
+    { continue; }
+
+    RecordEndpointMiss(server, pending.endpoint, pending.endpoints_generation);
+    RecordCircuitFailure(server);
+
+    onExpired(std::move(pending.packet), pending.direction);
+    ReleasePendingSlot(pending);
+    ++expired;
   }
 
-  time_t seconds = 0;
-  if (dataRecvTimeout > 999999)
-  { 
-    seconds = dataRecvTimeout / 1000000;
-    dataRecvTimeout -= (seconds * 1000000);
+  return expired;
+} // }}}
+
+size_t ReleasePendingAcks(std::function<void(PackagedDataToSend_t&&, Direction)> &onReleased) // {{{
+{
+  size_t released = 0;
+
+  for (PendingAck_t &pending : pending_acks)
+  {
+    if (!pending.in_use) continue;
+
+    onReleased(std::move(pending.packet), pending.direction);
+    ReleasePendingSlot(pending);
+    ++released;
   }
 
+  return released;
+} // }}}
+
+size_t ReleaseRetries(std::function<void(PackagedDataToSend_t&&, Direction)> &onReleased) // {{{
+{
+  size_t released = 0;
 
-  result.recv_timeout.tv_sec = seconds;
-  result.recv_timeout.tv_usec = dataRecvTimeout;
+  for (Direction direction : { UP_TX, DOWN_TX })
+  {
+    PacketQueue_t &queue = packet_queues[direction];
+    released += queue.retries.size();
 
+    queue.retries.drain([&onReleased, direction](PackagedDataToSend_t &&packet) {
+      onReleased(std::move(packet), direction);
+    });
 
-  if (setsockopt(result.socket, SOL_SOCKET, SO_RCVTIMEO,
-		  (void *) &result.recv_timeout, sizeof(result.recv_timeout)) != 0) {
-    Die(strerror(errno));
+    for (ServerQueue_t &serverQueue : server_queues)
+    {
+      std::deque<PackagedDataToSend_t> &due = serverQueue.due[direction];
+      released += due.size();
+      for (PackagedDataToSend_t &packet : due)
+      { onReleased(std::move(packet), direction); }
+      due.clear();
+
+      SpscRing<PackagedDataToSend_t> &held = *serverQueue.held[direction];
+      for (PackagedDataToSend_t *packet = held.front(); packet != nullptr; packet = held.front())
+      {
+        onReleased(std::move(*packet), direction);
+        held.pop();
+        ++released;
+      }
+    }
   }
 
-  memset((char *) &result.si_other, 0, sizeof(result.si_other));
-  result.si_other.sin_family = AF_INET;
+  return released;
+} // }}}
+
+static void RefillRetryTokens(ServerQueue_t &serverQueue, std::chrono::steady_clock::time_point now) // {{{
+{
+  std::chrono::duration<double> elapsed = now - serverQueue.retry_tokens_at;
+  serverQueue.retry_tokens_at = now;
+  serverQueue.retry_tokens = std::min((double) retransmission.max_per_s,
+                                      serverQueue.retry_tokens + elapsed.count() * retransmission.max_per_s);
+} // }}}
+
+static void DispatchDueRetries(Direction direction, std::chrono::steady_clock::time_point now) // {{{
+{
+  packet_queues[direction].retries.advance(now, [direction](PackagedDataToSend_t &&packet) {
+    server_queues[packet.server].due[direction].push_back(std::move(packet));
+  });
+} // }}}
+
+int NextRetryTimeoutMs() // {{{
+{
+  auto now = std::chrono::steady_clock::now();
+  int result = -1;
+
+  for (Direction direction : { UP_TX, DOWN_TX })
+  {
+    int timeout = packet_queues[direction].retries.msUntilNext(now);
+    if (timeout >= 0 && (result < 0 || timeout < result)) result = timeout;
+
+    for (size_t server = 0; server < server_queues.size(); ++server)
+    {
+      ServerQueue_t &serverQueue = server_queues[server];
+
+      // the same as DequeuePacket waits for
+      const PackagedDataToSend_t *held = serverQueue.held[direction]->front();
+      if (held != nullptr)
+      {
+        timeout = SendableInMs(server, direction, *held, now);
+        if (timeout >= 0 && (result < 0 || timeout < result)) result = timeout;
+      }
+
+      const std::deque<PackagedDataToSend_t> &due = serverQueue.due[direction];
+      if (due.empty()) continue;
+
+      timeout = SendableInMs(server, direction, due.front(), now);
+      if (timeout == 0 && due.front().curr_attempt > 0 && retransmission.max_per_s > 0)
+      {
+        RefillRetryTokens(serverQueue, now);
+        if (serverQueue.retry_tokens < 1)
+        { timeout = (int) ((1 - serverQueue.retry_tokens) * 1000 / retransmission.max_per_s) + 1; }
+      }
+
+      if (timeout >= 0 && (result < 0 || timeout < result)) result = timeout;
+    }
+  }
+
+  return result;
+} // }}}
+
+size_t PendingAcksCount() // {{{
+{
+  return pending_count;
+} // }}}
+
+int NextPendingAckTimeoutMs() // {{{
+{
+  if (pending_count == 0)
+  { return -1; }
+
+  auto now = std::chrono::steady_clock::now();
+  auto earliest = std::chrono::steady_clock::time_point::max();
+
+  for (const PendingAck_t &pending : pending_acks)
+  {
+    if (!pending.in_use) continue;
+
+    auto deadline = pending.sent_at + std::chrono::milliseconds(2 * PacketDestination(pending.packet).receive_timeout_ms);
+    if (deadline < earliest) earliest = deadline;
+  }
+
+  if (earliest <= now)
+  { return 0; }
+
+  return (int) std::chrono::duration_cast<std::chrono::milliseconds>(earliest - now).count() + 1;
+} // }}}
+
+
+NetworkConf_t PrepareNetworking(const char* networkInterfaceName, char gatewayId[25]) // {{{
+{
+  NetworkConf_t result;
+
+  // dual-stack, so that both the IPv4 and IPv6 addresses of the servers can be used
+  int v6only = 0;
+  result.family = AF_INET6;
+  if ((result.socket = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP)) == -1 ||
+      setsockopt(result.socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) != 0) {
+    if (result.socket != -1) close(result.socket);
+
+    result.family = AF_INET;
+    if ((result.socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+      Die("socket");
+    }
+  }
+
+  // read as the event loop finds it readable, never waited on; the ACK timeouts are tracked apart
+  int flags = fcntl(result.socket, F_GETFL, 0);
+  if (flags == -1 || fcntl(result.socket, F_SETFL, flags | O_NONBLOCK) == -1) {
+    Die("fcntl");
+  }
 
   result.ifr.ifr_addr.sa_family = AF_INET;
   strncpy(result.ifr.ifr_name, networkInterfaceName, IFNAMSIZ - 1);
 
   ioctl(result.socket, SIOCGIFHWADDR, &result.ifr);
 
+  const uint8_t *hwaddr = (const uint8_t *) result.ifr.ifr_hwaddr.sa_data;
+  const uint8_t eui[8] = { hwaddr[0], hwaddr[1], hwaddr[2], 0xFF, 0xFF, hwaddr[3], hwaddr[4], hwaddr[5] };
+  memcpy(result.gateway_eui, eui, sizeof(eui));
+
   sprintf(gatewayId, "%.2x:%.2x:%.2x:ff:ff:%.2x:%.2x:%.2x",
       (uint8_t)result.ifr.ifr_hwaddr.sa_data[0],
       (uint8_t)result.ifr.ifr_hwaddr.sa_data[1],
@@ -230,87 +755,298 @@ NetworkConf_t PrepareNetworking(const char* networkInterfaceName, suseconds_t da
   return result;  
 } // }}}
 
-bool RequeuePacket(PackagedDataToSend_t &&packet, uint32_t maxAttempts, Direction direction)
+bool RequeuePacket(PackagedDataToSend_t &&packet, Direction direction) // {{{
 {
-  if (packet.curr_attempt >= maxAttempts)
+  // always called by the consumer of that direction, so it must not touch the ring
+  // nothing more gets sent to a server whose circuit has opened but the probes
+  Server_t &server = PacketDestination(packet);
+  if (packet.curr_attempt >= retransmission.max_attempts || server.health.state == CIRCUIT_OPEN)
   { return false; }
 
-  std::unique_lock<std::timed_mutex> lock = std::unique_lock<std::timed_mutex>(
-    direction_to_mutex.at(direction),
-    std::chrono::system_clock::now() + std::chrono::seconds(2)
-  );
+  // the longer the server hasn't been answering, the longer its retries wait; half of the backoff is
+  // random, so that the retries of a burst don't all come back together
+  uint32_t failures = (server.health.failures > 0 ? server.health.failures - 1 : 0);
+  uint64_t backoff = (uint64_t) retransmission.backoff_min_ms << std::min(failures, 16U);
+  backoff = std::min(backoff, (uint64_t) retransmission.backoff_max_ms);
+  backoff = backoff / 2 + (uint64_t) rand() % (backoff / 2 + 1);
 
-  if (!lock.owns_lock())
-  {
-    printf("Failed to obtain uplink queue lock! Giving up on requeuing the packet!");
-    return false;
-  }
+  auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(backoff);
+  if (due - packet.queued_at > std::chrono::seconds(retransmission.max_age_s))
+  { return false; }
 
   packet.curr_attempt++;
-  direction_to_queue.at(direction).push(std::move(packet));
-
+  packet_queues[direction].retries.schedule(std::move(packet), due);
   return true;
-}
+} // }}}
 
-void EnqueuePacket(uint8_t *data, uint32_t data_length, PackagedDataContentType_t data_type, Server_t& dest, Direction direction) // {{{
+static SpscRing<PackagedDataToSend_t>& ClassRing(PacketQueue_t &queue, PriorityClass_t priority) // {{{
 {
-  if (data == nullptr) return;
+  return *(queue.rings[priority] ? queue.rings[priority] : queue.rings[PRIORITY_NORMAL]);
+} // }}}
 
-  std::unique_lock<std::timed_mutex> lock = std::unique_lock<std::timed_mutex>(
-    direction_to_mutex.at(direction),
-    std::chrono::system_clock::now() + std::chrono::seconds(2)
-  );
+static bool PushPacket(Direction direction, PriorityClass_t priority, PackagedDataToSend_t &&packet) // {{{
+{
+  SpscRing<PackagedDataToSend_t> &ring = ClassRing(packet_queues[direction], priority);
+  if (ring.push(std::move(packet)))
+  { return true; }
+
+  printf("Packet queue %d (%s) is full (%u dropped so far)! Giving up on that packet!\n",
+    (int) direction, PRIORITY_CLASS_NAMES[priority], ring.dropped());
+  return false;
+} // }}}
 
-  if (!lock.owns_lock())
+void EnqueueFanOut(uint8_t pkt_type, const PacketBufferRef &body, uint32_t body_len,
+                   PackagedDataContentType_t data_type, Direction direction, PriorityClass_t priority,
+                   uint16_t frames) // {{{
+{
+  // every server only gets its own 12-byte header, the body is shared; the token is set once sent
+  uint8_t header[PROTOCOL_HEADER_SIZE] = { PROTOCOL_VERSION, 0, 0, pkt_type };
+
+  auto now = std::chrono::steady_clock::now();
+  bool queued = false;
+
+  for (size_t i = 0; i < registered_servers->size(); ++i) {
+    Server_t &serv = (*registered_servers)[i];
+    NetworkConf_t &networkConf = (direction == UP_TX ? serv.uplink_network_cfg : serv.downlink_network_cfg);
+    memcpy(header + 4, networkConf.gateway_eui, sizeof(networkConf.gateway_eui));
+
+    PackagedDataToSend_t packet{ data_type, header, body, body_len, (uint16_t) i };
+    packet.queued_at = now;
+    packet.frames = frames;
+
+    if (!PushPacket(direction, priority, std::move(packet)))
+    { continue; }
+    queued = true;
+  }
+
+  if (queued) NotifyPacketQueue();
+} // }}}
+
+int ReplaySpooledUplinks() // {{{
+{
+  // back among the due retries at a steady pace, so the fresh uplinks keep going first while catching up
+  static std::chrono::steady_clock::time_point nextReplay;
+  static SpooledUplink_t record;
+  static SpoolCursor_t cursor;
+
+  uint32_t rate = UplinkSpoolReplayRate();
+  if (!UplinkSpoolEnabled() || rate == 0 || GetUplinkSpoolStats().records == 0)
+  { return -1; }
+
+  auto now = std::chrono::steady_clock::now();
+  auto interval = std::chrono::microseconds(1000000 / rate);
+  if (nextReplay < now - std::chrono::seconds(1))
+  { nextReplay = now; } // no burst after a pause
+
+  auto answering = [](const Server_t &serv) { return ServerAnswering(serv) && serv.health.state == CIRCUIT_CLOSED; };
+  if (std::none_of(registered_servers->begin(), registered_servers->end(), answering))
+  { return 1000; } // until the ACKs resume
+
+  bool replayed = false;
+
+  while (nextReplay <= now)
   {
-    printf("Failed to obtain uplink queue lock! Giving up on that packet!");
-    return;
+    PacketBufferRef body = AcquirePacketBuffer();
+    if (!body)
+    { return 1000; }
+
+    // what's left behind is for servers that aren't answering, another look in a while
+    if (!NextSpooledUplink(cursor, record, body.data(), PACKET_BUFFER_SIZE - PROTOCOL_HEADER_SIZE))
+    {
+      nextReplay = now + std::chrono::seconds(1);
+      break;
+    }
+
+    size_t server = 0;
+    while (server < registered_servers->size() && ((*registered_servers)[server].address != record.server ||
+                                                   (*registered_servers)[server].port != record.port))
+    { ++server; }
+
+    if (server == registered_servers->size())
+    {
+      printf("Dropping a spooled uplink for %s:%hu, no such server anymore\n", record.server.c_str(), record.port);
+      TakeSpooledUplink(cursor);
+      continue;
+    }
+
+    // passed over, so that one server that isn't answering, or has a window of packets in flight already,
+    // holds back none of the others
+    Server_t &serv = (*registered_servers)[server];
+    if (!answering(serv) || server_queues[server].pending >= pending_slots_per_server)
+    { continue; }
+
+    uint8_t header[PROTOCOL_HEADER_SIZE] = { PROTOCOL_VERSION, 0, 0, PKT_PUSH_DATA };
+    memcpy(header + 4, serv.uplink_network_cfg.gateway_eui, sizeof(serv.uplink_network_cfg.gateway_eui));
+
+    PackagedDataToSend_t packet{ UPLINK_PUSH, header, body, record.body_len, (uint16_t) server };
+    packet.queued_at = now;
+    server_queues[server].due[UP_TX].push_back(std::move(packet));
+    TakeSpooledUplink(cursor);
+
+    nextReplay += interval;
+    replayed = true;
   }
 
-  PackagedDataToSend_t packaged_data{ 0UL, data_type, data_length, data, dest };
-  direction_to_queue.at(direction).push(std::move(packaged_data));
+  if (replayed) NotifyPacketQueue();
+
+  if (GetUplinkSpoolStats().records == 0)
+  { return -1; }
+
+  return (int) std::chrono::duration_cast<std::chrono::milliseconds>(nextReplay - now).count() + 1;
+} // }}}
+
+static SpscRing<PackagedDataToSend_t>* NextFreshRing(PacketQueue_t &queue) // {{{
+{
+  if (priority_settings.strict)
+  {
+    for (PacketRing_t &ring : queue.rings)
+    { if (ring && ring->front() != nullptr) return ring.get(); }
+    return nullptr;
+  }
+
+  // each class in turn dequeues up to its weight of packets in a row, as long as it has some
+  for (int i = 0; i <= PRIORITY_CLASSES; ++i)
+  {
+    PacketRing_t &ring = queue.rings[queue.current_class];
+    if (queue.credit > 0 && ring && ring->front() != nullptr)
+    {
+      --queue.credit;
+      return ring.get();
+    }
+
+    queue.current_class = (queue.current_class + 1) % PRIORITY_CLASSES;
+    queue.credit = priority_settings.weights[queue.current_class];
+  }
+  return nullptr;
 } // }}}
 
 PackagedDataToSend_t DequeuePacket(Direction direction) // {{{
 {
-  std::unique_lock<std::timed_mutex> lock = std::unique_lock<std::timed_mutex>(
-    direction_to_mutex.at(direction),
-    std::chrono::system_clock::now() + std::chrono::seconds(1)
-  );
+  PacketQueue_t &queue = packet_queues[direction];
+  auto now = std::chrono::steady_clock::now();
+
+  // the ones held back for their server first, as soon as it can take them: they were dequeued by class
+  // ahead of anything in the rings now
+  for (size_t i = 0; direction != DOWN_RX && i < server_queues.size(); ++i)
+  {
+    size_t server = (next_held_server[direction] + i) % server_queues.size();
+    SpscRing<PackagedDataToSend_t> &held = *server_queues[server].held[direction];
+    if (held.front() == nullptr || SendableInMs(server, direction, *held.front(), now) != 0) continue;
+
+    next_held_server[direction] = server + 1;
+    PackagedDataToSend_t result{std::move(*held.front())};
+    held.pop();
+    return result;
+  }
+
+  // fresh packets next, by class, then the ones that have been put back by the consumer
+  SpscRing<PackagedDataToSend_t> *ring = NextFreshRing(queue);
+  if (ring != nullptr)
+  {
+    PackagedDataToSend_t result{std::move(*ring->front())};
+    ring->pop();
+    return result;
+  }
+
+  // the radio thread's downlinks are never put back
+  if (direction == DOWN_RX)
+  { return PackagedDataToSend_t(); }
+
+  DispatchDueRetries(direction, now);
+
+  // a server at a time, so that the backlog of one doesn't delay the others
+  for (size_t i = 0; i < server_queues.size(); ++i)
+  {
+    size_t server = (next_due_server[direction] + i) % server_queues.size();
+    ServerQueue_t &serverQueue = server_queues[server];
+    std::deque<PackagedDataToSend_t> &due = serverQueue.due[direction];
+    if (due.empty() || SendableInMs(server, direction, due.front(), now) != 0) continue;
 
-  if (!lock.owns_lock() || direction_to_queue.at(direction).empty())
-  { return std::move(NO_PACKAGED_DATA); }
+    // the retries within the budget of their server only, the replayed uplinks have their own pace
+    if (due.front().curr_attempt > 0 && retransmission.max_per_s > 0)
+    {
+      RefillRetryTokens(serverQueue, now);
+      if (serverQueue.retry_tokens < 1) continue;
+      serverQueue.retry_tokens -= 1;
+    }
 
-  PackagedDataToSend_t result = [](std::queue<PackagedDataToSend>& queue) -> PackagedDataToSend_t {      
-      auto res = std::move(queue.front());
-      queue.pop();
-      return res;
-  }(direction_to_queue.at(direction));
+    next_due_server[direction] = server + 1;
+    PackagedDataToSend_t result{std::move(due.front())};
+    due.pop_front();
+    return result;
+  }
 
-  lock.unlock();
+  return PackagedDataToSend_t();
+} // }}}
 
+PacketQueueStats_t GetPacketQueueStats(Direction direction) // {{{
+{
+  PacketQueue_t &queue = packet_queues[direction];
+
+  // all classes together
+  PacketQueueStats_t result{};
+  for (PacketRing_t &ring : queue.rings)
+  {
+    if (!ring) continue;
+    result.depth += (uint32_t) ring->size();
+    result.high_water_mark += ring->highWaterMark();
+    result.drops += ring->dropped();
+  }
+
+  // and those held for their server
+  for (size_t server = 0; direction != DOWN_RX && server < server_queues.size(); ++server)
+  {
+    SpscRing<PackagedDataToSend_t> &held = *server_queues[server].held[direction];
+    result.depth += (uint32_t) held.size();
+    result.high_water_mark += held.highWaterMark();
+    result.drops += held.dropped();
+  }
   return result;
 } // }}}
 
+int PacketQueueEventFd() // {{{
+{
+  static std::once_flag created;
+  std::call_once(created, []() {
+    packet_queue_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (packet_queue_event_fd == -1) Die("eventfd");
+  });
+
+  return packet_queue_event_fd;
+} // }}}
+
+void NotifyPacketQueue() // {{{
+{
+  uint64_t one = 1;
+  if (write(PacketQueueEventFd(), &one, sizeof(one)) == -1 && errno != EAGAIN)
+  { perror("eventfd write"); }
+} // }}}
+
+int DownlinkQueueEventFd() // {{{
+{
+  static std::once_flag created;
+  std::call_once(created, []() {
+    downlink_queue_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (downlink_queue_event_fd == -1) Die("eventfd");
+  });
+
+  return downlink_queue_event_fd;
+} // }}}
+
+void NotifyDownlinkQueue() // {{{
+{
+  uint64_t one = 1;
+  if (write(DownlinkQueueEventFd(), &one, sizeof(one)) == -1 && errno != EAGAIN)
+  { perror("eventfd write"); }
+} // }}}
+
 void PublishStatProtocolPacket(PlatformInfo_t &cfg, LoRaPacketTrafficStats_t &pktStats) // {{{
 {
   // see https://github.com/Lora-net/packet_forwarder/blob/master/PROTOCOL.TXT
   // also see document ANNWS.01.2.1.W.SYS
 
-  char status_report[STATUS_MSG_SIZE]; /* status report as a JSON object */
   char stat_timestamp[24];
 
-  int stat_index = 0;
-
-  /* pre-fill the data buffer with fixed fields */
-  status_report[0] = PROTOCOL_VERSION;
-  status_report[3] = PKT_PUSH_DATA;
-
-  /* start composing datagram with the header */
-  status_report[1] = ((uint8_t) rand()); /* random token */
-  status_report[2] = ((uint8_t) rand()); /* random token */
-  stat_index = 12; /* 12-byte header */
-
   /* get timestamp for statistics */
   time_t t = time(NULL);
   strftime(stat_timestamp, sizeof stat_timestamp, "%F %T %Z", gmtime(&t));
@@ -353,32 +1089,74 @@ void PublishStatProtocolPacket(PlatformInfo_t &cfg, LoRaPacketTrafficStats_t &pk
   writer.String(cfg.platform_email);
   writer.String("desc");
   writer.String(cfg.platform_description);
+  if (UplinkSpoolEnabled())
+  {
+    UplinkSpoolStats_t spoolStats = GetUplinkSpoolStats();
+    writer.String("spln");
+    writer.Uint(spoolStats.records);
+    writer.String("spla");
+    writer.Uint(spoolStats.oldest_age_s);
+  }
   // =======================================
 
   writer.EndObject();
   writer.EndObject();
 
-  std::string json = sb.GetString();
-  //printf("stat update: %s\n", json.c_str());
+  //printf("stat update: %s\n", sb.GetString());
+
+  PacketBufferRef body = AcquirePacketBuffer();
+  if (!body || sb.GetSize() > PACKET_BUFFER_SIZE - PROTOCOL_HEADER_SIZE) {
+    printf("No packet buffer for the stat update, skipping it!\n");
+    return;
+  }
+  memcpy(body.data(), sb.GetString(), sb.GetSize());
 
-  memcpy(status_report + 12, json.c_str(), json.size());
+  EnqueueFanOut(PKT_PUSH_DATA, body, (uint32_t) sb.GetSize(), STAT_PUSH, UP_TX, PRIORITY_BACKGROUND);
+} // }}}
 
-  for (Server_t &serv : cfg.servers) {
-    status_report[4] = (unsigned char)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[0];
-    status_report[5] = (unsigned char)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[1];
-    status_report[6] = (unsigned char)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[2];
-    status_report[7] = 0xFF;
-    status_report[8] = 0xFF;
-    status_report[9] = (unsigned char)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[3];
-    status_report[10] = (unsigned char)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[4];
-    status_report[11] = (unsigned char)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[5];
+static PriorityClass_t UplinkPriorityClass(const LoRaDataPkt_t &loraPacket) // {{{
+{
+  // by the MType of the LoRaWAN MAC header, the devices wait for an answer to these
+  if (loraPacket.msg == nullptr || loraPacket.msg_sz == 0)
+  { return PRIORITY_NORMAL; }
 
-    size_t packet_sz = stat_index + json.size();
-    uint8_t *packet = new uint8_t[packet_sz];
-    memcpy(packet, status_report, packet_sz);
-    EnqueuePacket(packet, packet_sz, STAT_PUSH, serv, UP_TX);
+  switch (loraPacket.msg[0] >> 5)
+  {
+    case 0: // join request
+    case 4: // confirmed data up
+    case 6: // rejoin request
+      return PRIORITY_CRITICAL;
   }
+  return PRIORITY_NORMAL;
+} // }}}
+
+void SetUplinkCoalescing(const UplinkCoalescingSettings_t &settings) // {{{
+{
+  coalescing = settings;
+  coalescing.hold_ms = std::min(settings.hold_ms, (uint32_t) COALESCING_MAX_HOLD_MS);
+  coalescing.max_bytes = std::min(settings.max_bytes, (uint32_t) (TX_BUFF_UP_SIZE - PROTOCOL_HEADER_SIZE));
+} // }}}
+
+void FlushCoalescedUplinks(bool force) // {{{
+{
+  if (coalesced.frames == 0 || (!force && std::chrono::steady_clock::now() < coalesced.due))
+  { return; }
 
+  EnqueueFanOut(PKT_PUSH_DATA, coalesced.body, coalesced.json_len, UPLINK_PUSH, UP_TX, coalesced.priority,
+                coalesced.frames);
+  coalesced = CoalescedUplinks_t();
+} // }}}
+
+int CoalescedUplinksDueInMs() // {{{
+{
+  if (coalesced.frames == 0)
+  { return -1; }
+
+  auto now = std::chrono::steady_clock::now();
+  if (coalesced.due <= now)
+  { return 0; }
+
+  return (int) std::chrono::duration_cast<std::chrono::milliseconds>(coalesced.due - now).count() + 1;
 } // }}}
 
 void PublishLoRaUplinkProtocolPacket(PlatformInfo_t &cfg, LoRaDataPkt_t &loraPacket) // {{{
@@ -386,132 +1164,211 @@ void PublishLoRaUplinkProtocolPacket(PlatformInfo_t &cfg, LoRaDataPkt_t &loraPac
   // see https://github.com/Lora-net/packet_forwarder/blob/master/PROTOCOL.TXT
   // also see document ANNWS.01.2.1.W.SYS
 
-  char buff_up[TX_BUFF_UP_SIZE]; /* buffer to compose the upstream packet */
-  int buff_index = 0;
-
-  /* pre-fill the data buffer with fixed fields */
-  buff_up[0] = PROTOCOL_VERSION;
-  buff_up[3] = PKT_PUSH_DATA;
-
-  /* start composing datagram with the header */
-  buff_up[1] = ((uint8_t) rand()); /* random token */
-  buff_up[2] = ((uint8_t) rand()); /* random token */
-  buff_index = 12; /* 12-byte header */
+  PriorityClass_t priority = UplinkPriorityClass(loraPacket);
 
   struct timeval now;
   gettimeofday(&now, NULL);
-  //uint32_t tmst = (uint32_t)(now.tv_sec * 1000000 + now.tv_usec);
-  uint32_t tmst = loraPacket.internal_recv_ts_us; // counter since wiringPiSetup was called
-
-  // unix epoch in seconds ts to GPS timestamp in millis
-  uint64_t tmms = std::round( (unix2gps(now.tv_sec, false) * 1000.0) + (now.tv_usec / 1000) );
 
-  char extended_iso8610_time[28] = {0};
-  iso8601_utc_extended_now(&now, extended_iso8610_time, sizeof extended_iso8610_time);
-
-  // Build JSON object.
-  rapidjson::StringBuffer sb;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
-  writer.StartObject();
-  writer.String("rxpk");
-  writer.StartArray();
-  writer.StartObject();
-  writer.String("time");
-  writer.String(extended_iso8610_time);
-  writer.String("tmms");
-  writer.Uint64(tmms); 
-  writer.String("tmst");
-  writer.Uint(tmst);
-  writer.String("freq");
-  writer.SetMaxDecimalPlaces(6);
-  writer.Double(loraPacket.freq_mhz);
-  writer.SetMaxDecimalPlaces(rapidjson::Writer<rapidjson::StringBuffer>::kDefaultMaxDecimalPlaces);
-  writer.String("chan");
-  writer.Uint(0);
-  writer.String("rfch");
-  writer.Uint(0);
-  writer.String("stat");
-  writer.Uint(1);
-  writer.String("modu");
-  writer.String("LORA");
-
-  writer.String("datr");
-  char datr[] = "SFxxBWxxxxxx";
-  snprintf(datr, strlen(datr) + 1, "SF%hhuBW%g", loraPacket.sf, loraPacket.bandwidth_khz);
-  writer.String(datr);
-
-  writer.String("codr");
-  char cr[4] = "4/x";
-  snprintf(cr, sizeof(cr), "4/%d", cfg.lora_chip_settings.coding_rate);
-  writer.String(cr);
-
-  writer.String("rssi");
-  writer.Int(((int)loraPacket.RSSI));
-  writer.String("lsnr");
-  writer.SetMaxDecimalPlaces(1);
-  writer.Double(std::round(loraPacket.SNR * 10) / 10);
-  writer.SetMaxDecimalPlaces(rapidjson::Writer<rapidjson::StringBuffer>::kDefaultMaxDecimalPlaces);
-  writer.String("size");
-  writer.Uint(loraPacket.msg_sz);
-  writer.String("data");
+  if (coalescing.hold_ms > 0 && coalesced.frames > 0)
+  {
+    int json_sz = AppendRxpk((char *) coalesced.body.data(), coalescing.max_bytes + 1, coalesced.json_len, loraPacket,
+                             cfg.lora_chip_settings.coding_rate, now);
+    if (json_sz >= 0)
+    {
+      coalesced.json_len = json_sz;
+      ++coalesced.frames;
+      coalesced.priority = std::min(coalesced.priority, priority);
 
-  // Encode payload.
-  char b64[BASE64_MAX_LENGTH];
-  bin_to_b64(loraPacket.msg, loraPacket.msg_sz, b64, BASE64_MAX_LENGTH);
+      // the device of a critical one is waiting for the answer
+      if (priority == PRIORITY_CRITICAL) FlushCoalescedUplinks(true);
+      return;
+    }
 
-  writer.String(b64);
-  writer.EndObject();
-  writer.EndArray();
-  writer.EndObject();
+    FlushCoalescedUplinks(true); // no room left for it
+  }
 
-  std::string json = sb.GetString();
-  //printf("%s\n", json.c_str());
+  PacketBufferRef body = AcquirePacketBuffer(); /* the upstream packet, bar its header */
+  if (!body) {
+    printf("No packet buffer left, dropping the uplink!\n");
+    return;
+  }
 
-  memcpy(buff_up + 12, json.c_str(), json.size());
-  for (Server_t &serv : cfg.servers) {
-    buff_up[4] = (uint8_t)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[0];
-    buff_up[5] = (uint8_t)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[1];
-    buff_up[6] = (uint8_t)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[2]; 
-    buff_up[7] = 0xFF;
-    buff_up[8] = 0xFF;
-    buff_up[9] = (uint8_t)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[3];
-    buff_up[10] = (uint8_t)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[4];
-    buff_up[11] = (uint8_t)serv.uplink_network_cfg.ifr.ifr_hwaddr.sa_data[5];
+  int json_sz = SerializeRxpk((char *) body.data(), TX_BUFF_UP_SIZE - PROTOCOL_HEADER_SIZE, loraPacket,
+                              cfg.lora_chip_settings.coding_rate, now);
+  if (json_sz < 0) {
+    printf("The uplink of %u bytes does not fit a PUSH_DATA datagram!\n", loraPacket.msg_sz);
+    return;
+  }
 
-    size_t packet_sz = buff_index + json.size();
-    uint8_t *packet = new uint8_t[packet_sz];
-    memcpy(packet, buff_up, packet_sz);
-    EnqueuePacket(packet, packet_sz, UPLINK_PUSH, serv, UP_TX);
+  if (coalescing.hold_ms == 0 || priority == PRIORITY_CRITICAL)
+  {
+    EnqueueFanOut(PKT_PUSH_DATA, body, json_sz, UPLINK_PUSH, UP_TX, priority);
+    return;
   }
 
+  // waiting for the ones received right after it
+  coalesced.body = std::move(body);
+  coalesced.json_len = json_sz;
+  coalesced.frames = 1;
+  coalesced.priority = priority;
+  coalesced.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(coalescing.hold_ms);
 } // }}}
 
 void PublishLoRaDownlinkProtocolPacket(PlatformInfo_t &cfg) // {{{
 {
   // see https://github.com/Lora-net/packet_forwarder/blob/master/PROTOCOL.TXT
-  char buff_up[TX_BUFF_DOWN_REQ_SIZE]; /* buffer to compose the downstream request packet */
-
-  buff_up[0] = PROTOCOL_VERSION;
-  buff_up[3] = PKT_PULL_DATA;
-
-  /* start composing datagram with the header */
-  uint8_t token_h = (uint8_t)rand(); /* random token */
-  uint8_t token_l = (uint8_t)rand(); /* random token */
-  buff_up[1] = token_h;
-  buff_up[2] = token_l;
-
-  for (Server_t &serv : cfg.servers) {
-    buff_up[4] = (uint8_t)serv.downlink_network_cfg.ifr.ifr_hwaddr.sa_data[0];
-    buff_up[5] = (uint8_t)serv.downlink_network_cfg.ifr.ifr_hwaddr.sa_data[1];
-    buff_up[6] = (uint8_t)serv.downlink_network_cfg.ifr.ifr_hwaddr.sa_data[2]; 
-    buff_up[7] = 0xFF;
-    buff_up[8] = 0xFF;
-    buff_up[9] = (uint8_t)serv.downlink_network_cfg.ifr.ifr_hwaddr.sa_data[3];
-    buff_up[10] = (uint8_t)serv.downlink_network_cfg.ifr.ifr_hwaddr.sa_data[4];
-    buff_up[11] = (uint8_t)serv.downlink_network_cfg.ifr.ifr_hwaddr.sa_data[5];
-
-    uint8_t *packet = new uint8_t[sizeof(buff_up)];
-    memcpy(packet, buff_up, sizeof(buff_up));
-    EnqueuePacket(packet, sizeof(buff_up), DOWNLINK_REQ, serv, DOWN_TX);
+  // a PULL_DATA is nothing but the header
+  EnqueueFanOut(PKT_PULL_DATA, PacketBufferRef(), 0, DOWNLINK_REQ, DOWN_TX, PRIORITY_BACKGROUND);
+} // }}}
+
+bool DownlinkTxJsonToPacket(const char *json, size_t json_sz, uint32_t spi_speed_hz,
+                            DownlinkPacket_t &result, const char **tx_ack_error) // {{{
+{
+  // see https://github.com/Lora-net/packet_forwarder/blob/master/PROTOCOL.TXT
+  // the error values are the ones a TX_ACK may carry; unspecific problems get a vague, but compliant one
+  *tx_ack_error = "COLLISION_BEACON";
+  result.initialised = false;
+
+  rapidjson::Document doc;
+  doc.Parse(json, json_sz);
+  if (doc.HasParseError()) {
+    printf("Failed to parse the JSON payload!\n");
+    return false;
+  }
+
+  if (!doc.IsObject() || !doc.HasMember("txpk") || !doc["txpk"].IsObject()) {
+    printf("No txpk recognized!\n");
+    return false;
+  }
+
+  const rapidjson::Value& txpkt = doc["txpk"].GetObject();
+  result.send_immediately = (txpkt.HasMember("imme") ? txpkt["imme"].GetBool() : false);
+  if (!result.send_immediately && (txpkt.HasMember("tmst") || txpkt.HasMember("tmms"))) {
+
+    bool isFutureSchedOk = false;
+
+    std::time_t now{std::time(nullptr)};
+    uint32_t internalTsMicrosNow = micros();
+
+    if (txpkt.HasMember("tmst")) {
+      uint32_t diffMicros = diff_timestamps(internalTsMicrosNow, txpkt["tmst"].GetUint(), isFutureSchedOk);
+
+      if ((!isFutureSchedOk && diffMicros > 1500000UL) || (isFutureSchedOk && diffMicros < UINT32_MAX - 20000000UL))
+      { isFutureSchedOk = true; }
+
+      result.internal_ts_micros = internalTsMicrosNow + diffMicros;
+      result.unix_epoch_timestamp = add_seconds(now, ((int)(diffMicros / 1000000U)) * (isFutureSchedOk ? 1 : -1));
+    } else {
+      double gpsTsMillis = txpkt["tmms"].GetDouble();
+      std::time_t scheduledTs = static_cast<std::time_t>(gps2unix(gpsTsMillis / 1000.0, false));
+
+      isFutureSchedOk = (now <= scheduledTs || now <= add_seconds(scheduledTs, 1));
+
+      result.unix_epoch_timestamp = scheduledTs;
+      result.internal_ts_micros = internalTsMicrosNow + static_cast<uint32_t>(difftime(scheduledTs, now) * 1000000.0);
+      result.internal_ts_micros += (remainder(gpsTsMillis, 1000.0) * 1000);
+    }
+
+    if (!isFutureSchedOk) {
+      printf("Invalid time scheduled: %lu (%lu internal ts micros); local ts %lu, internal ts(micros) %lu!\n",
+          (unsigned long) result.unix_epoch_timestamp, (unsigned long) result.internal_ts_micros,
+          (unsigned long) now, (unsigned long) internalTsMicrosNow);
+      *tx_ack_error = "TOO_LATE";
+      return false;
+    }
+  } else {
+    printf("Missing tx schedule!\n");
+    return false;
+  }
+
+  if (!txpkt.HasMember("modu")) {
+    printf("Missing tx modulation information!\n");
+    return false;
+  }
+  if (!txpkt.HasMember("datr")) {
+    printf("Missing tx data rate information!\n");
+    return false;
   }
+
+  if (txpkt.HasMember("freq"))
+  { result.carrier_frequency_mhz = static_cast<float>(txpkt["freq"].GetDouble()); }
+  if (txpkt.HasMember("rfch"))
+  { result.concentrator_rf_chain = txpkt["rfch"].GetUint(); }
+  if (txpkt.HasMember("powe"))
+  { result.output_power_dbm = static_cast<float>(txpkt["powe"].GetDouble()); }
+
+  bool isLoraModulation = (strcmp(txpkt["modu"].GetString(), "LORA") == 0 &&
+      txpkt["datr"].IsString() && txpkt.HasMember("codr"));
+  if (isLoraModulation) {
+    int sf = 0;
+    float bw = 0;
+
+    if (sscanf(txpkt["datr"].GetString(), "%*[SF]%d%*[BW]%f", &sf, &bw) < 2 ||
+        sf < SF_MIN || sf > SF_MAX || bw < 1.0F || bw > 500.0F) {
+      printf("Invalid SF or BW!\n");
+      return false;
+    }
+    result.spreading_factor = SpreadingFactor_t(sf);
+    result.bandwidth_khz = bw;
+
+    int cr = 0;
+    if (sscanf(txpkt["codr"].GetString(), "%*[4/]%d", &cr) < 1 ||
+        cr < CodingRate_t::CR_MIN || cr > CodingRate_t::CR_MAX) {
+      printf("Invalid codr!\n");
+      return false;
+    }
+    result.coding_rate = static_cast<CodingRate_t>(cr);
+
+    if (txpkt.HasMember("ipol")) {
+      result.iq_polatization_inversion = txpkt["ipol"].GetBool();
+    }
+
+  } else if (txpkt["datr"].IsNumber() && txpkt.HasMember("fdev")) {
+    result.fsk_datarate_bps = txpkt["datr"].GetUint();
+    result.fsk_freq_deviation_hz = txpkt["fdev"].GetUint();
+  } else {
+    printf("Invalid data rate / frequency deviation for the specified modulation!\n");
+    return false;
+  }
+
+  if (txpkt.HasMember("prea")) {
+      int preamble = txpkt["prea"].GetUint();
+      if (preamble > 5 && preamble < 256) {
+        result.preamble_length = static_cast<unsigned char>(preamble);
+      } else {
+        printf("Invalid preamble length!\n");
+        return false;
+      }
+  } else if (result.fsk_datarate_bps != 0) {
+    result.preamble_length = 5;
+  }
+
+  if (txpkt.HasMember("size")) {
+    result.payload_size = txpkt["size"].GetUint();
+    if (result.payload_size > 255) {
+      printf("Invalid payload size!\n");
+      return false;
+    }
+  }
+
+  if (txpkt.HasMember("data")) {
+    result.payload_size = b64_to_bin(txpkt["data"].GetString(), txpkt["data"].GetStringLength(), result.payload, 255);
+  }
+
+  if (txpkt.HasMember("ncrc")) {
+    result.disable_crc = txpkt["ncrc"].GetBool();
+  }
+
+  uint32_t usCorrection = compute_rf_tx_timestamp_correction_us(
+    result.fsk_datarate_bps, result.payload_size, result.spreading_factor, result.bandwidth_khz,
+    result.coding_rate, !result.disable_crc, false, spi_speed_hz);
+
+  result.internal_ts_micros -= usCorrection;
+
+  if (usCorrection >= 1000000U)
+  { result.unix_epoch_timestamp -= (usCorrection / 1000000U); }
+
+  *tx_ack_error = nullptr;
+  result.initialised = true;
+  return true;
 } // }}}
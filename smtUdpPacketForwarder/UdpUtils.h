@@ -11,7 +11,7 @@
 #include <chrono>
 #include <string>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <map>
 #include <functional>
 #include <mutex>
@@ -31,11 +31,16 @@
 
 #include "gpsTimestampUtils/GpsTimestampUtils.h"
 
+#include "SpscRing.h"
+#include "TimerWheel.h"
+#include "PacketBufferPool.h"
+
 #include "config.h"
 
 
 #define STATUS_MSG_SIZE 1024 /* status report as a JSON object */
 #define PROTOCOL_VERSION  2
+#define PROTOCOL_HEADER_SIZE 12
 #define PKT_PUSH_DATA 0
 #define PKT_PUSH_ACK  1
 
@@ -48,6 +53,14 @@
 #define TX_BUFF_DOWN_REQ_SIZE 12 /* buffer to compose downstream request packet */
 #define RX_BUFF_DOWN_SIZE 2048
 
+#define DOWNLINK_TX_QUEUE_CAPACITY 64  /* PULL_DATA datagrams waiting to be sent */
+#define DOWNLINK_RX_QUEUE_CAPACITY 64  /* PULL_RESP payloads waiting for the radio */
+
+#define MAX_PENDING_ACKS 256     /* datagrams awaiting PUSH_ACK / PULL_ACK across all servers, split evenly among them */
+#define SEND_BATCH_MAX 16        /* datagrams handed over to a single sendmmsg */
+#define RETRY_TICK_MS 10         /* resolution of the retry deadlines */
+#define COALESCING_MAX_HOLD_MS 1000
+
 #define BASE64_MAX_LENGTH 341
 
 typedef enum PackagedDataContentType : char
@@ -55,57 +68,128 @@ typedef enum PackagedDataContentType : char
   STAT_PUSH = 0, UPLINK_PUSH, DOWNLINK_REQ, DOWNLINK_TRANSMIT
 } PackagedDataContentType_t;
 
+// what the decoded buffer of a DOWNLINK_TRANSMIT holds
+typedef struct ReceivedDownlink
+{
+  DownlinkPacket_t downlink;
+  struct sockaddr_storage source;   // of its PULL_RESP, where the TX_ACK goes back to
+  socklen_t source_len;
+} ReceivedDownlink_t;
+
 typedef struct PackagedDataToSend
 {
   uint32_t curr_attempt;
   PackagedDataContentType_t data_type;
-  uint32_t data_len;
-  std::unique_ptr<uint8_t> data;
-  Server_t destination;
-  bool logged;
-  std::time_t schedule;
-
-  PackagedDataToSend(uint32_t curr_attempt, PackagedDataContentType_t data_type, uint32_t data_len, uint8_t *data_content, Server_t& destination)
+  uint16_t frames;                        // rxpk elements of an UPLINK_PUSH
+  uint16_t server;                        // index among the servers given to RegisterServers
+  uint32_t data_len;                      // whole datagram to send, or received payload (DOWN_RX)
+  uint8_t header[PROTOCOL_HEADER_SIZE];   // datagram to send: its own header, followed by (DOWN_RX: its TX_ACK one)
+  PacketBufferRef body;                   // the JSON shared by the copies sent to each server, or the received payload
+  PacketBufferRef decoded;                // ReceivedDownlink_t of a DOWNLINK_TRANSMIT, if any
+  std::chrono::steady_clock::time_point queued_at;   // the first time, bounds the retries
+
+  PackagedDataToSend() : curr_attempt(0), data_type(STAT_PUSH), frames(1), server(0), data_len(0), header{}
+  { }
+
+  PackagedDataToSend(PackagedDataContentType_t data_type, const uint8_t header[PROTOCOL_HEADER_SIZE],
+                     const PacketBufferRef &body, uint32_t body_len, uint16_t server)
+    : curr_attempt(0), data_type(data_type), frames(1), server(server), data_len(PROTOCOL_HEADER_SIZE + body_len), body(body)
   {
-    this->logged = false;
-    this->schedule = 0;
-    this->curr_attempt = curr_attempt;
-    this->data_type = data_type;
-    this->data_len = data_len;
-    this->data = std::unique_ptr<uint8_t>(data_content);
-    this->destination = destination; 
+    memcpy(this->header, header, PROTOCOL_HEADER_SIZE);
   }
 
-  PackagedDataToSend(PackagedDataToSend &&origin)
-  {
-    logged = origin.logged;
-    schedule = origin.schedule;
-    curr_attempt = origin.curr_attempt;
-    data_type = origin.data_type;
-    data_len = origin.data_len;
-    data = std::move(origin.data);
-    destination = origin.destination;
-  }
+  PackagedDataToSend(PackagedDataContentType_t data_type, PacketBufferRef &&payload, uint32_t payload_len,
+                     uint16_t server, PacketBufferRef &&decoded)
+    : curr_attempt(0), data_type(data_type), frames(1), server(server), data_len(payload_len), header{},
+      body(std::move(payload)), decoded(std::move(decoded))
+  { }
+
+  PackagedDataToSend(PackagedDataToSend &&origin) = default;
+  PackagedDataToSend& operator=(PackagedDataToSend &&origin) = default;
+
+  ReceivedDownlink_t* received() const
+  { return (decoded ? reinterpret_cast<ReceivedDownlink_t*>(decoded.data()) : nullptr); }
+
+  DownlinkPacket_t* downlink() const
+  { return (decoded ? &received()->downlink : nullptr); }
 
 } PackagedDataToSend_t;
 
 enum Direction { UP_TX, DOWN_TX, DOWN_RX };
 
+// the outcome of scheduling a PULL_RESP: radio thread -> network exchange worker
+typedef struct DownlinkAck
+{
+  uint16_t server;
+  uint8_t header[PROTOCOL_HEADER_SIZE];   // TX_ACK header, token of the PULL_RESP
+  struct sockaddr_storage dest;           // the PULL_RESP's source
+  socklen_t dest_len;
+  const char *error;                      // TX_ACK error value
+} DownlinkAck_t;
+
+typedef struct PacketQueueStats
+{
+  uint32_t depth;
+  uint32_t high_water_mark;
+  uint32_t drops;
+} PacketQueueStats_t;
+
 void Die(const char *s);
-bool SolveHostname(const char* p_hostname, uint16_t port, struct sockaddr_in* p_sin);
-bool SendUdp(Server_t &server, char *msg, int length, Direction direction,
-             std::function<bool(char*, int, char*, int)> &validator);
-bool RecvUdp(Server_t &server, char *msg, int size,
-             std::function<bool(char*, int, char*, int*)> &validator);
-NetworkConf_t PrepareNetworking(const char* networkInterfaceName, suseconds_t dataRecvTimeout, char gatewayId[25]);
-
-void EnqueuePacket(uint8_t *data, uint32_t data_length, PackagedDataContentType_t data_type, Server_t& dest, Direction direction);
-bool RequeuePacket(PackagedDataToSend_t &&packet, uint32_t maxAttempts, Direction direction);
+void RegisterServers(std::vector<Server_t> &servers);
+void SetRetransmissionSettings(const RetransmissionSettings_t &settings);
+// Sizes the uplink queue of each class; before anything gets queued
+void SetPriorityClasses(const PrioritySettings_t &settings);
+Server_t& PacketDestination(const PackagedDataToSend_t &packet);
+// Leaves the packets that couldn't be sent in packets, those a server's open circuit refuses go to onRefused.
+// The ones whose server has no pending ACK slot left, or no address yet, are held for it without an attempt,
+// as many as the queue of the direction holds; onRefused gets those past that.
+size_t SendUdpBatchAsync(std::vector<PackagedDataToSend_t> &packets, Direction direction,
+                         std::function<void(PackagedDataToSend_t&&, Direction)> &onRefused);
+int CollectUdpAcks(int socket, std::function<void(PackagedDataToSend_t&, Direction)> &onAcked);
+size_t ExpirePendingAcks(std::function<void(PackagedDataToSend_t&&, Direction)> &onExpired);
+size_t ReleasePendingAcks(std::function<void(PackagedDataToSend_t&&, Direction)> &onReleased);
+size_t PendingAcksCount();
+size_t ReleaseRetries(std::function<void(PackagedDataToSend_t&&, Direction)> &onReleased);
+int NextRetryTimeoutMs();
+int NextPendingAckTimeoutMs();
+int RecvUdp(uint16_t serverIndex, char *msg, int size,
+            std::function<bool(char*, int, DownlinkPacket_t&, char*, int*)> &validator);
+// Radio thread: the TX_ACK of a DOWN_RX packet, taken before the packet is handed over to the scheduler,
+// then reported with whether its downlink got scheduled
+DownlinkAck_t PrepareDownlinkAck(const PackagedDataToSend_t &packet);
+void AcknowledgeDownlink(DownlinkAck_t &&ack, const char *error);
+// Network exchange worker: sends the TX_ACKs reported since the last call
+size_t SendDownlinkAcks();
+NetworkConf_t PrepareNetworking(const char* networkInterfaceName, char gatewayId[25]);
+
+void EnqueueFanOut(uint8_t pkt_type, const PacketBufferRef &body, uint32_t body_len,
+                   PackagedDataContentType_t data_type, Direction direction, PriorityClass_t priority,
+                   uint16_t frames = 1);
+// Schedules a retry after the backoff of the server, false if the packet is out of attempts or too old.
+// Fresh packets always get dequeued ahead of the retries, which are rate limited per server.
+bool RequeuePacket(PackagedDataToSend_t &&packet, Direction direction);
+// Moves spooled uplinks back to the uplink queue at the configured rate, once their server acknowledges again.
+// Returns the ms until it's worth calling again, -1 if there's nothing spooled.
+int ReplaySpooledUplinks();
 PackagedDataToSend_t DequeuePacket(Direction direction);
+PacketQueueStats_t GetPacketQueueStats(Direction direction);
+int PacketQueueEventFd();
+void NotifyPacketQueue();
+int DownlinkQueueEventFd();
+void NotifyDownlinkQueue();
 
 
 void PublishStatProtocolPacket(PlatformInfo_t &cfg, LoRaPacketTrafficStats_t &pktStats);
+// With a hold time, the uplinks received close together are packed into the same PUSH_DATA; a critical one
+// sends it right away. Radio thread only, like the flushing of those held:
+void SetUplinkCoalescing(const UplinkCoalescingSettings_t &settings);
 void PublishLoRaUplinkProtocolPacket(PlatformInfo_t &cfg, LoRaDataPkt_t &loraPacket);
+// Enqueues the held uplinks once their hold time is over, or whatever it is with force
+void FlushCoalescedUplinks(bool force);
+// -1 if none is held
+int CoalescedUplinksDueInMs();
 void PublishLoRaDownlinkProtocolPacket(PlatformInfo_t &cfg);
+bool DownlinkTxJsonToPacket(const char *json, size_t json_sz, uint32_t spi_speed_hz,
+                            DownlinkPacket_t &result, const char **tx_ack_error);
 
 #endif
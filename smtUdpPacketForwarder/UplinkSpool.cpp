@@ -0,0 +1,453 @@
+#include "UplinkSpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SPOOL_FILE_MAGIC 0x4C4F4F50   /* "POOL" */
+#define SPOOL_RECORD_MAGIC 0x50535055 /* "UPSP" */
+#define SPOOL_VERSION 1
+#define SPOOL_DATA_OFFSET 4096        /* the file header takes the first page */
+#define SPOOL_RECORD_TAKEN 0x01       /* replayed already, only kept until the ones before it are gone too */
+
+typedef struct SpoolFileHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;        // of the records area
+  uint64_t head;            // offset of the oldest record
+  uint32_t head_sequence;
+  uint32_t reserved;
+} SpoolFileHeader_t;
+
+// followed by the server name and the body, padded to 8 bytes
+typedef struct SpoolRecordHeader
+{
+  uint32_t magic;
+  uint32_t length;          // of the whole record, padding included
+  uint32_t sequence;        // one more than the record before, tells apart the stale records overwritten in part
+  uint32_t crc;             // CRC-32 of the record, computed with this field zeroed
+  uint64_t spooled_at_ms;
+  uint16_t port;
+  uint8_t server_len;
+  uint8_t flags;            // SPOOL_RECORD_*, left out of the CRC
+  uint32_t body_len;
+} SpoolRecordHeader_t;
+
+static_assert(sizeof(SpoolFileHeader_t) <= SPOOL_DATA_OFFSET, "the file header fits its page");
+static_assert(sizeof(SpoolRecordHeader_t) % 8 == 0, "records are 8 bytes aligned");
+
+static int spool_fd = -1;
+static uint8_t *spool_map = nullptr;
+static size_t spool_map_size = 0;
+static SpoolFileHeader_t *spool_header = nullptr;
+static uint8_t *spool_data = nullptr;
+static uint32_t spool_replay_per_s = 0;
+
+// where the next record goes, the ring is [head, tail) wrapping around at the capacity
+static uint64_t spool_tail = 0;
+static uint32_t spool_next_sequence = 0;
+
+// the records between the head and the tail, taken ones included
+static std::atomic<uint32_t> spool_records{0};
+static std::atomic<uint32_t> spool_taken{0};
+static std::atomic<uint32_t> spool_bytes{0};
+static std::atomic<uint64_t> spool_oldest_ms{0};
+static std::atomic<uint32_t> spool_overwritten{0};
+
+static uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t len) // {{{
+{
+  static uint32_t table[256];
+  static bool tableReady = false;
+  if (!tableReady)
+  {
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) c = (c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1);
+      table[i] = c;
+    }
+    tableReady = true;
+  }
+
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i)
+  { crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8); }
+  return ~crc;
+} // }}}
+
+static uint64_t NowUnixMs() // {{{
+{
+  return (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+} // }}}
+
+static uint32_t RecordCrc(const SpoolRecordHeader_t *record) // {{{
+{
+  SpoolRecordHeader_t header = *record;
+  header.crc = 0;
+  header.flags = 0;
+
+  uint32_t crc = Crc32(0, (const uint8_t *) &header, sizeof(header));
+  return Crc32(crc, (const uint8_t *) (record + 1), record->length - sizeof(header));
+} // }}}
+
+static SpoolRecordHeader_t* ValidRecordAt(uint64_t offset, uint32_t sequence) // {{{
+{
+  uint64_t capacity = spool_header->capacity;
+  if (offset + sizeof(SpoolRecordHeader_t) > capacity)
+  { return nullptr; }
+
+  SpoolRecordHeader_t *record = (SpoolRecordHeader_t *) (spool_data + offset);
+  if (record->magic != SPOOL_RECORD_MAGIC || record->sequence != sequence ||
+      record->length < sizeof(SpoolRecordHeader_t) || record->length > capacity - offset ||
+      sizeof(SpoolRecordHeader_t) + record->server_len + record->body_len > record->length)
+  { return nullptr; }
+
+  return (RecordCrc(record) == record->crc ? record : nullptr);
+} // }}}
+
+static uint64_t LocateRecord(uint64_t offset, uint32_t sequence) // {{{
+{
+  // a record that doesn't fit before the end of the file is written at its start
+  if (ValidRecordAt(offset, sequence) != nullptr) return offset;
+  if (offset != 0 && ValidRecordAt(0, sequence) != nullptr) return 0;
+  return UINT64_MAX;
+} // }}}
+
+static void UpdateOldest() // {{{
+{
+  uint64_t offset = (spool_records.load(std::memory_order_relaxed) > 0 ?
+                     LocateRecord(spool_header->head, spool_header->head_sequence) : UINT64_MAX);
+  spool_oldest_ms.store(offset == UINT64_MAX ? 0 : ((SpoolRecordHeader_t *) (spool_data + offset))->spooled_at_ms,
+                        std::memory_order_relaxed);
+} // }}}
+
+static bool DropOldest() // {{{
+{
+  uint64_t offset = LocateRecord(spool_header->head, spool_header->head_sequence);
+  if (offset == UINT64_MAX)
+  {
+    // can't be, unless the file got corrupted under us; start over
+    spool_header->head = spool_tail = 0;
+    spool_header->head_sequence = spool_next_sequence;
+    spool_records.store(0, std::memory_order_relaxed);
+    spool_taken.store(0, std::memory_order_relaxed);
+    spool_bytes.store(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  const SpoolRecordHeader_t *record = (const SpoolRecordHeader_t *) (spool_data + offset);
+  uint32_t length = record->length;
+  bool taken = (record->flags & SPOOL_RECORD_TAKEN);
+  if (taken) spool_taken.fetch_sub(1, std::memory_order_relaxed);
+
+  spool_header->head = offset + length;
+  ++spool_header->head_sequence;
+  spool_records.fetch_sub(1, std::memory_order_relaxed);
+  spool_bytes.fetch_sub(length, std::memory_order_relaxed);
+
+  if (spool_records.load(std::memory_order_relaxed) == 0)
+  {
+    spool_header->head = spool_tail = 0;
+    spool_header->head_sequence = spool_next_sequence;
+    return !taken;
+  }
+
+  // the next one may have been wrapped to the start
+  uint64_t next = LocateRecord(spool_header->head, spool_header->head_sequence);
+  if (next != UINT64_MAX) spool_header->head = next;
+  return !taken;
+} // }}}
+
+static void DropTakenOldest() // {{{
+{
+  // the head is always a record still to be replayed
+  while (spool_records.load(std::memory_order_relaxed) > 0)
+  {
+    uint64_t offset = LocateRecord(spool_header->head, spool_header->head_sequence);
+    if (offset == UINT64_MAX || !(((SpoolRecordHeader_t *) (spool_data + offset))->flags & SPOOL_RECORD_TAKEN))
+    { return; }
+    DropOldest();
+  }
+} // }}}
+
+static bool OverlapsRecords(uint64_t offset, uint64_t length) // {{{
+{
+  if (spool_records.load(std::memory_order_relaxed) == 0)
+  { return false; }
+
+  uint64_t head = spool_header->head, end = offset + length;
+  if (head < spool_tail)
+  { return offset < spool_tail && end > head; }
+
+  // wrapped around: [head, capacity) and [0, tail)
+  return end > head || offset < spool_tail;
+} // }}}
+
+static void RecoverRecords() // {{{
+{
+  // the records still intact from the head on are kept, the first missing or damaged one ends the spool
+  uint64_t offset = (spool_header->head < spool_header->capacity ? spool_header->head : 0);
+  uint32_t sequence = spool_header->head_sequence;
+  uint32_t records = 0, taken = 0, bytes = 0;
+
+  spool_header->head = offset;
+  spool_tail = offset;
+
+  for (uint64_t found; (found = LocateRecord(offset, sequence)) != UINT64_MAX; ++sequence)
+  {
+    if (records == 0) spool_header->head = found;
+
+    const SpoolRecordHeader_t *record = (const SpoolRecordHeader_t *) (spool_data + found);
+    uint32_t length = record->length;
+    if (record->flags & SPOOL_RECORD_TAKEN) ++taken;
+    offset = found + length;
+    spool_tail = offset;
+    bytes += length;
+
+    if (++records > spool_header->capacity / sizeof(SpoolRecordHeader_t))
+    { break; } // can't be, but never loops forever
+  }
+
+  if (records == 0)
+  {
+    spool_header->head = spool_tail = 0;
+    spool_header->head_sequence = sequence;
+  }
+
+  spool_next_sequence = sequence;
+  spool_records.store(records, std::memory_order_relaxed);
+  spool_taken.store(taken, std::memory_order_relaxed);
+  spool_bytes.store(bytes, std::memory_order_relaxed);
+  DropTakenOldest();
+  UpdateOldest();
+} // }}}
+
+bool OpenUplinkSpool(const UplinkSpoolSettings_t &settings) // {{{
+{
+  if (settings.path.empty() || spool_map != nullptr)
+  { return false; }
+
+  uint32_t sizeKb = (settings.size_kb < UPLINK_SPOOL_MIN_SIZE_KB ? UPLINK_SPOOL_MIN_SIZE_KB : settings.size_kb);
+  size_t size = (size_t) sizeKb * 1024;
+
+  int fd = open(settings.path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1)
+  {
+    perror(settings.path.c_str());
+    return false;
+  }
+
+  struct stat st;
+  bool fresh = (fstat(fd, &st) != 0 || (size_t) st.st_size != size);
+  if (fresh && (ftruncate(fd, 0) != 0 || posix_fallocate(fd, 0, size) != 0))
+  {
+    // allocated up front, so that a full disk can't fault the mapping later
+    printf("Cannot allocate %u KiB for the uplink spool %s\n", sizeKb, settings.path.c_str());
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    perror("mmap");
+    close(fd);
+    return false;
+  }
+
+  spool_fd = fd;
+  spool_map = (uint8_t *) map;
+  spool_map_size = size;
+  spool_header = (SpoolFileHeader_t *) spool_map;
+  spool_data = spool_map + SPOOL_DATA_OFFSET;
+  spool_replay_per_s = settings.replay_per_s;
+
+  if (fresh || spool_header->magic != SPOOL_FILE_MAGIC || spool_header->version != SPOOL_VERSION ||
+      spool_header->capacity != size - SPOOL_DATA_OFFSET)
+  {
+    memset(spool_header, 0, sizeof(SpoolFileHeader_t));
+    spool_header->magic = SPOOL_FILE_MAGIC;
+    spool_header->version = SPOOL_VERSION;
+    spool_header->capacity = size - SPOOL_DATA_OFFSET;
+  }
+
+  RecoverRecords();
+
+  UplinkSpoolStats_t stats = GetUplinkSpoolStats();
+  printf("Uplink spool %s: %u KiB, %u records kept (the oldest from %u s ago), replayed at %u/s\n",
+    settings.path.c_str(), sizeKb, stats.records, stats.oldest_age_s, spool_replay_per_s);
+  fflush(stdout);
+  return true;
+} // }}}
+
+void CloseUplinkSpool() // {{{
+{
+  if (spool_map == nullptr)
+  { return; }
+
+  msync(spool_map, spool_map_size, MS_SYNC);
+  munmap(spool_map, spool_map_size);
+  close(spool_fd);
+
+  spool_map = nullptr;
+  spool_header = nullptr;
+  spool_data = nullptr;
+  spool_fd = -1;
+} // }}}
+
+bool UplinkSpoolEnabled() // {{{
+{
+  return spool_map != nullptr;
+} // }}}
+
+uint32_t UplinkSpoolReplayRate() // {{{
+{
+  return spool_replay_per_s;
+} // }}}
+
+bool SpoolUplink(const Server_t &server, const uint8_t *body, uint32_t body_len) // {{{
+{
+  if (spool_map == nullptr)
+  { return false; }
+
+  size_t serverLen = std::min(server.address.size(), (size_t) UPLINK_SPOOL_MAX_SERVER_NAME);
+  uint64_t length = (sizeof(SpoolRecordHeader_t) + serverLen + body_len + 7) & ~(uint64_t) 7;
+  uint64_t capacity = spool_header->capacity;
+  if (length > capacity)
+  { return false; }
+
+  uint64_t offset = (capacity - spool_tail < length ? 0 : spool_tail);
+  while (OverlapsRecords(offset, length))
+  {
+    if (DropOldest()) spool_overwritten.fetch_add(1, std::memory_order_relaxed);
+    DropTakenOldest();
+    if (spool_records.load(std::memory_order_relaxed) == 0) offset = 0;
+  }
+
+  SpoolRecordHeader_t *record = (SpoolRecordHeader_t *) (spool_data + offset);
+  SpoolRecordHeader_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SPOOL_RECORD_MAGIC;
+  header.length = (uint32_t) length;
+  header.sequence = spool_next_sequence;
+  header.spooled_at_ms = NowUnixMs();
+  header.port = server.port;
+  header.server_len = (uint8_t) serverLen;
+  header.body_len = body_len;
+
+  uint8_t *payload = (uint8_t *) (record + 1);
+  memcpy(payload, server.address.data(), serverLen);
+  memcpy(payload + serverLen, body, body_len);
+  memset(payload + serverLen + body_len, 0, length - sizeof(header) - serverLen - body_len);
+
+  // the header last, so that a record torn by a crash never checks out
+  memcpy(record, &header, sizeof(header));
+  record->crc = RecordCrc(record);
+
+  if (spool_records.load(std::memory_order_relaxed) == 0)
+  {
+    spool_header->head = offset;
+    spool_header->head_sequence = spool_next_sequence;
+  }
+
+  spool_tail = offset + length;
+  ++spool_next_sequence;
+  spool_bytes.fetch_add((uint32_t) length, std::memory_order_relaxed);
+  if (spool_records.fetch_add(1, std::memory_order_relaxed) == 0)
+  { UpdateOldest(); }
+
+  return true;
+} // }}}
+
+bool NextSpooledUplink(SpoolCursor_t &cursor, SpooledUplink_t &record, uint8_t *body, size_t body_sz) // {{{
+{
+  uint32_t records = (spool_map != nullptr ? spool_records.load(std::memory_order_relaxed) : 0);
+  if (records == 0)
+  {
+    cursor = SpoolCursor_t();
+    return false;
+  }
+
+  // from the oldest record again once the one the cursor is on is gone
+  uint64_t offset = spool_header->head;
+  uint32_t sequence = spool_header->head_sequence;
+  if (cursor.offset != UINT64_MAX && (uint32_t) (cursor.sequence - spool_header->head_sequence) < records)
+  {
+    offset = cursor.offset + ((const SpoolRecordHeader_t *) (spool_data + cursor.offset))->length;
+    sequence = cursor.sequence + 1;
+  }
+
+  for (; sequence != spool_next_sequence; ++sequence)
+  {
+    uint64_t found = LocateRecord(offset, sequence);
+    if (found == UINT64_MAX)
+    {
+      if (sequence == spool_header->head_sequence)
+      {
+        printf("The uplink spool is damaged, dropping its %u records\n", records - spool_taken.load(std::memory_order_relaxed));
+        DropOldest();
+        UpdateOldest();
+      }
+      break;
+    }
+
+    const SpoolRecordHeader_t *header = (const SpoolRecordHeader_t *) (spool_data + found);
+    offset = found + header->length;
+    if (header->flags & SPOOL_RECORD_TAKEN)
+    { continue; }
+
+    const char *payload = (const char *) (header + 1);
+    record.server.assign(payload, header->server_len);
+    record.port = header->port;
+    record.spooled_at_ms = header->spooled_at_ms;
+    record.body_len = (header->body_len < body_sz ? header->body_len : (uint32_t) body_sz);
+    memcpy(body, payload + header->server_len, record.body_len);
+
+    cursor.offset = found;
+    cursor.sequence = sequence;
+    return true;
+  }
+
+  cursor = SpoolCursor_t();
+  return false;
+} // }}}
+
+void TakeSpooledUplink(const SpoolCursor_t &cursor) // {{{
+{
+  if (spool_map == nullptr || cursor.offset == UINT64_MAX ||
+      (uint32_t) (cursor.sequence - spool_header->head_sequence) >= spool_records.load(std::memory_order_relaxed))
+  { return; }
+
+  SpoolRecordHeader_t *record = ValidRecordAt(cursor.offset, cursor.sequence);
+  if (record == nullptr || (record->flags & SPOOL_RECORD_TAKEN))
+  { return; }
+
+  // marked only, unless it's the oldest one: the ring can't do without the records between its head and tail
+  record->flags |= SPOOL_RECORD_TAKEN;
+  spool_taken.fetch_add(1, std::memory_order_relaxed);
+
+  DropTakenOldest();
+  UpdateOldest();
+} // }}}
+
+UplinkSpoolStats_t GetUplinkSpoolStats() // {{{
+{
+  UplinkSpoolStats_t result;
+  result.records = spool_records.load(std::memory_order_relaxed) - spool_taken.load(std::memory_order_relaxed);
+  result.bytes = spool_bytes.load(std::memory_order_relaxed);
+  result.overwritten = spool_overwritten.load(std::memory_order_relaxed);
+
+  uint64_t oldest = spool_oldest_ms.load(std::memory_order_relaxed);
+  uint64_t now = NowUnixMs();
+  result.oldest_age_s = (result.records == 0 || oldest == 0 || oldest > now ? 0 : (uint32_t) ((now - oldest) / 1000));
+  return result;
+} // }}}
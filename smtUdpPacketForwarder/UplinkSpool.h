@@ -0,0 +1,57 @@
+#ifndef LORA_PF_UPLINK_SPOOL_H
+#define LORA_PF_UPLINK_SPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "config.h"
+
+#define UPLINK_SPOOL_MIN_SIZE_KB 64
+#define UPLINK_SPOOL_MAX_SERVER_NAME 255
+
+// Optional on-disk spool of the uplinks no server has acknowledged: a memory-mapped ring file of CRC'd records,
+// appended to at the tail and the oldest records overwritten once it's full. It survives restarts, the records
+// found intact at the head on opening are kept. A record replayed ahead of older ones is only marked as taken
+// until those are gone. Only the network exchange thread may touch the records.
+
+typedef struct SpooledUplink
+{
+  std::string server;        // address and port of the server it was meant for
+  uint16_t port;
+  uint64_t spooled_at_ms;    // unix time
+  uint32_t body_len;
+} SpooledUplink_t;
+
+typedef struct UplinkSpoolStats
+{
+  uint32_t records;
+  uint32_t bytes;
+  uint32_t oldest_age_s;    // 0 when empty
+  uint32_t overwritten;     // oldest records dropped for lack of room since opening
+} UplinkSpoolStats_t;
+
+bool OpenUplinkSpool(const UplinkSpoolSettings_t &settings);
+void CloseUplinkSpool();
+bool UplinkSpoolEnabled();
+uint32_t UplinkSpoolReplayRate();   // records per second moved back to the uplink queue
+
+// false if the spool is disabled or the record can never fit
+bool SpoolUplink(const Server_t &server, const uint8_t *body, uint32_t body_len);
+// Where a walk through the records is at; a new one starts from the oldest record
+typedef struct SpoolCursor
+{
+  uint64_t offset = UINT64_MAX;
+  uint32_t sequence = 0;
+} SpoolCursor_t;
+
+// Moves the cursor on to the next record not taken yet, its body copied to body (body_sz bytes at most).
+// False once past the newest one, the cursor then starts over.
+bool NextSpooledUplink(SpoolCursor_t &cursor, SpooledUplink_t &record, uint8_t *body, size_t body_sz);
+// The record the cursor is on leaves the spool
+void TakeSpooledUplink(const SpoolCursor_t &cursor);
+
+// any thread
+UplinkSpoolStats_t GetUplinkSpoolStats();
+
+#endif
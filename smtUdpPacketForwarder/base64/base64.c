@@ -22,6 +22,7 @@ Maintainer: Sylvain Miermont
 #include <stdint.h>
 
 #include "base64.h"
+#include "base64_simd.h"
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE MACROS ------------------------------------------------------- */
@@ -137,8 +138,8 @@ int bin_to_b64_nopad(const uint8_t * in, int size, char * out, int max_len) {
 		return -1;
 	}
 	
-	/* process all the full blocks */
-	for (i=0; i < full_blocks; ++i) {
+	/* process all the full blocks, the bulk of them vectorised if the CPU allows */
+	for (i = b64_encode_blocks(in, full_blocks, out); i < full_blocks; ++i) {
 		b  = (0xFF & in[3*i]    ) << 16;
 		b |= (0xFF & in[3*i + 1]) << 8;
 		b |=  0xFF & in[3*i + 2];
@@ -214,8 +215,8 @@ int b64_to_bin_nopad(const char * in, int size, uint8_t * out, int max_len) {
 		return -1;
 	}
 	
-	/* process all the full blocks */
-	for (i=0; i < full_blocks; ++i) {
+	/* process all the full blocks, the bulk of them vectorised if the CPU allows */
+	for (i = b64_decode_blocks(in, full_blocks, out); i < full_blocks; ++i) {
 		b  = (0x3F & char_to_code(in[4*i]    )) << 18;
 		b |= (0x3F & char_to_code(in[4*i + 1])) << 12;
 		b |= (0x3F & char_to_code(in[4*i + 2])) << 6;
@@ -0,0 +1,386 @@
+/*
+Description:
+	Vectorised bulk kernels of the Base64 library, see base64_simd.h
+
+	The SSSE3/AVX2 kernels follow the well known pshufb based approach (W. Mula,
+	D. Lemire, A. Klomp), the NEON one works on de-interleaved 8 block vectors.
+	They assume the RFC 1421 alphabet, which is what base64.c uses.
+*/
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base64_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#define B64_X86
+	#include <immintrin.h>
+#elif defined(__aarch64__) || (defined(__arm__) && defined(__ARM_NEON))
+	/* armhf builds need NEON enabled at compile time (e.g. -mfpu=neon), otherwise the table kernel is used */
+	#define B64_NEON
+	#include <arm_neon.h>
+#endif
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MODULE-WIDE VARIABLES ---------------------------------------- */
+
+typedef int (*b64_encode_kernel_t)(const uint8_t * in, int blocks, char * out);
+typedef int (*b64_decode_kernel_t)(const char * in, int blocks, uint8_t * out);
+
+static const char enc_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static uint8_t dec_table[256]; /* 0xFF for characters outside of the alphabet */
+
+static b64_encode_kernel_t encode_kernel = NULL;
+static b64_decode_kernel_t decode_kernel = NULL;
+static const char * kernel_name = "reference";
+static int kernel_disabled = 0;
+
+/* -------------------------------------------------------------------------- */
+/* --- PORTABLE KERNEL ------------------------------------------------------ */
+
+static int encode_blocks_table(const uint8_t * in, int blocks, char * out) {
+	int i;
+	uint32_t b;
+
+	for (i = 0; i < blocks; ++i) {
+		b = ((uint32_t)in[3*i] << 16) | ((uint32_t)in[3*i + 1] << 8) | in[3*i + 2];
+		out[4*i + 0] = enc_table[(b >> 18) & 0x3F];
+		out[4*i + 1] = enc_table[(b >> 12) & 0x3F];
+		out[4*i + 2] = enc_table[(b >> 6 ) & 0x3F];
+		out[4*i + 3] = enc_table[ b        & 0x3F];
+	}
+	return blocks;
+}
+
+static int decode_blocks_table(const char * in, int blocks, uint8_t * out) {
+	int i;
+	uint8_t c0, c1, c2, c3;
+	uint32_t b;
+
+	for (i = 0; i < blocks; ++i) {
+		c0 = dec_table[(uint8_t)in[4*i]    ];
+		c1 = dec_table[(uint8_t)in[4*i + 1]];
+		c2 = dec_table[(uint8_t)in[4*i + 2]];
+		c3 = dec_table[(uint8_t)in[4*i + 3]];
+		if ((c0 | c1 | c2 | c3) & 0x80) {
+			break; /* left to the reference code */
+		}
+		b = ((uint32_t)c0 << 18) | ((uint32_t)c1 << 12) | ((uint32_t)c2 << 6) | c3;
+		out[3*i + 0] = (b >> 16) & 0xFF;
+		out[3*i + 1] = (b >> 8 ) & 0xFF;
+		out[3*i + 2] =  b        & 0xFF;
+	}
+	return i;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- X86 KERNELS ---------------------------------------------------------- */
+
+#ifdef B64_X86
+
+/* the 16 byte loads/stores may touch up to 4 bytes past the blocks they convert, hence the spare blocks */
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_reshuffle_ssse3(__m128i in) {
+	/* 3 bytes -> 4 x 6 bit values, each in its own byte */
+	in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00));
+	const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003F03F0));
+	const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_translate_ssse3(__m128i in) {
+	/* 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12: the index of the offset to add */
+	__m128i idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+	const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), in);
+	idx = _mm_or_si128(idx, _mm_and_si128(less, _mm_set1_epi8(13)));
+	const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	return _mm_add_epi8(in, _mm_shuffle_epi8(offsets, idx));
+}
+
+__attribute__((target("ssse3")))
+static inline int dec_translate_ssse3(__m128i * str) {
+	const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i mask_2f = _mm_set1_epi8(0x2F);
+
+	const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(*str, 4), mask_2f);
+	const __m128i lo_nibbles = _mm_and_si128(*str, mask_2f);
+	const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+	const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+	/* a character outside of the alphabet has a common bit in both lookups */
+	if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) {
+		return 0;
+	}
+
+	const __m128i eq_2f = _mm_cmpeq_epi8(*str, mask_2f);
+	*str = _mm_add_epi8(*str, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles)));
+	return 1;
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i dec_reshuffle_ssse3(__m128i in) {
+	/* 4 x 6 bit values -> 3 bytes, packed into the lower 12 bytes */
+	const __m128i merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+	const __m128i out = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static int encode_blocks_ssse3(const uint8_t * in, int blocks, char * out) {
+	int i;
+
+	for (i = 0; blocks - i >= 6; i += 4) {
+		__m128i str = _mm_loadu_si128((const __m128i *)(in + 3*i));
+		_mm_storeu_si128((__m128i *)(out + 4*i), enc_translate_ssse3(enc_reshuffle_ssse3(str)));
+	}
+	return i + encode_blocks_table(in + 3*i, blocks - i, out + 4*i);
+}
+
+__attribute__((target("ssse3")))
+static int decode_blocks_ssse3(const char * in, int blocks, uint8_t * out) {
+	int i;
+
+	for (i = 0; blocks - i >= 6; i += 4) {
+		__m128i str = _mm_loadu_si128((const __m128i *)(in + 4*i));
+		if (!dec_translate_ssse3(&str)) {
+			break;
+		}
+		_mm_storeu_si128((__m128i *)(out + 3*i), dec_reshuffle_ssse3(str));
+	}
+	return i + decode_blocks_table(in + 4*i, blocks - i, out + 3*i);
+}
+
+__attribute__((target("avx2")))
+static int encode_blocks_avx2(const uint8_t * in, int blocks, char * out) {
+	int i;
+	const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+	/* 2 x 12 bytes, one per 128 bit lane */
+	for (i = 0; blocks - i >= 10; i += 8) {
+		__m256i str = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(in + 3*i))),
+			_mm_loadu_si128((const __m128i *)(in + 3*i + 12)), 1);
+
+		str = _mm256_shuffle_epi8(str, shuffle);
+		const __m256i t0 = _mm256_and_si256(str, _mm256_set1_epi32(0x0FC0FC00));
+		const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		const __m256i t2 = _mm256_and_si256(str, _mm256_set1_epi32(0x003F03F0));
+		const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		str = _mm256_or_si256(t1, t3);
+
+		__m256i idx = _mm256_subs_epu8(str, _mm256_set1_epi8(51));
+		const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), str);
+		idx = _mm256_or_si256(idx, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+		str = _mm256_add_epi8(str, _mm256_shuffle_epi8(offsets, idx));
+
+		_mm256_storeu_si256((__m256i *)(out + 4*i), str);
+	}
+	/* the rest goes through the non-VEX SSSE3 code, which would be slowed down by dirty upper halves */
+	_mm256_zeroupper();
+	return i + encode_blocks_ssse3(in + 3*i, blocks - i, out + 4*i);
+}
+
+__attribute__((target("avx2")))
+static int decode_blocks_avx2(const char * in, int blocks, uint8_t * out) {
+	int i;
+	const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+	const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+
+	/* 32 characters in, 24 bytes out, 8 spare ones written */
+	for (i = 0; blocks - i >= 11; i += 8) {
+		__m256i str = _mm256_loadu_si256((const __m256i *)(in + 4*i));
+
+		const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+		const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+		const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+		const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+		if (!_mm256_testz_si256(lo, hi)) {
+			break;
+		}
+
+		const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+		str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+
+		const __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+		str = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+		str = _mm256_shuffle_epi8(str, pack);
+		str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+
+		_mm256_storeu_si256((__m256i *)(out + 3*i), str);
+	}
+	_mm256_zeroupper();
+	return i + decode_blocks_ssse3(in + 4*i, blocks - i, out + 3*i);
+}
+
+#endif /* B64_X86 */
+
+/* -------------------------------------------------------------------------- */
+/* --- NEON KERNELS --------------------------------------------------------- */
+
+#ifdef B64_NEON
+
+static inline uint8x8_t enc_translate_neon(uint8x8_t x) {
+	uint8x8_t offset = vdup_n_u8('A');
+	offset = vbsl_u8(vcge_u8(x, vdup_n_u8(26)), vdup_n_u8((uint8_t)('a' - 26)), offset);
+	offset = vbsl_u8(vcge_u8(x, vdup_n_u8(52)), vdup_n_u8((uint8_t)('0' - 52)), offset);
+	offset = vbsl_u8(vceq_u8(x, vdup_n_u8(62)), vdup_n_u8((uint8_t)('+' - 62)), offset);
+	offset = vbsl_u8(vceq_u8(x, vdup_n_u8(63)), vdup_n_u8((uint8_t)('/' - 63)), offset);
+	return vadd_u8(x, offset);
+}
+
+static inline uint8x8_t dec_translate_neon(uint8x8_t c, uint8x8_t * valid) {
+	const uint8x8_t upper = vand_u8(vcge_u8(c, vdup_n_u8('A')), vcle_u8(c, vdup_n_u8('Z')));
+	const uint8x8_t lower = vand_u8(vcge_u8(c, vdup_n_u8('a')), vcle_u8(c, vdup_n_u8('z')));
+	const uint8x8_t digit = vand_u8(vcge_u8(c, vdup_n_u8('0')), vcle_u8(c, vdup_n_u8('9')));
+	const uint8x8_t plus = vceq_u8(c, vdup_n_u8('+'));
+	const uint8x8_t slash = vceq_u8(c, vdup_n_u8('/'));
+
+	uint8x8_t offset = vdup_n_u8(0);
+	offset = vbsl_u8(upper, vdup_n_u8((uint8_t)(0 - 'A')), offset);
+	offset = vbsl_u8(lower, vdup_n_u8((uint8_t)(26 - 'a')), offset);
+	offset = vbsl_u8(digit, vdup_n_u8((uint8_t)(52 - '0')), offset);
+	offset = vbsl_u8(plus, vdup_n_u8((uint8_t)(62 - '+')), offset);
+	offset = vbsl_u8(slash, vdup_n_u8((uint8_t)(63 - '/')), offset);
+
+	*valid = vand_u8(*valid, vorr_u8(vorr_u8(vorr_u8(upper, lower), vorr_u8(digit, plus)), slash));
+	return vadd_u8(c, offset);
+}
+
+static int encode_blocks_neon(const uint8_t * in, int blocks, char * out) {
+	int i;
+	uint8x8x3_t bytes;
+	uint8x8x4_t chars;
+
+	/* 8 blocks at once, de-interleaved: lane n of val[k] is byte/character k of block n */
+	for (i = 0; blocks - i >= 8; i += 8) {
+		bytes = vld3_u8(in + 3*i);
+		chars.val[0] = vshr_n_u8(bytes.val[0], 2);
+		chars.val[1] = vorr_u8(vshl_n_u8(vand_u8(bytes.val[0], vdup_n_u8(0x03)), 4), vshr_n_u8(bytes.val[1], 4));
+		chars.val[2] = vorr_u8(vshl_n_u8(vand_u8(bytes.val[1], vdup_n_u8(0x0F)), 2), vshr_n_u8(bytes.val[2], 6));
+		chars.val[3] = vand_u8(bytes.val[2], vdup_n_u8(0x3F));
+
+		chars.val[0] = enc_translate_neon(chars.val[0]);
+		chars.val[1] = enc_translate_neon(chars.val[1]);
+		chars.val[2] = enc_translate_neon(chars.val[2]);
+		chars.val[3] = enc_translate_neon(chars.val[3]);
+		vst4_u8((uint8_t *)(out + 4*i), chars);
+	}
+	return i + encode_blocks_table(in + 3*i, blocks - i, out + 4*i);
+}
+
+static int decode_blocks_neon(const char * in, int blocks, uint8_t * out) {
+	int i;
+	uint8x8x4_t chars;
+	uint8x8x3_t bytes;
+	uint8x8_t valid;
+
+	for (i = 0; blocks - i >= 8; i += 8) {
+		chars = vld4_u8((const uint8_t *)(in + 4*i));
+		valid = vdup_n_u8(0xFF);
+		chars.val[0] = dec_translate_neon(chars.val[0], &valid);
+		chars.val[1] = dec_translate_neon(chars.val[1], &valid);
+		chars.val[2] = dec_translate_neon(chars.val[2], &valid);
+		chars.val[3] = dec_translate_neon(chars.val[3], &valid);
+		if (vget_lane_u64(vreinterpret_u64_u8(valid), 0) != UINT64_MAX) {
+			break;
+		}
+
+		bytes.val[0] = vorr_u8(vshl_n_u8(chars.val[0], 2), vshr_n_u8(chars.val[1], 4));
+		bytes.val[1] = vorr_u8(vshl_n_u8(chars.val[1], 4), vshr_n_u8(chars.val[2], 2));
+		bytes.val[2] = vorr_u8(vshl_n_u8(chars.val[2], 6), chars.val[3]);
+		vst3_u8(out + 3*i, bytes);
+	}
+	return i + decode_blocks_table(in + 4*i, blocks - i, out + 3*i);
+}
+
+#endif /* B64_NEON */
+
+/* -------------------------------------------------------------------------- */
+/* --- DISPATCH ------------------------------------------------------------- */
+
+__attribute__((constructor))
+static void select_kernel(void) {
+	int i;
+
+	for (i = 0; i < 256; ++i) {
+		dec_table[i] = 0xFF;
+	}
+	for (i = 0; i < 64; ++i) {
+		dec_table[(uint8_t)enc_table[i]] = (uint8_t)i;
+	}
+
+	encode_kernel = encode_blocks_table;
+	decode_kernel = decode_blocks_table;
+	kernel_name = "table";
+
+#if defined(B64_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		encode_kernel = encode_blocks_avx2;
+		decode_kernel = decode_blocks_avx2;
+		kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("ssse3")) {
+		encode_kernel = encode_blocks_ssse3;
+		decode_kernel = decode_blocks_ssse3;
+		kernel_name = "ssse3";
+	}
+#elif defined(B64_NEON)
+	encode_kernel = encode_blocks_neon;
+	decode_kernel = decode_blocks_neon;
+	kernel_name = "neon";
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+int b64_encode_blocks(const uint8_t * in, int blocks, char * out) {
+	if (kernel_disabled || (encode_kernel == NULL)) {
+		return 0;
+	}
+	return encode_kernel(in, blocks, out);
+}
+
+int b64_decode_blocks(const char * in, int blocks, uint8_t * out) {
+	if (kernel_disabled || (decode_kernel == NULL)) {
+		return 0;
+	}
+	return decode_kernel(in, blocks, out);
+}
+
+const char * b64_kernel_name(void) {
+	return (kernel_disabled || (encode_kernel == NULL) ? "reference" : kernel_name);
+}
+
+void b64_kernel_disable(int disable) {
+	kernel_disabled = disable;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,52 @@
+/*
+Description:
+	Vectorised bulk kernels of the Base64 library
+
+	bin_to_b64_nopad() and b64_to_bin_nopad() hand their full 3 bytes / 4 characters
+	blocks to the best kernel the CPU supports (AVX2, SSSE3, NEON or a portable table
+	driven one), chosen once at startup. The kernels process as many leading blocks as
+	they efficiently can and return that count, the reference code does the rest.
+	A decoding kernel stops before any group containing a non Base64 character, so
+	invalid input is still dealt with by the reference code, exactly as before.
+*/
+
+#ifndef _BASE64_SIMD_H
+#define _BASE64_SIMD_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+@brief Encode leading full blocks of in
+@param blocks number of full 3 bytes blocks in the input
+@return number of blocks encoded into out (4 characters each, no null char written)
+*/
+int b64_encode_blocks(const uint8_t * in, int blocks, char * out);
+
+/**
+@brief Decode leading full blocks of in
+@param blocks number of full 4 characters blocks in the input
+@return number of blocks decoded into out (3 bytes each), stops before invalid characters
+*/
+int b64_decode_blocks(const char * in, int blocks, uint8_t * out);
+
+/**
+@brief Name of the kernel in use, "reference" if disabled
+*/
+const char * b64_kernel_name(void);
+
+/**
+@brief Fall back to the reference code (disable != 0) or go back to the selected kernel, for comparisons
+*/
+void b64_kernel_disable(int disable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
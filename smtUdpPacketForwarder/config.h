@@ -4,6 +4,7 @@
 #include <cstdlib>
 #include <stdint.h>
 #include <inttypes.h>
+#include <ctime>
 
 #include <arpa/inet.h>
 #include <net/if.h>
@@ -13,6 +14,7 @@
 #include <sys/types.h>
 #include <netdb.h>
 
+#include <chrono>
 #include <vector>
 #include <string>
 
@@ -39,6 +41,24 @@ typedef enum CodingRate {
   CR_4_8 = CR_MAX
 } CodingRate_t;
 
+typedef enum SimArrivalProcess {
+  SIM_ARRIVAL_PERIODIC,
+  SIM_ARRIVAL_POISSON
+} SimArrivalProcess_t;
+
+// traffic of the simulated radio, ic_model "SIM"
+typedef struct SimRadioSettings {
+  SimArrivalProcess_t arrival_process = SIM_ARRIVAL_POISSON;
+  uint32_t mean_interval_ms = 1000;
+  SpreadingFactor_t spreading_factor = SF_ALL; // SF_ALL picks a random one for each uplink
+  float rssi_dbm = -80.0f;
+  float snr_db = 7.5f;
+  uint32_t payload_size = 23;
+  float crc_error_ratio = 0.0f;
+  uint32_t seed = 1;
+  std::string tx_log_file; // CSV of the accepted transmissions, empty means none
+} SimRadioSettings_t;
+
 typedef struct LoRaChipSettings {
   std::string ic_model;
 
@@ -51,6 +71,13 @@ typedef struct LoRaChipSettings {
   int pin_dio1;
   int pin_rest; // negative value means not used
 
+  // kernel GPIO line offsets of DIO0/DIO1 for interrupt driven RX; negative value means not used
+  std::string gpio_chip;
+  int gpio_line_dio0;
+  int gpio_line_dio1;
+
+  SimRadioSettings_t sim;
+
   bool all_spreading_factors;
   SpreadingFactor_t spreading_factor;
   double carrier_frequency_mhz;
@@ -62,22 +89,91 @@ typedef struct LoRaChipSettings {
 } LoRaChipSettings_t;
 
 typedef struct NetworkConf {
-  struct sockaddr_in si_other;
   struct ifreq ifr;
+  uint8_t gateway_eui[8];   // as put in the header of each datagram, derived from the ifr hardware address
   int socket;
-  struct timeval recv_timeout;
-  struct sockaddr_in si_other2;
-  socklen_t si_other2_addr_len;
+  int family;               // AF_INET6 (dual-stack) or, where IPv6 isn't available, AF_INET
 } NetworkConf_t;
 
+#define SERVER_MAX_ENDPOINTS 8
+
+typedef struct ServerEndpoint {
+  struct sockaddr_in6 addr;   // IPv4 addresses mapped to ::ffff:a.b.c.d, port set
+  float srtt_ms;              // smoothed round trip time of the ACKs, negative until one has been measured
+  uint32_t missed_acks;       // in a row
+  std::chrono::steady_clock::time_point last_ack;
+  std::chrono::steady_clock::time_point last_miss;
+} ServerEndpoint_t;
+
+typedef enum CircuitState {
+  CIRCUIT_CLOSED = 0,   // everything is sent
+  CIRCUIT_OPEN,         // the server doesn't answer, nothing is sent to it
+  CIRCUIT_HALF_OPEN     // probing it, a datagram at a time
+} CircuitState_t;
+
+typedef struct ServerHealth {
+  CircuitState_t state = CIRCUIT_CLOSED;
+  uint32_t failures = 0;    // datagrams left unacknowledged or not sent in a row
+  uint32_t open_s = 0;      // how long the circuit stays open before the next probe
+  std::chrono::steady_clock::time_point next_probe;
+} ServerHealth_t;
+
 typedef struct Server {
   std::string address;
   uint16_t port;
   uint32_t receive_timeout_ms;
   NetworkConf_t uplink_network_cfg;
   NetworkConf_t downlink_network_cfg;
+
+  // all the addresses the host name resolves to, see ServerEndpoints.h
+  uint32_t endpoints_generation = 0;
+  uint8_t endpoints_count = 0;
+  uint8_t current_endpoint = 0;
+  ServerEndpoint_t endpoints[SERVER_MAX_ENDPOINTS];
+
+  ServerHealth_t health;   // see CircuitBreaker.h
 } Server_t;
 
+// retries of the datagrams no ACK came for, "retransmission"
+typedef struct RetransmissionSettings {
+  uint32_t max_attempts = 4;        // retries of a datagram
+  uint32_t max_age_s = 120;         // since it was queued, an older one isn't retried anymore
+  uint32_t backoff_min_ms = 1000;   // doubled for each datagram the server left unacknowledged in a row
+  uint32_t backoff_max_ms = 30000;
+  uint32_t max_per_s = 50;          // retries sent to each server, bounds the backhaul load; 0 means no limit
+} RetransmissionSettings_t;
+
+// classes of the packets queued for the servers, the first ones go first
+typedef enum PriorityClass {
+  PRIORITY_CRITICAL = 0,   // join requests and confirmed uplinks, a device is waiting for the answer
+  PRIORITY_NORMAL,         // the other uplinks
+  PRIORITY_BACKGROUND,     // stats and keepalives
+  PRIORITY_CLASSES
+} PriorityClass_t;
+
+// also their keys in "priority_classes"
+static const char* const PRIORITY_CLASS_NAMES[PRIORITY_CLASSES] = { "critical", "normal", "background" };
+
+// "priority_classes"
+typedef struct PrioritySettings {
+  bool strict = false;                                      // otherwise weighted round robin
+  uint32_t weights[PRIORITY_CLASSES] = { 8, 4, 1 };         // packets dequeued from a class in a row
+  uint32_t depths[PRIORITY_CLASSES] = { 128, 512, 64 };     // packets queued per class, rounded up to a power of 2
+} PrioritySettings_t;
+
+// optional packing of the frames received close together into a single PUSH_DATA, "uplink_coalescing"
+typedef struct UplinkCoalescingSettings {
+  uint32_t hold_ms = 0;        // how long the first frame may wait for the next ones, 0 disables it
+  uint32_t max_bytes = 1400;   // of the JSON, small enough for the datagram not to get fragmented
+} UplinkCoalescingSettings_t;
+
+// optional on-disk spool of the uplinks no server acknowledged, see UplinkSpool.h
+typedef struct UplinkSpoolSettings {
+  std::string path;            // empty means none
+  uint32_t size_kb = 1024;
+  uint32_t replay_per_s = 5;   // once their server acknowledges again
+} UplinkSpoolSettings_t;
+
 typedef struct PlatformInfo {
   LoRaChipSettings_t lora_chip_settings;  
 
@@ -92,6 +188,13 @@ typedef struct PlatformInfo {
   char __identifier[129];
 
   std::vector<Server_t> servers;
+
+  uint32_t packet_buffers;   // datagram buffers of PACKET_BUFFER_SIZE bytes, allocated once
+
+  RetransmissionSettings_t retransmission;
+  PrioritySettings_t priority_classes;
+  UplinkCoalescingSettings_t uplink_coalescing;
+  UplinkSpoolSettings_t uplink_spool;
 } PlatformInfo_t;
 
 typedef struct LoRaPacketTrafficStats {
@@ -114,4 +217,31 @@ typedef struct LoRaDataPkt {
   SpreadingFactor_t sf;
 } LoRaDataPkt_t;
 
+typedef struct DownlinkPacket {
+  bool initialised = false;
+
+  bool send_immediately;
+  std::time_t unix_epoch_timestamp;
+  uint32_t internal_ts_micros;
+
+  unsigned long concentrator_rf_chain;
+
+  float output_power_dbm = 0;
+  SpreadingFactor_t spreading_factor = SpreadingFactor_t::SF_ALL;
+  float carrier_frequency_mhz = 0;
+  float bandwidth_khz = 0;
+  CodingRate_t coding_rate = CodingRate_t::CR_MIN;
+  unsigned char preamble_length = 8;
+
+  unsigned long fsk_datarate_bps = 0;
+  unsigned long fsk_freq_deviation_hz = 0;
+
+  bool iq_polatization_inversion = true;
+
+  unsigned long payload_size = 0;
+  unsigned char payload[255];
+
+  bool disable_crc = true;
+} DownlinkPacket_t;
+
 #endif
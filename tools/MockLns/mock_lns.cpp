@@ -0,0 +1,545 @@
+/**
+ * A mock LoRa network server speaking the Semtech UDP v2 protocol, for
+ * end-to-end latency and throughput measurements of the packet forwarder.
+ * It acknowledges PUSH_DATA/PULL_DATA with a configurable delay and loss,
+ * answers each uplink with a PULL_RESP scheduled at an RX1 offset from its
+ * tmst, records every datagram with a nanosecond timestamp and prints a
+ * summary on exit.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <cmath>
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../../smtUdpPacketForwarder/rapidjson/document.h"
+#include "../../smtUdpPacketForwarder/rapidjson/stringbuffer.h"
+#include "../../smtUdpPacketForwarder/rapidjson/writer.h"
+#include "../../smtUdpPacketForwarder/base64/base64.h"
+
+#define PROTOCOL_VERSION 2
+#define PKT_PUSH_DATA 0
+#define PKT_PUSH_ACK  1
+#define PKT_PULL_DATA 2
+#define PKT_PULL_RESP 3
+#define PKT_PULL_ACK  4
+#define PKT_TX_ACK    5
+
+static volatile sig_atomic_t keep_running = 1;
+
+struct Options
+{
+	uint16_t port = 1700;
+	uint32_t ack_delay_us = 0;
+	double ack_loss = 0.0;
+	uint32_t rx1_offset_us = 1000000;
+	double downlink_ratio = 1.0;
+	uint32_t downlink_size = 12;
+	uint32_t duration_s = 0;
+	uint32_t seed = 1;
+	uint32_t deadline_tolerance_us = 1000;
+	std::string record_file;
+	std::string sim_tx_log;
+};
+
+struct PendingSend
+{
+	int64_t due_ns;
+	std::vector<uint8_t> datagram;
+	struct sockaddr_in dest;
+
+	bool operator<(const PendingSend &other) const
+	{ return due_ns > other.due_ns; } // earliest first in std::priority_queue
+};
+
+struct SentDownlink
+{
+	uint32_t target_tmst;
+	int64_t sent_ns;
+	bool acked;
+};
+
+struct Counters
+{
+	uint64_t datagrams_rx = 0;
+	uint64_t datagrams_tx = 0;
+	uint64_t push_data = 0;
+	uint64_t push_data_retries = 0;
+	uint64_t push_acks = 0;
+	uint64_t pull_data = 0;
+	uint64_t pull_acks = 0;
+	uint64_t acks_lost = 0;
+	uint64_t uplinks = 0;
+	uint64_t stats = 0;
+	uint64_t pull_resps = 0;
+	uint64_t tx_acks = 0;
+	uint64_t tx_acks_unmatched = 0;
+	std::map<std::string, uint64_t> tx_ack_results;
+};
+
+static int64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool parse_iso8601_ns(const char *s, int64_t *result)
+{
+	// "YYYY-MM-DDTHH:MM:SS[.ffffff]Z" as written by iso8601_utc_extended_now()
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+
+	const char *rest = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (rest == nullptr)
+	{ return false; }
+
+	int64_t frac_ns = 0;
+	if (*rest == '.')
+	{
+		int64_t scale = 100000000LL;
+		for (++rest; *rest >= '0' && *rest <= '9'; ++rest, scale /= 10)
+		{ frac_ns += (*rest - '0') * scale; }
+	}
+
+	*result = (int64_t) timegm(&tm) * 1000000000LL + frac_ns;
+	return true;
+}
+
+static int64_t percentile(std::vector<int64_t> &values, double p)
+{
+	if (values.empty())
+	{ return 0; }
+
+	size_t idx = (size_t) std::ceil(p / 100.0 * values.size());
+	if (idx > 0) --idx;
+	std::nth_element(values.begin(), values.begin() + idx, values.end());
+	return values[idx];
+}
+
+static void print_percentiles(const char *title, std::vector<int64_t> values, const char *unit)
+{
+	if (values.empty())
+	{
+		printf("  %s: no samples\n", title);
+		return;
+	}
+
+	printf("  %s (%zu samples): p50=%lld p90=%lld p99=%lld max=%lld %s\n", title, values.size(),
+		(long long) percentile(values, 50), (long long) percentile(values, 90),
+		(long long) percentile(values, 99), (long long) *std::max_element(values.begin(), values.end()), unit);
+}
+
+static std::vector<uint32_t> load_sim_tx_starts(const std::string &path)
+{
+	std::vector<uint32_t> result;
+
+	FILE *f = fopen(path.c_str(), "r");
+	if (f == nullptr)
+	{
+		perror(path.c_str());
+		return result;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), f) != nullptr)
+	{
+		char *end = nullptr;
+		unsigned long started_us = strtoul(line, &end, 10);
+		if (end != line && *end == ',') result.push_back((uint32_t) started_us);
+	}
+
+	fclose(f);
+	return result;
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage:\n%s [-h] [-p port] [-a ack_delay_us] [-l ack_loss] [-r rx1_offset_us] [-D downlink_ratio]\n"
+		"    [-S downlink_size] [-o record.csv] [-x sim_tx.csv] [-w tolerance_us] [-t seconds] [-s seed]\n"
+		"  -p UDP port to listen on (by default 1700)\n"
+		"  -a delay of the PUSH_ACK/PULL_ACK responses in microseconds (by default 0)\n"
+		"  -l ratio of the PUSH_ACK/PULL_ACK responses to drop, 0.0 - 1.0 (by default 0.0)\n"
+		"  -r RX1 offset from the uplink tmst in microseconds (by default 1000000)\n"
+		"  -D ratio of the uplinks answered with a downlink, 0.0 - 1.0 (by default 1.0)\n"
+		"  -S downlink payload size in bytes (by default 12)\n"
+		"  -o records every datagram in that CSV file\n"
+		"  -x transmission log of the simulated radio (sim.tx_log_file) to evaluate the downlink deadlines\n"
+		"  -w deadline tolerance in microseconds (by default 1000)\n"
+		"  -t stops after that many seconds (by default runs until interrupted)\n"
+		"  -s random seed (by default 1)\n", prog);
+}
+
+int main(int argc, char* argv[])
+{
+	Options opts;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:a:l:r:D:S:o:x:w:t:s:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': opts.port = (uint16_t) atoi(optarg); break;
+			case 'a': opts.ack_delay_us = (uint32_t) strtoul(optarg, nullptr, 10); break;
+			case 'l': opts.ack_loss = atof(optarg); break;
+			case 'r': opts.rx1_offset_us = (uint32_t) strtoul(optarg, nullptr, 10); break;
+			case 'D': opts.downlink_ratio = atof(optarg); break;
+			case 'S': opts.downlink_size = (uint32_t) strtoul(optarg, nullptr, 10); break;
+			case 'o': opts.record_file = optarg; break;
+			case 'x': opts.sim_tx_log = optarg; break;
+			case 'w': opts.deadline_tolerance_us = (uint32_t) strtoul(optarg, nullptr, 10); break;
+			case 't': opts.duration_s = (uint32_t) strtoul(optarg, nullptr, 10); break;
+			case 's': opts.seed = (uint32_t) strtoul(optarg, nullptr, 10); break;
+			case 'h':
+			default:
+				print_usage(argv[0]);
+				return (opt == 'h' ? 0 : 1);
+		}
+	}
+
+	if (opts.downlink_size > 255) opts.downlink_size = 255;
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock == -1)
+	{
+		perror("socket");
+		return 1;
+	}
+
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)); // kernel receive timestamps
+
+	struct sockaddr_in bind_addr;
+	memset(&bind_addr, 0, sizeof(bind_addr));
+	bind_addr.sin_family = AF_INET;
+	bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	bind_addr.sin_port = htons(opts.port);
+
+	if (bind(sock, (struct sockaddr*) &bind_addr, sizeof(bind_addr)) == -1)
+	{
+		perror("bind");
+		return 1;
+	}
+
+	FILE *record = nullptr;
+	if (!opts.record_file.empty())
+	{
+		record = fopen(opts.record_file.c_str(), "w");
+		if (record == nullptr)
+		{
+			perror(opts.record_file.c_str());
+			return 1;
+		}
+		fprintf(record, "realtime_ns,dir,peer,type,token,bytes\n");
+	}
+
+	auto signal_handler = [](int sig_num) { keep_running = 0; };
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	printf("Mock LNS listening on UDP port %u\n", (unsigned) opts.port);
+	fflush(stdout);
+
+	std::mt19937 rng(opts.seed);
+	std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+	std::priority_queue<PendingSend> pending;
+	std::map<uint16_t, SentDownlink> downlinks; // by PULL_RESP token
+	std::map<std::string, uint16_t> last_push_tokens;
+	std::vector<int64_t> uplink_latencies_us;
+	std::vector<int64_t> tx_ack_rtts_us;
+	Counters counters;
+
+	bool have_pull_addr = false;
+	struct sockaddr_in pull_addr;
+	uint16_t next_downlink_token = (uint16_t) rng();
+	uint32_t downlink_seq = 0;
+
+	auto record_datagram = [&](int64_t realtime_ns, const char *dir, const struct sockaddr_in &peer,
+			const uint8_t *datagram, size_t size) {
+		if (record == nullptr || size < 4)
+		{ return; }
+
+		char peer_ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &peer.sin_addr, peer_ip, sizeof(peer_ip));
+		fprintf(record, "%lld,%s,%s:%u,%u,%u,%zu\n", (long long) realtime_ns, dir, peer_ip,
+			(unsigned) ntohs(peer.sin_port), datagram[3], (unsigned) (datagram[1] << 8 | datagram[2]), size);
+	};
+
+	auto send_now = [&](const uint8_t *datagram, size_t size, const struct sockaddr_in &dest) {
+		if (sendto(sock, datagram, size, 0, (const struct sockaddr*) &dest, sizeof(dest)) == -1)
+		{ perror("sendto"); return; }
+
+		++counters.datagrams_tx;
+		record_datagram(clock_ns(CLOCK_REALTIME), "tx", dest, datagram, size);
+	};
+
+	auto queue_ack = [&](const uint8_t *request, uint8_t ack_type, const struct sockaddr_in &dest) {
+		if (chance(rng) < opts.ack_loss)
+		{
+			++counters.acks_lost;
+			return false;
+		}
+
+		PendingSend ack;
+		ack.due_ns = clock_ns(CLOCK_MONOTONIC) + (int64_t) opts.ack_delay_us * 1000;
+		ack.datagram = { PROTOCOL_VERSION, request[1], request[2], ack_type };
+		ack.dest = dest;
+		pending.push(ack);
+		return true;
+	};
+
+	auto send_downlink = [&](const rapidjson::Value &rxpk) {
+		if (!have_pull_addr || chance(rng) >= opts.downlink_ratio || !rxpk.HasMember("tmst"))
+		{ return; }
+
+		uint32_t target_tmst = rxpk["tmst"].GetUint() + opts.rx1_offset_us;
+
+		uint8_t payload[256];
+		payload[0] = 0x60; // unconfirmed data down
+		for (uint32_t i = 1; i < opts.downlink_size; ++i)
+		{ payload[i] = (uint8_t) (i < 5 ? downlink_seq >> (8 * (i - 1)) : rng()); }
+		++downlink_seq;
+
+		char b64[512];
+		bin_to_b64(payload, (int) opts.downlink_size, b64, sizeof(b64));
+
+		rapidjson::StringBuffer sb;
+		rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+		writer.StartObject();
+		writer.String("txpk");
+		writer.StartObject();
+		writer.String("imme"); writer.Bool(false);
+		writer.String("tmst"); writer.Uint(target_tmst);
+		writer.String("freq"); writer.Double(rxpk.HasMember("freq") ? rxpk["freq"].GetDouble() : 868.1);
+		writer.String("rfch"); writer.Uint(0);
+		writer.String("powe"); writer.Uint(14);
+		writer.String("modu"); writer.String("LORA");
+		writer.String("datr"); writer.String(rxpk.HasMember("datr") ? rxpk["datr"].GetString() : "SF7BW125");
+		writer.String("codr"); writer.String(rxpk.HasMember("codr") ? rxpk["codr"].GetString() : "4/5");
+		writer.String("ipol"); writer.Bool(true);
+		writer.String("size"); writer.Uint(opts.downlink_size);
+		writer.String("data"); writer.String(b64);
+		writer.EndObject();
+		writer.EndObject();
+
+		uint16_t token = next_downlink_token++;
+		std::vector<uint8_t> datagram = { PROTOCOL_VERSION, (uint8_t) (token >> 8), (uint8_t) token, PKT_PULL_RESP };
+		datagram.insert(datagram.end(), sb.GetString(), sb.GetString() + sb.GetSize());
+
+		send_now(datagram.data(), datagram.size(), pull_addr);
+		downlinks[token] = SentDownlink{ target_tmst, clock_ns(CLOCK_MONOTONIC), false };
+		++counters.pull_resps;
+	};
+
+	int64_t stop_ns = (opts.duration_s > 0 ? clock_ns(CLOCK_MONOTONIC) + (int64_t) opts.duration_s * 1000000000LL : 0);
+
+	uint8_t buffer[65536];
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+
+	while (keep_running)
+	{
+		int64_t now_ns = clock_ns(CLOCK_MONOTONIC);
+
+		while (!pending.empty() && pending.top().due_ns <= now_ns)
+		{
+			const PendingSend &due = pending.top();
+			send_now(due.datagram.data(), due.datagram.size(), due.dest);
+			pending.pop();
+		}
+
+		if (stop_ns != 0 && now_ns >= stop_ns)
+		{ break; }
+
+		int timeout_ms = 1000;
+		if (!pending.empty())
+		{ timeout_ms = (int) std::max<int64_t>(0, (pending.top().due_ns - now_ns + 999999) / 1000000); }
+
+		struct pollfd pfd = { sock, POLLIN, 0 };
+		int ready = poll(&pfd, 1, timeout_ms);
+		if (ready == -1 && errno != EINTR)
+		{
+			perror("poll");
+			break;
+		}
+		if (ready <= 0)
+		{ continue; }
+
+		struct sockaddr_in peer;
+		struct iovec iov = { buffer, sizeof(buffer) - 1 };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &peer;
+		msg.msg_namelen = sizeof(peer);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t size = recvmsg(sock, &msg, 0);
+		if (size < 4 || buffer[0] != PROTOCOL_VERSION)
+		{ continue; }
+
+		int64_t recv_realtime_ns = clock_ns(CLOCK_REALTIME);
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c))
+		{
+			if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS)
+			{
+				struct timespec ts;
+				memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+				recv_realtime_ns = (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+			}
+		}
+
+		++counters.datagrams_rx;
+		record_datagram(recv_realtime_ns, "rx", peer, buffer, (size_t) size);
+		buffer[size] = '\0';
+
+		uint16_t token = (uint16_t) (buffer[1] << 8 | buffer[2]);
+
+		switch (buffer[3])
+		{
+			case PKT_PUSH_DATA:
+			{
+				if (size < 12) break;
+				++counters.push_data;
+
+				char peer_key[32];
+				snprintf(peer_key, sizeof(peer_key), "%08x:%u", peer.sin_addr.s_addr, (unsigned) peer.sin_port);
+				auto last = last_push_tokens.find(peer_key);
+				bool retry = (last != last_push_tokens.end() && last->second == token);
+				last_push_tokens[peer_key] = token;
+				if (retry) ++counters.push_data_retries;
+
+				if (queue_ack(buffer, PKT_PUSH_ACK, peer)) ++counters.push_acks;
+
+				rapidjson::Document doc;
+				doc.Parse((const char*) buffer + 12);
+				if (doc.HasParseError() || !doc.IsObject())
+				{ break; }
+
+				if (doc.HasMember("stat")) ++counters.stats;
+				if (!doc.HasMember("rxpk") || !doc["rxpk"].IsArray() || retry)
+				{ break; }
+
+				for (const rapidjson::Value &rxpk : doc["rxpk"].GetArray())
+				{
+					++counters.uplinks;
+
+					int64_t radio_ns;
+					if (rxpk.HasMember("time") && parse_iso8601_ns(rxpk["time"].GetString(), &radio_ns))
+					{ uplink_latencies_us.push_back((recv_realtime_ns - radio_ns) / 1000); }
+
+					send_downlink(rxpk);
+				}
+				break;
+			}
+
+			case PKT_PULL_DATA:
+				++counters.pull_data;
+				pull_addr = peer;
+				have_pull_addr = true;
+				if (queue_ack(buffer, PKT_PULL_ACK, peer)) ++counters.pull_acks;
+				break;
+
+			case PKT_TX_ACK:
+			{
+				++counters.tx_acks;
+
+				auto sent = downlinks.find(token);
+				if (sent == downlinks.end() || sent->second.acked)
+				{
+					++counters.tx_acks_unmatched;
+					break;
+				}
+				sent->second.acked = true;
+				tx_ack_rtts_us.push_back((clock_ns(CLOCK_MONOTONIC) - sent->second.sent_ns) / 1000);
+
+				std::string result = "NONE";
+				rapidjson::Document doc;
+				if (size > 12) doc.Parse((const char*) buffer + 12);
+				if (size > 12 && !doc.HasParseError() && doc.IsObject() && doc.HasMember("txpk_ack") &&
+					doc["txpk_ack"].HasMember("error"))
+				{ result = doc["txpk_ack"]["error"].GetString(); }
+
+				++counters.tx_ack_results[result];
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+
+	if (record != nullptr) fclose(record);
+	close(sock);
+
+	printf("\nMock LNS summary:\n");
+	printf("  datagrams: %llu received, %llu sent\n",
+		(unsigned long long) counters.datagrams_rx, (unsigned long long) counters.datagrams_tx);
+	printf("  PUSH_DATA: %llu (%llu retries, %llu uplinks, %llu stats), PUSH_ACK rate %.2f%%\n",
+		(unsigned long long) counters.push_data, (unsigned long long) counters.push_data_retries,
+		(unsigned long long) counters.uplinks, (unsigned long long) counters.stats,
+		(counters.push_data > 0 ? 100.0 * counters.push_acks / counters.push_data : 0.0));
+	printf("  PULL_DATA: %llu, PULL_ACK rate %.2f%%, %llu ACKs dropped on purpose\n",
+		(unsigned long long) counters.pull_data,
+		(counters.pull_data > 0 ? 100.0 * counters.pull_acks / counters.pull_data : 0.0),
+		(unsigned long long) counters.acks_lost);
+
+	print_percentiles("radio to server latency", uplink_latencies_us, "us");
+
+	printf("  PULL_RESP: %llu sent, %llu TX_ACKs (%llu unmatched), TX_ACK rate %.2f%%\n",
+		(unsigned long long) counters.pull_resps, (unsigned long long) counters.tx_acks,
+		(unsigned long long) counters.tx_acks_unmatched,
+		(counters.pull_resps > 0 ? 100.0 * (counters.tx_acks - counters.tx_acks_unmatched) / counters.pull_resps : 0.0));
+	for (const auto &result : counters.tx_ack_results)
+	{ printf("    %s: %llu\n", result.first.c_str(), (unsigned long long) result.second); }
+	print_percentiles("PULL_RESP to TX_ACK", tx_ack_rtts_us, "us");
+
+	if (!opts.sim_tx_log.empty())
+	{
+		std::vector<uint32_t> starts = load_sim_tx_starts(opts.sim_tx_log);
+		std::vector<int64_t> errors_us;
+		uint64_t hits = 0;
+
+		for (const auto &sent : downlinks)
+		{
+			int64_t best = INT64_MAX;
+			for (uint32_t started_us : starts)
+			{
+				int64_t error_us = (int32_t) (started_us - sent.second.target_tmst);
+				if (std::llabs(error_us) < std::llabs(best)) best = error_us;
+			}
+
+			if (best == INT64_MAX)
+			{ continue; }
+
+			errors_us.push_back(std::llabs(best));
+			if (std::llabs(best) <= (int64_t) opts.deadline_tolerance_us) ++hits;
+		}
+
+		printf("  downlink deadline hit-rate (+-%u us): %.2f%% of %zu\n", opts.deadline_tolerance_us,
+			(downlinks.empty() ? 0.0 : 100.0 * hits / downlinks.size()), downlinks.size());
+		print_percentiles("downlink start error", errors_us, "us");
+	}
+
+	fflush(stdout);
+	return 0;
+}